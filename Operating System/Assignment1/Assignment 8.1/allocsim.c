@@ -0,0 +1,338 @@
+/* Filename: allocsim.c */
+
+/* Allocation workload simulator for the block allocator in solution.c.
+   A trace of allocations and frees (sizes in blocks) is generated from a
+   seed, or read from a file, and replayed on a fresh device under one
+   placement policy. Only the bitmap side of the allocator runs (no data
+   blocks are written), so the timings are the allocator's own. The same
+   trace and seed give the same requests under every policy.
+
+   Build: cc -O2 -pthread -o allocsim allocsim.c
+   Usage: ./allocsim <file> <no_of_blocks> <trace> <policy> [ops] [seed] [max_run]
+          ./allocsim -w <trace_file> <no_of_blocks> <trace> [ops] [seed] [max_run]
+
+   trace:  uniform  sizes 1..max_run, random frees
+           bursty   bursts of allocations alternating with bursts of random frees
+           log      sizes 1..max_run, the oldest allocation is freed first
+           mixed    95% small (1..4 blocks), 5% large (max_run/2..max_run), random frees
+           @path    a recorded trace: lines "a <id> <blocks>" and "f <id>"
+   policy: first, next, best (get_freeblocks policies on the bitmap),
+           aligned (FIT_BUDDY: sizes rounded up to a power of two and
+           placed on a multiple of it, still found in the bitmap) or
+           buddy (a device in buddy mode, allocating through its tree)
+
+   The generated traces keep about 70% of the device allocated (bursty
+   swings up to 90%). -w writes the trace to trace_file instead of
+   replaying it, for replaying later with @trace_file.
+
+   Twenty times during the replay a sample line shows the device:
+     op=<i> used_pct=<p> largest_free=<blocks> frag=<f> internal=<blocks> failed=<n>
+   frag is the external fragmentation index 1 - largest_free / free blocks
+   (0 when all free space is one run; in buddy mode the free space is that
+   of the tree); internal counts the blocks added by rounding (aligned and
+   buddy); failed counts allocations that found no run.
+   The last line sums up:
+     ops=<n> ns=<n> ops_per_s=<r> p50_ns=<n> p90_ns=<n> p99_ns=<n> p999_ns=<n> failed=<n> frag=<f> */
+
+#define main solution_demo_main
+#include "solution.c"
+#undef main
+
+#include <time.h>
+
+typedef struct {
+    char op;    // 'a' allocate, 'f' free
+    int id;     // allocation the event refers to
+    int len;    // blocks requested ('a' only)
+} event_t;
+
+typedef struct {
+    event_t *ev;
+    int count, cap;
+    int ids;    // allocation ids are 0 .. ids-1
+} trace_t;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int trace_add(trace_t *t, char op, int id, int len)
+{
+    if (t->count == t->cap) {
+        int cap = t->cap ? t->cap * 2 : 1024;
+        event_t *grown = realloc(t->ev, cap * sizeof(event_t));
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failed\n");
+            return -1;
+        }
+        t->ev = grown;
+        t->cap = cap;
+    }
+    t->ev[t->count++] = (event_t){ op, id, len };
+    if (op == 'a' && id >= t->ids)
+        t->ids = id + 1;
+    return 0;
+}
+
+// Blocks requested by one allocation of the given trace kind
+static int trace_size(const char *kind, int max_run)
+{
+    if (strcmp(kind, "mixed") == 0) {
+        if (rand() % 100 < 95)
+            return 1 + rand() % 4;
+        return max_run / 2 + 1 + rand() % (max_run - max_run / 2);
+    }
+    return 1 + rand() % max_run;
+}
+
+// Generates 'ops' events of a synthetic trace for a device of n blocks
+static int trace_generate(trace_t *t, const char *kind, int n, int ops, unsigned seed, int max_run)
+{
+    int bursty = strcmp(kind, "bursty") == 0, fifo = strcmp(kind, "log") == 0;
+    if (!bursty && !fifo && strcmp(kind, "uniform") != 0 && strcmp(kind, "mixed") != 0) {
+        fprintf(stderr, "allocsim: unknown trace %s\n", kind);
+        return -1;
+    }
+    // Live allocations are live[head..nlive), oldest first; a random free
+    // swaps its victim to the head first, so both kinds of free pop the head
+    int *live = malloc(sizeof(int) * ops);
+    int *lens = malloc(sizeof(int) * ops);
+    if (!live || !lens) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+    srand(seed);
+    long target = (long)n * 7 / 10, cap = (long)n * 9 / 10, live_blocks = 0;
+    int head = 0, nlive = 0, burst = 0, burst_alloc = 0;
+    for (int i = 0; i < ops; i++) {
+        int len = trace_size(kind, max_run);
+        int alloc;
+        if (bursty) {
+            if (burst == 0) {
+                burst_alloc = !burst_alloc;
+                burst = 64 + rand() % 960;
+            }
+            burst--;
+            alloc = burst_alloc ? live_blocks + len <= cap : head == nlive;
+        } else {
+            alloc = head == nlive || live_blocks + len <= target;
+        }
+
+        if (alloc) {
+            lens[nlive] = len;
+            live[nlive] = nlive;    // ids are handed out in order
+            nlive++;
+            live_blocks += len;
+            if (trace_add(t, 'a', nlive - 1, len) < 0)
+                return -1;
+        } else {
+            if (!fifo) {
+                int k = head + rand() % (nlive - head);
+                int tmp = live[k];
+                live[k] = live[head];
+                live[head] = tmp;
+            }
+            int id = live[head++];
+            live_blocks -= lens[id];
+            if (trace_add(t, 'f', id, 0) < 0)
+                return -1;
+        }
+    }
+    free(live);
+    free(lens);
+    return 0;
+}
+
+// Reads a recorded trace: "a <id> <blocks>" and "f <id>" lines
+static int trace_read(trace_t *t, const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror("fopen trace");
+        return -1;
+    }
+    char op;
+    int id, len = 0;
+    while (fscanf(fp, " %c %d", &op, &id) == 2) {
+        if ((op != 'a' && op != 'f') || id < 0 ||
+            (op == 'a' && (fscanf(fp, "%d", &len) != 1 || len <= 0))) {
+            fprintf(stderr, "allocsim: bad trace line %d\n", t->count + 1);
+            fclose(fp);
+            return -1;
+        }
+        if (trace_add(t, op, id, op == 'a' ? len : 0) < 0) {
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+static int trace_write(const trace_t *t, const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror("fopen trace");
+        return -1;
+    }
+    for (int i = 0; i < t->count; i++) {
+        if (t->ev[i].op == 'a')
+            fprintf(fp, "a %d %d\n", t->ev[i].id, t->ev[i].len);
+        else
+            fprintf(fp, "f %d\n", t->ev[i].id);
+    }
+    if (fclose(fp) != 0) {
+        perror("fclose trace");
+        return -1;
+    }
+    return 0;
+}
+
+// Longest free run on the device, from the free-extent index (the largest
+// free region of the tree in buddy mode)
+static int largest_free(dd_t *dd)
+{
+    if (dd->buddy)
+        return dd->buddy[1] ? 1 << (dd->buddy[1] - 1) : 0;
+    if (!dd->ix_ready) {
+        extents_free(&dd->ix);
+        if (extents_build(dd, &dd->ix) < 0)
+            return 0;
+        dd->ix_ready = 1;
+    }
+    int best = 0;
+    for (int i = 0; i < dd->ix.count; i++)
+        if (dd->ix.ext[i].len > best)
+            best = dd->ix.ext[i].len;
+    return best;
+}
+
+// 1 - largest free run / free blocks. In buddy mode the unused tails of
+// rounded regions ('internal') are not free.
+static double frag_index(dd_t *dd, long internal)
+{
+    long free_blocks = dd->sb->fbn - (dd->buddy ? internal : 0);
+    return free_blocks > 0 ? 1.0 - (double)largest_free(dd) / free_blocks : 0.0;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static int replay(const char *fname, int n, const trace_t *t, const char *policy)
+{
+    int buddy = strcmp(policy, "buddy") == 0;
+    int fit = strcmp(policy, "first") == 0 || buddy ? FIT_FIRST :
+              strcmp(policy, "next") == 0 ? FIT_NEXT :
+              strcmp(policy, "best") == 0 ? FIT_BEST :
+              strcmp(policy, "aligned") == 0 ? FIT_BUDDY : -1;
+    if (fit < 0) {
+        fprintf(stderr, "allocsim: policy must be first, next, best, aligned or buddy\n");
+        return 1;
+    }
+    if ((buddy ? init_File_dd_buddy(fname, 4096, n) : init_File_dd(fname, 4096, n)) != 0)
+        return 1;
+    dd_t *dd = dd_open(fname);
+    int *starts = malloc(sizeof(int) * (t->ids + 1));
+    int *sizes = malloc(sizeof(int) * (t->ids + 1));    // blocks asked of the allocator
+    int *waste = malloc(sizeof(int) * (t->ids + 1));    // blocks added by rounding
+    long long *lat = malloc(sizeof(long long) * (t->count + 1));
+    if (!dd || !starts || !sizes || !waste || !lat) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    for (int i = 0; i < t->ids; i++)
+        starts[i] = -1;
+
+    long failed = 0, internal = 0;
+    int every = t->count / 20 > 0 ? t->count / 20 : 1;
+    long long total = 0;
+    for (int i = 0; i < t->count; i++) {
+        const event_t *e = &t->ev[i];
+        long long start = now_ns();
+        if (e->op == 'a') {
+            int len = e->len, rounded = e->len;
+            if (fit == FIT_BUDDY || buddy)
+                for (rounded = 1; rounded < e->len; rounded *= 2)
+                    ;
+            if (fit == FIT_BUDDY)
+                len = rounded;      // buddy mode rounds inside the allocator
+            if (starts[e->id] >= 0) {
+                fprintf(stderr, "allocsim: id %d allocated twice\n", e->id);
+                return 1;
+            }
+            starts[e->id] = reserve_run(dd, len, fit);
+            sizes[e->id] = len;
+            waste[e->id] = rounded - e->len;
+            if (starts[e->id] < 0)
+                failed++;
+            else
+                internal += waste[e->id];
+        } else if (e->id < t->ids && starts[e->id] >= 0) {
+            release_run(dd, starts[e->id], sizes[e->id]);
+            starts[e->id] = -1;
+            internal -= waste[e->id];
+        }
+        lat[i] = now_ns() - start;
+        total += lat[i];
+
+        if ((i + 1) % every == 0 || i + 1 == t->count)
+            printf("op=%d used_pct=%.1f largest_free=%d frag=%.4f internal=%ld failed=%ld\n",
+                   i + 1, 100.0 * dd->sb->ubn / n, largest_free(dd), frag_index(dd, internal),
+                   internal, failed);
+    }
+
+    int bad = dd_check(dd);
+    double frag = frag_index(dd, internal);
+    if (dd_close(dd) < 0)
+        bad = 1;
+    qsort(lat, t->count, sizeof(long long), cmp_ll);
+    long long p[4] = { 0, 0, 0, 0 };
+    const int permille[4] = { 500, 900, 990, 999 };
+    for (int k = 0; k < 4 && t->count > 0; k++)
+        p[k] = lat[(long)(t->count - 1) * permille[k] / 1000];
+    printf("ops=%d ns=%lld ops_per_s=%.1f p50_ns=%lld p90_ns=%lld p99_ns=%lld p999_ns=%lld failed=%ld frag=%.4f\n",
+           t->count, total, total > 0 ? t->count / (total / 1e9) : 0.0,
+           p[0], p[1], p[2], p[3], failed, frag);
+    free(starts);
+    free(sizes);
+    free(waste);
+    free(lat);
+    return bad;
+}
+
+int main(int argc, char *argv[])
+{
+    int record = argc > 1 && strcmp(argv[1], "-w") == 0;
+    int base = 5;   // first optional argument, in both forms
+    if (argc < 5 || argc > base + 3) {
+        fprintf(stderr, "Usage: %s <file> <no_of_blocks> <trace> <policy> [ops] [seed] [max_run]\n", argv[0]);
+        fprintf(stderr, "       %s -w <trace_file> <no_of_blocks> <trace> [ops] [seed] [max_run]\n", argv[0]);
+        return 1;
+    }
+    const char *path = record ? argv[2] : argv[1];
+    int n = atoi(record ? argv[3] : argv[2]);
+    const char *kind = record ? argv[4] : argv[3];
+    int ops = argc > base ? atoi(argv[base]) : 100000;
+    unsigned seed = argc > base + 1 ? (unsigned)atoi(argv[base + 1]) : 42;
+    int max_run = argc > base + 2 ? atoi(argv[base + 2]) : 64;
+    if (n <= 0 || ops <= 0 || max_run <= 0) {
+        fprintf(stderr, "allocsim: blocks, ops and max_run must be positive\n");
+        return 1;
+    }
+
+    trace_t t = { NULL, 0, 0, 0 };
+    int ret = kind[0] == '@' ? trace_read(&t, kind + 1)
+                             : trace_generate(&t, kind, n, ops, seed, max_run);
+    if (ret < 0)
+        return 1;
+    ret = record ? (trace_write(&t, path) < 0) : replay(path, n, &t, argv[4]);
+    free(t.ev);
+    return ret;
+}
@@ -0,0 +1,389 @@
+/* Filename: bench.c */
+
+/* Benchmark harness for the block allocator in solution.c.
+   solution.c only ships a demo main(), so it is included here with that main
+   renamed and its functions are driven directly.
+
+   Build: cc -O2 -pthread -o bench bench.c
+   Usage: ./bench mkfs  <file> <block_size> <no_of_blocks>
+          ./bench churn <file> <block_size> <no_of_blocks> <ops> <seed> [file|handle]
+          ./bench search <no_of_blocks> <used_pct> <ops> <seed> <word|bit>
+          ./bench range <file> <block_size> <no_of_blocks> <run> <ops> <seed> <first|best|single>
+          ./bench threads <file> <no_of_blocks> <ops_per_thread> <threads> <seed>
+          ./bench check <file> <no_of_blocks> <rounds> <changes> <seed> <incremental|full|bit>
+
+   Each run prints one line: ops=<n> bytes=<n> ns=<n>
+   (fsbench.sh turns that into the common report format). */
+
+#define main solution_demo_main
+#include "solution.c"
+#undef main
+
+#include <time.h>
+#include <pthread.h>
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// mkfs: one init_File_dd of the whole device
+static int bench_mkfs(const char *fname, int bsize, int bno)
+{
+    long long start = now_ns();
+    if (init_File_dd(fname, bsize, bno) != 0)
+        return 1;
+    long long ns = now_ns() - start;
+    printf("ops=1 bytes=%lld ns=%lld\n", (long long)bsize * bno, ns);
+    return 0;
+}
+
+// churn: fill half the device, then alternate frees of random used
+// blocks with fresh allocations. api "file" goes through get_freeblock and
+// free_block (one open per call), "handle" through one dd_open'ed handle,
+// synced once at the end.
+static int bench_churn(const char *fname, int bsize, int bno, int ops, unsigned seed,
+                       const char *api)
+{
+    int handle = strcmp(api, "handle") == 0;
+    if (!handle && strcmp(api, "file") != 0) {
+        fprintf(stderr, "churn: api must be file or handle\n");
+        return 1;
+    }
+    if (init_File_dd(fname, bsize, bno) != 0)
+        return 1;
+    dd_t *dd = handle ? dd_open(fname) : NULL;
+    int *used = malloc(sizeof(int) * bno);
+    if (!used || (handle && !dd))
+        return 1;
+    int nused = 0;
+    for (int i = 0; i < bno / 2; i++) {
+        int b = handle ? dd_alloc(dd) : get_freeblock(fname);
+        if (b < 0)
+            break;
+        used[nused++] = b;
+    }
+
+    srand(seed);
+    long long start = now_ns();
+    for (int i = 0; i < ops; i++) {
+        if (nused > 0 && (i & 1)) {
+            int k = rand() % nused;
+            if (handle)
+                dd_free(dd, used[k]);
+            else
+                free_block(fname, used[k]);
+            used[k] = used[--nused];
+        } else {
+            int b = handle ? dd_alloc(dd) : get_freeblock(fname);
+            if (b >= 0)
+                used[nused++] = b;
+        }
+    }
+    if (handle && (dd_sync(dd) < 0 || dd_close(dd) < 0))
+        return 1;
+    long long ns = now_ns() - start;
+    free(used);
+    printf("ops=%d bytes=%lld ns=%lld\n", ops, (long long)ops * bsize, ns);
+    return check_fs(fname);
+}
+
+// search: the free-block search alone, on an in-memory bitmap with no
+// file I/O around it. The bitmap starts used_pct% full
+// (random blocks left free); each op frees one random used block and then
+// allocates one, so the occupancy stays put. "word" is get_freeblock's
+// search (next-fit cursor, 64-bit words, summary bitmap), "bit" the original
+// test_bit loop from block 0.
+static int bench_search(int bno, int used_pct, int ops, unsigned seed, const char *policy)
+{
+    int word = strcmp(policy, "word") == 0;
+    if (!word && strcmp(policy, "bit") != 0) {
+        fprintf(stderr, "search: policy must be word or bit\n");
+        return 1;
+    }
+    unsigned char *ub = calloc((bno + 63) / 64, 8);
+    uint64_t *full = calloc(((bno + 63) / 64 + 63) / 64, 8);
+    if (!ub || !full)
+        return 1;
+
+    srand(seed);
+    for (int i = 0; i < bno; i++)
+        if (rand() % 100 < used_pct)
+            mark_used(ub, full, bno, i);
+
+    int next = 0;
+    long long start = now_ns();
+    for (int i = 0; i < ops; i++) {
+        int victim = rand() % bno;
+        if (test_bit(ub, victim))
+            mark_free(ub, full, victim);
+
+        int b = -1;
+        if (word) {
+            b = find_free_bit(ub, full, bno, next);
+        } else {
+            for (int k = 0; k < bno; k++) {
+                if (!test_bit(ub, k)) {
+                    b = k;
+                    break;
+                }
+            }
+        }
+        if (b < 0)
+            break;
+        mark_used(ub, full, bno, b);
+        next = b + 1 < bno ? b + 1 : 0;
+    }
+    long long ns = now_ns() - start;
+    free(ub);
+    free(full);
+    printf("ops=%d bytes=0 ns=%lld\n", ops, ns);
+    return 0;
+}
+
+// range: fill the device to about half with runs of 1..run blocks, then
+// each op frees a random held run and allocates a new one. "first" and
+// "best" use get_freeblocks/free_blocks, one call per run; "single" does
+// the same work a block at a time with get_freeblock/free_block (its runs
+// need not be contiguous, so it keeps every block number).
+typedef struct {
+    const char *fname;
+    int single, fit, run;
+    int nruns;
+    int *starts, *lens;  // held runs
+    int *blocks;         // single: blocks of held run k at blocks[k * run]
+} range_state_t;
+
+static int range_take(range_state_t *st, int len)
+{
+    int k = st->nruns;
+    if (st->single) {
+        for (int j = 0; j < len; j++) {
+            if ((st->blocks[k * st->run + j] = get_freeblock(st->fname)) < 0) {
+                for (; j > 0; j--)
+                    free_block(st->fname, st->blocks[k * st->run + j - 1]);
+                return -1;
+            }
+        }
+    } else if (get_freeblocks(st->fname, len, &st->starts[k], st->fit) != 0) {
+        return -1;
+    }
+    st->lens[st->nruns++] = len;
+    return 0;
+}
+
+static void range_drop(range_state_t *st, int k)
+{
+    int last = --st->nruns;
+    if (st->single) {
+        for (int j = 0; j < st->lens[k]; j++)
+            free_block(st->fname, st->blocks[k * st->run + j]);
+        memcpy(&st->blocks[k * st->run], &st->blocks[last * st->run], sizeof(int) * st->run);
+    } else {
+        free_blocks(st->fname, st->starts[k], st->lens[k]);
+    }
+    st->starts[k] = st->starts[last];
+    st->lens[k] = st->lens[last];
+}
+
+static int bench_range(const char *fname, int bsize, int bno, int run, int ops,
+                       unsigned seed, const char *policy)
+{
+    range_state_t st = {
+        .fname = fname,
+        .single = strcmp(policy, "single") == 0,
+        .fit = strcmp(policy, "best") == 0 ? FIT_BEST : FIT_FIRST,
+        .run = run,
+    };
+    if (!st.single && st.fit == FIT_FIRST && strcmp(policy, "first") != 0) {
+        fprintf(stderr, "range: policy must be first, best or single\n");
+        return 1;
+    }
+    if (run < 1 || init_File_dd(fname, bsize, bno) != 0)
+        return 1;
+    int max_runs = bno / 2 + 1;
+    st.starts = malloc(sizeof(int) * max_runs);
+    st.lens = malloc(sizeof(int) * max_runs);
+    st.blocks = st.single ? malloc(sizeof(int) * (long)run * max_runs) : NULL;
+    if (!st.starts || !st.lens || (st.single && !st.blocks))
+        return 1;
+
+    srand(seed);
+    for (int held = 0; held < bno / 2 && st.nruns < max_runs; ) {
+        int len = 1 + rand() % run;
+        if (range_take(&st, len) != 0)
+            break;
+        held += len;
+    }
+
+    long long moved = 0;
+    long long start = now_ns();
+    for (int i = 0; i < ops; i++) {
+        if (st.nruns > 0)
+            range_drop(&st, rand() % st.nruns);
+        int len = 1 + rand() % run;
+        if (range_take(&st, len) == 0)
+            moved += len;
+    }
+    long long ns = now_ns() - start;
+    free(st.starts);
+    free(st.lens);
+    free(st.blocks);
+    printf("ops=%d bytes=%lld ns=%lld\n", ops, moved * bsize, ns);
+    return check_fs(fname);
+}
+
+// threads: dd_claim/dd_release on one shared handle. Each thread does
+// ops_per_thread operations, alternating claims with releases of random
+// blocks it holds, so it keeps about a quarter of its share of the device.
+// Run with 1, 2, 4, ... threads to see how throughput scales.
+typedef struct {
+    dd_t *dd;
+    int thread, nthreads, ops;
+    unsigned seed;
+    pthread_barrier_t *go;
+    int *held;
+    int nheld;
+} worker_t;
+
+static void *threads_worker(void *arg)
+{
+    worker_t *wk = arg;
+    dd_cursor_t c;
+    dd_cursor_init(wk->dd, &c, wk->thread, wk->nthreads);
+    pthread_barrier_wait(wk->go);
+    for (int i = 0; i < wk->ops; i++) {
+        if (wk->nheld > 0 && (i & 1)) {
+            int k = rand_r(&wk->seed) % wk->nheld;
+            dd_release(wk->dd, &c, wk->held[k]);
+            wk->held[k] = wk->held[--wk->nheld];
+        } else {
+            int b = dd_claim(wk->dd, &c);
+            if (b >= 0)
+                wk->held[wk->nheld++] = b;
+        }
+    }
+    return NULL;
+}
+
+static int bench_threads(const char *fname, int bno, int ops, int nthreads, unsigned seed)
+{
+    if (nthreads < 1 || ops < 1 || init_File_dd(fname, 4096, bno) != 0)
+        return 1;
+    dd_t *dd = dd_open(fname);
+    pthread_t *tids = malloc(sizeof(pthread_t) * nthreads);
+    worker_t *wk = calloc(nthreads, sizeof(worker_t));
+    if (!dd || !tids || !wk)
+        return 1;
+    pthread_barrier_t go;
+    pthread_barrier_init(&go, NULL, nthreads + 1);
+    for (int t = 0; t < nthreads; t++) {
+        wk[t] = (worker_t){ dd, t, nthreads, ops, seed + t, &go, malloc(sizeof(int) * ops), 0 };
+        if (!wk[t].held || pthread_create(&tids[t], NULL, threads_worker, &wk[t]) != 0)
+            return 1;
+    }
+
+    pthread_barrier_wait(&go);
+    long long start = now_ns();
+    for (int t = 0; t < nthreads; t++)
+        pthread_join(tids[t], NULL);
+    long long ns = now_ns() - start;
+
+    // Every block claimed and not released must be marked, exactly once
+    long held = 0;
+    for (int t = 0; t < nthreads; t++) {
+        held += wk[t].nheld;
+        free(wk[t].held);
+    }
+    int bad = dd_check(dd) != 0 || dd->sb->ubn != held;
+    if (dd_sync(dd) < 0 || dd_close(dd) < 0)
+        bad = 1;
+    pthread_barrier_destroy(&go);
+    free(tids);
+    free(wk);
+    printf("ops=%lld bytes=0 ns=%lld\n", (long long)ops * nthreads, ns);
+    return bad;
+}
+
+// check: dd_check on a half-used device after each round of 'changes'
+// random releases and claims. "incremental" is dd_check as it is (only the
+// pages changed since the last round are counted), "full" marks every page
+// changed first, "bit" counts every page with the original test_bit loop.
+static int bench_check(const char *fname, int bno, int rounds, int changes, unsigned seed,
+                       const char *mode)
+{
+    int full = strcmp(mode, "full") == 0, bit = strcmp(mode, "bit") == 0;
+    if (!full && !bit && strcmp(mode, "incremental") != 0) {
+        fprintf(stderr, "check: mode must be incremental, full or bit\n");
+        return 1;
+    }
+    if (init_File_dd(fname, 4096, bno) != 0)
+        return 1;
+    dd_t *dd = dd_open(fname);
+    if (!dd)
+        return 1;
+    dd_cursor_t c;
+    dd_cursor_init(dd, &c, 0, 1);
+    srand(seed);
+    for (int i = 0; i < bno; i++)
+        if (rand() % 2 == 0 && dd_claim(dd, &c) < 0)
+            break;
+    int bad = dd_check(dd);
+
+    long long ns = 0;
+    for (int r = 0; r < rounds && !bad; r++) {
+        for (int i = 0; i < changes; i++) {
+            dd_release(dd, &c, rand() % bno);
+            dd_claim(dd, &c);
+        }
+        fold_counters(dd);
+        long long start = now_ns();
+        if (bit) {
+            long used = 0;
+            for (int pno = 0; pno < dd->sb->pages; pno++)
+                for (int i = 0; i < page_blocks(dd->sb, pno); i++)
+                    used += test_bit(page_bits(dd, pno), i);
+            bad = used != dd->sb->ubn;
+        } else {
+            if (full)
+                memset(dd->page_dirty, 0xFF, (dd->sb->pages + 63) / 64 * sizeof(uint64_t));
+            bad = dd_check(dd);
+        }
+        ns += now_ns() - start;
+    }
+    if (dd_close(dd) < 0)
+        return 1;
+    printf("ops=%d bytes=%lld ns=%lld\n", rounds, (long long)rounds * ((bno + 7) / 8), ns);
+    return bad;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 5 && strcmp(argv[1], "mkfs") == 0)
+        return bench_mkfs(argv[2], atoi(argv[3]), atoi(argv[4]));
+    if ((argc == 7 || argc == 8) && strcmp(argv[1], "churn") == 0)
+        return bench_churn(argv[2], atoi(argv[3]), atoi(argv[4]), atoi(argv[5]),
+                           (unsigned)atoi(argv[6]), argc == 8 ? argv[7] : "file");
+    if (argc == 9 && strcmp(argv[1], "range") == 0)
+        return bench_range(argv[2], atoi(argv[3]), atoi(argv[4]), atoi(argv[5]),
+                           atoi(argv[6]), (unsigned)atoi(argv[7]), argv[8]);
+    if (argc == 7 && strcmp(argv[1], "search") == 0)
+        return bench_search(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]),
+                            (unsigned)atoi(argv[5]), argv[6]);
+    if (argc == 8 && strcmp(argv[1], "check") == 0)
+        return bench_check(argv[2], atoi(argv[3]), atoi(argv[4]), atoi(argv[5]),
+                           (unsigned)atoi(argv[6]), argv[7]);
+    if (argc == 7 && strcmp(argv[1], "threads") == 0)
+        return bench_threads(argv[2], atoi(argv[3]), atoi(argv[4]), atoi(argv[5]),
+                             (unsigned)atoi(argv[6]));
+
+    fprintf(stderr, "Usage: %s mkfs <file> <block_size> <no_of_blocks>\n", argv[0]);
+    fprintf(stderr, "       %s churn <file> <block_size> <no_of_blocks> <ops> <seed> [file|handle]\n", argv[0]);
+    fprintf(stderr, "       %s range <file> <block_size> <no_of_blocks> <run> <ops> <seed> <first|best|single>\n", argv[0]);
+    fprintf(stderr, "       %s search <no_of_blocks> <used_pct> <ops> <seed> <word|bit>\n", argv[0]);
+    fprintf(stderr, "       %s check <file> <no_of_blocks> <rounds> <changes> <seed> <incremental|full|bit>\n", argv[0]);
+    fprintf(stderr, "       %s threads <file> <no_of_blocks> <ops_per_thread> <threads> <seed>\n", argv[0]);
+    return 1;
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #define HEADER_SIZE 4096
 
@@ -10,10 +11,17 @@ int get_freeblock(const char *fname);
 int free_block(const char *fname, int bno);
 int check_fs(const char *fname);
 
-// Helper function to count the number of set bits in the bitmap
+// Helper function to count the number of set bits in the bitmap:
+// 64 bits at a time with popcount, then the last few bits one by one
 static int count_set_bits(const unsigned char *ub, int n) {
     int count = 0;
-    for (int i = 0; i < n; i++) {
+    int i = 0;
+    for (; i + 64 <= n; i += 64) {
+        uint64_t word;
+        memcpy(&word, ub + i / 8, sizeof(word));
+        count += __builtin_popcountll(word);
+    }
+    for (; i < n; i++) {
         int byte_idx = i / 8;
         int bit_idx = i % 8;
         if (ub[byte_idx] & (1 << bit_idx)) {
@@ -1,99 +1,254 @@
+#define _GNU_SOURCE             // O_DIRECT for BLOCKDEV=direct
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <errno.h>
+#include <fcntl.h>      // open()
+#include <unistd.h>     // ftruncate()
+#include <sys/mman.h>   // mmap(), msync(), munmap()
+#include <pthread.h>    // dd_check splits large bitmaps over threads
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>  // AVX2 / AVX-512 popcount for dd_check
+#endif
+#include "../blockdev.h"  // bd_open(), bd_pread(), bd_pwrite(): the shared image I/O layer
 
 // -----------------------------------------------
 // Constants
 // -----------------------------------------------
-#define METADATA_SIZE 4096      // First 4096 bytes reserved for superblock
-#define MAX_BLOCKS    2048      // For example, we allow up to 2048 blocks
-                                // (You can adapt this if needed)
+#define METADATA_SIZE 4096      // Size of one metadata page (superblock, bitmap pages)
+#define BITS_PER_PAGE (METADATA_SIZE * 8)   // blocks covered by one bitmap page
+#define SB_MAGIC      0x31384642            // "BF81": superblock of the paged layout
+#define MAX_PAGES     ((METADATA_SIZE - 32) * 8)    // bitmap pages the superblock can summarise
+#define MAX_BLOCKS    (MAX_PAGES * BITS_PER_PAGE)      // about a billion blocks
+#define FILL_BYTES    (1 << 20)     // largest buffer used to fill a run of data blocks
+#define WORDS_PER_PAGE (BITS_PER_PAGE / 64)
+#define DD_SHARDS     64            // used-block counter shards for dd_claim/dd_release
+#define CHECK_THREADS 16            // most threads dd_check recounts pages with
+#define CHECK_PAGES_PER_THREAD 32   // fewer changed pages than this per thread: fewer threads
+
+// Policies for get_freeblocks
+#define FIT_FIRST     0             // lowest run that is long enough
+#define FIT_BEST      1             // shortest run that is long enough
+#define FIT_NEXT      2             // first run long enough after the last one handed out
+#define FIT_BUDDY     3             // lowest run aligned to count rounded up to a power of two
 
 // -----------------------------------------------
 // Data Structures
 // -----------------------------------------------
+
+// Layout of the file:
+//   page 0                 superblock (METADATA_SIZE bytes)
+//   pages 1 .. pages       bitmap, BITS_PER_PAGE blocks per page
+//                          (bit set = block used, as before)
+//   then                   buddy_pages pages of buddy tree (buddy mode only)
+//   then                   n data blocks of s bytes
+// The superblock, the bitmap and the buddy tree are memory-mapped, so
+// only the pages a call touches are read and written back.
 #pragma pack(push, 1)
 typedef struct {
     int n;      // total number of data blocks
     int s;      // size of each data block (bytes)
     int ubn;    // number of used blocks
     int fbn;    // number of free blocks
-    // 'ub' is a bitmap array for up to MAX_BLOCKS
-    // Each bit in ub corresponds to one block: 1 = used, 0 = free
-    unsigned char ub[MAX_BLOCKS/8]; // 2048 blocks => 2048 bits => 256 bytes
+    int magic;  // SB_MAGIC
+    int pages;  // number of bitmap pages following the superblock
+    int next;   // next-fit cursor: get_freeblock starts looking here
+    int buddy_pages;    // buddy tree pages after the bitmap, 0 if not in buddy mode
+    // Summary bitmap: bit p is set when bitmap page p has no free block,
+    // so the search skips full pages without reading them
+    uint64_t full[MAX_PAGES / 64];
 } superblock_t;
 #pragma pack(pop)
 
+// Summary of one bitmap page's words, as superblock_t.full is of the
+// pages: bit w set when word w has no free block. Kept in memory only and
+// built the first time a handle touches the page.
+typedef struct {
+    int ready;
+    uint64_t full[BITS_PER_PAGE / 64 / 64];
+} page_summary_t;
+
+// A run of free blocks
+typedef struct {
+    int start;
+    int len;
+} extent_t;
+
+// Free-extent index: every free run on the device, in block order
+typedef struct {
+    extent_t *ext;
+    int count;
+    int cap;
+} extent_index_t;
+
+// One shard of the used-block counter, alone on its cache line so
+// threads updating different shards do not contend
+typedef struct {
+    long delta;
+    char pad[64 - sizeof(long)];
+} counter_shard_t;
+
+// An open device. The superblock and bitmap are used in place through
+// the mapping; dd_sync makes the changes durable.
+typedef struct {
+    int fd;
+    superblock_t *sb;           // the mapping starts with the superblock...
+    unsigned char *bitmap;      // ...followed by the bitmap pages
+    size_t map_len;
+    page_summary_t *sum;        // one per bitmap page
+    extent_index_t ix;          // built by the first range call, then kept up to date
+    int ix_ready;
+    counter_shard_t *shards;    // dd_claim/dd_release changes not yet in sb->ubn/fbn
+    int *page_used;             // used blocks per bitmap page, as of the last dd_check...
+    uint64_t *page_dirty;       // ...and bit p set when page p changed since then
+    unsigned char *buddy;       // buddy tree in the mapping, NULL if not in buddy mode
+    int buddy_top;              // order of its root: the tree has 1 << buddy_top leaves
+} dd_t;
+
+// Per-thread state for dd_claim/dd_release
+typedef struct {
+    int hint;   // bitmap word to look at first: where this thread last found a block
+    int shard;  // counter shard this thread updates
+} dd_cursor_t;
+
 // -----------------------------------------------
 // Function Prototypes
 // -----------------------------------------------
 int init_File_dd(const char *fname, int bsize, int bno);
+int init_File_dd_buddy(const char *fname, int bsize, int bno);
 int get_freeblock(const char *fname);
 int free_block(const char *fname, int bno);
 int check_fs(const char *fname);
+int get_freeblocks(const char *fname, int count, int *start, int policy);
+int free_blocks(const char *fname, int start, int count);
+
+// Handle API: the same operations on a device that stays open
+dd_t *dd_open(const char *fname);
+int dd_alloc(dd_t *dd);                     // like get_freeblock
+int dd_free(dd_t *dd, int bno);             // like free_block
+int dd_alloc_run(dd_t *dd, int count, int *start, int policy);  // like get_freeblocks
+int dd_free_run(dd_t *dd, int start, int count);                // like free_blocks
+int dd_check(dd_t *dd);                     // like check_fs
+int dd_sync(dd_t *dd);
+int dd_close(dd_t *dd);
+
+// Thread-safe allocation on a shared handle (bitmap and counters only)
+void dd_cursor_init(dd_t *dd, dd_cursor_t *c, int thread, int nthreads);
+int dd_claim(dd_t *dd, dd_cursor_t *c);
+int dd_release(dd_t *dd, dd_cursor_t *c, int bno);
 
 // Helper functions
-static int read_superblock(FILE *fp, superblock_t *sb);
-static int write_superblock(FILE *fp, const superblock_t *sb);
+static int init_device(const char *fname, int bsize, int bno, int buddy);
+static dd_t *dd_map(const char *fname, int writable);
+static int write_superblock(int fd, const superblock_t *sb);
+static unsigned char *page_bits(const dd_t *dd, int pno);
+static int page_blocks(const superblock_t *sb, int pno);
+static uint64_t *page_summary(dd_t *dd, int pno);
+static long block_offset(const superblock_t *sb, int bno);
+static int fill_blocks(dd_t *dd, int bno, int count, int byte);
+static long update_range(dd_t *dd, int start, int count, int used);
+static void fold_counters(dd_t *dd);
+static void mark_dirty(dd_t *dd, int pno);
+static int recount_pages(dd_t *dd);
 static void set_bit(unsigned char *bitmap, int bno);
 static void clear_bit(unsigned char *bitmap, int bno);
 static int test_bit(const unsigned char *bitmap, int bno);
+static uint64_t load_word(const unsigned char *bitmap, int nblocks, int w);
+static void mark_used(unsigned char *bitmap, uint64_t *full, int nblocks, int bno);
+static void mark_free(unsigned char *bitmap, uint64_t *full, int bno);
+static int next_clear_bit(const uint64_t *bits, int from, int to);
+static int find_free_bit(const unsigned char *bitmap, const uint64_t *full, int nblocks, int start);
 static int count_used_bits(const unsigned char *bitmap, int total_blocks);
+static void set_range(unsigned char *bitmap, uint64_t *full, int nblocks, int lo, int hi, int used);
+static int count_range(const unsigned char *bitmap, int nblocks, int lo, int hi);
+static int extents_build(dd_t *dd, extent_index_t *ix);
+static void extents_free(extent_index_t *ix);
+static int reserve_run(dd_t *dd, int count, int policy);
+static long release_run(dd_t *dd, int start, int count);
+static int extents_find(const extent_index_t *ix, int count, int policy, int from);
+static int extents_locate(const extent_index_t *ix, int bno);
+static int extents_take(extent_index_t *ix, int start, int len);
+static int extents_give(extent_index_t *ix, int start, int len);
+static long blocks_used(dd_t *dd, int start, int count);
+static int buddy_pages_for(int nblocks);
+static void buddy_build(dd_t *dd);
+static int buddy_take(dd_t *dd, int order);
+static void buddy_release(dd_t *dd, int start, int count);
+static int buddy_check(dd_t *dd, long node, int order);
+static int buddy_check_whole(const unsigned char *t, long node, int order);
 
 // -----------------------------------------------
 // 1) init_File_dd
 // -----------------------------------------------
 int init_File_dd(const char *fname, int bsize, int bno)
 {
-    // Compute total file size
-    // first 4096 bytes (metadata) + (bno * bsize)
-    long total_size = METADATA_SIZE + (long)bno * bsize;
+    return init_device(fname, bsize, bno, 0);
+}
 
-    // Open file (create if not exist, truncate to 0 length, then set size)
-    FILE *fp = fopen(fname, "wb+");
-    if (!fp) {
-        perror("fopen");
+// Creates a device that hands out runs through a buddy tree (see 9)
+int init_File_dd_buddy(const char *fname, int bsize, int bno)
+{
+    if (init_device(fname, bsize, bno, 1) < 0) {
         return -1;
     }
-
-    // Attempt to set the file to the required total size
-    // One approach: Seek to (total_size-1) and write a single 0 byte.
-    if (fseek(fp, total_size - 1, SEEK_SET) != 0) {
-        perror("fseek");
-        fclose(fp);
+    dd_t *dd = dd_open(fname);
+    if (!dd) {
         return -1;
     }
-    if (fputc(0, fp) == EOF) {
-        perror("fputc");
-        fclose(fp);
+    buddy_build(dd);
+    return dd_close(dd);
+}
+
+static int init_device(const char *fname, int bsize, int bno, int buddy)
+{
+    if (bno <= 0 || bno > MAX_BLOCKS || bsize <= 0) {
+        fprintf(stderr, "init_File_dd: need 1..%d blocks of at least 1 byte\n", MAX_BLOCKS);
         return -1;
     }
 
-    // Now file has the required size. Next, fill in the superblock.
+    // Now fill in the superblock.
     superblock_t sb;
     memset(&sb, 0, sizeof(sb));
-    sb.n   = bno;
-    sb.s   = bsize;
-    sb.ubn = 0;     // used blocks = 0
-    sb.fbn = bno;   // free blocks = n initially
-    // ub[] is already zeroed by memset, so all bits = 0 => all blocks free
+    sb.n     = bno;
+    sb.s     = bsize;
+    sb.ubn   = 0;     // used blocks = 0
+    sb.fbn   = bno;   // free blocks = n initially
+    sb.magic = SB_MAGIC;
+    sb.pages = (bno + BITS_PER_PAGE - 1) / BITS_PER_PAGE;
+    sb.buddy_pages = buddy ? buddy_pages_for(bno) : 0;
+    // full[] is already zeroed by memset, so no page is full
+
+    // Compute total file size
+    // superblock + bitmap pages + buddy tree pages + (bno * bsize)
+    long total_size = block_offset(&sb, bno);
+
+    // Open file (create if not exist, truncate to 0 length, then set size)
+    int fd = bd_open(fname, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
 
-    // Write the superblock to the first 4096 bytes
-    if (fseek(fp, 0, SEEK_SET) != 0) {
-        perror("fseek");
-        fclose(fp);
+    // Set the file to the required total size.
+    // The bitmap pages read back as zeros => all blocks free.
+    if (ftruncate(fd, total_size) != 0) {
+        perror("ftruncate");
+        bd_close(fd);
         return -1;
     }
-    if (fwrite(&sb, sizeof(sb), 1, fp) != 1) {
-        perror("fwrite");
-        fclose(fp);
+
+    // Write the superblock to the first page
+    if (write_superblock(fd, &sb) < 0) {
+        bd_close(fd);
         return -1;
     }
 
     // Done
-    fclose(fp);
+    if (bd_close(fd) < 0) {
+        perror("close");
+        return -1;
+    }
     return 0;
 }
 
@@ -102,209 +257,946 @@ int init_File_dd(const char *fname, int bsize, int bno)
 // -----------------------------------------------
 int get_freeblock(const char *fname)
 {
-    FILE *fp = fopen(fname, "r+b");
-    if (!fp) {
-        perror("fopen");
+    dd_t *dd = dd_open(fname);
+    if (!dd) {
         return -1;
     }
-
-    // Read superblock
-    superblock_t sb;
-    if (read_superblock(fp, &sb) < 0) {
-        fclose(fp);
+    int bno = dd_alloc(dd);
+    if (dd_close(dd) < 0) {
         return -1;
     }
+    return bno;
+}
 
-    // Find the first free block in the bitmap
-    int free_bno = -1;
-    for (int i = 0; i < sb.n; i++) {
-        if (!test_bit(sb.ub, i)) { // bit == 0 => free
-            free_bno = i;
-            break;
-        }
+// -----------------------------------------------
+// 3) free_block
+// -----------------------------------------------
+int free_block(const char *fname, int bno)
+{
+    dd_t *dd = dd_open(fname);
+    if (!dd) {
+        return -1;
     }
-
-    if (free_bno == -1) {
-        // No free block found
-        fclose(fp);
+    int freed = dd_free(dd, bno);
+    if (dd_close(dd) < 0) {
         return -1;
     }
+    return freed;
+}
 
-    // Mark that block as used
-    set_bit(sb.ub, free_bno);
-    sb.ubn += 1;
-    sb.fbn -= 1;
+// -----------------------------------------------
+// 4) check_fs
+// -----------------------------------------------
+int check_fs(const char *fname)
+{
+    dd_t *dd = dd_map(fname, 0);
+    if (!dd) {
+        return 1; // can't open => fail
+    }
+    int check = dd_check(dd);
+    dd_close(dd);
+    return check;
+}
 
-    // Write back the updated superblock
-    if (write_superblock(fp, &sb) < 0) {
-        fclose(fp);
+// -----------------------------------------------
+// 5) get_freeblocks
+// -----------------------------------------------
+// Allocates 'count' contiguous blocks in one call and stores the first
+// one in *start. policy is FIT_FIRST, FIT_BEST, FIT_NEXT or FIT_BUDDY.
+// Returns 0, or -1 if no free run is long enough.
+int get_freeblocks(const char *fname, int count, int *start, int policy)
+{
+    dd_t *dd = dd_open(fname);
+    if (!dd) {
         return -1;
     }
-
-    // Fill that block with 1's (0xFF) to show it's now used
-    // Calculate offset: 4096 + free_bno * s
-    long block_offset = METADATA_SIZE + (long)free_bno * sb.s;
-    if (fseek(fp, block_offset, SEEK_SET) != 0) {
-        perror("fseek");
-        fclose(fp);
+    int ret = dd_alloc_run(dd, count, start, policy);
+    if (dd_close(dd) < 0) {
         return -1;
     }
+    return ret;
+}
 
-    // Create a buffer of size s, filled with 0xFF
-    unsigned char *buf = (unsigned char*)malloc(sb.s);
-    if (!buf) {
-        fprintf(stderr, "Memory allocation failed\n");
-        fclose(fp);
+// -----------------------------------------------
+// 6) free_blocks
+// -----------------------------------------------
+// Frees blocks [start, start+count) in one call. Blocks in the range that
+// are already free are left alone. Returns how many blocks were freed, or
+// -1 on error.
+int free_blocks(const char *fname, int start, int count)
+{
+    dd_t *dd = dd_open(fname);
+    if (!dd) {
         return -1;
     }
-    memset(buf, 0xFF, sb.s);
-
-    if (fwrite(buf, sb.s, 1, fp) != 1) {
-        perror("fwrite block");
-        free(buf);
-        fclose(fp);
+    int freed = dd_free_run(dd, start, count);
+    if (dd_close(dd) < 0) {
         return -1;
     }
-
-    free(buf);
-    fclose(fp);
-
-    // Return the block number that was allocated
-    return free_bno;
+    return freed;
 }
 
 // -----------------------------------------------
-// 3) free_block
+// 7) Handle API
 // -----------------------------------------------
-int free_block(const char *fname, int bno)
+// Each call above opens the device, maps it, does one operation and
+// unmaps it again. A caller doing many operations opens a handle once:
+//
+//     dd_t *dd = dd_open("dd1");
+//     int bno = dd_alloc(dd);
+//     dd_free(dd, bno);
+//     dd_sync(dd);        // superblock and bitmap on disk
+//     dd_close(dd);
+//
+// The counters and bitmap are updated in place in the mapping.
+
+dd_t *dd_open(const char *fname)
+{
+    return dd_map(fname, 1);
+}
+
+int dd_alloc(dd_t *dd)
 {
-    FILE *fp = fopen(fname, "r+b");
-    if (!fp) {
-        perror("fopen");
+    superblock_t *sb = dd->sb;
+    if (dd->buddy) {
+        int bno = reserve_run(dd, 1, FIT_FIRST);
+        if (bno < 0 || fill_blocks(dd, bno, 1, 0xFF) < 0) {
+            return -1;
+        }
+        return bno;
+    }
+
+    // Find the next free block after the last one handed out (next-fit):
+    // the cursor's page first, then the following pages that are not
+    // full, wrapping around to page 0
+    int start = (sb->next >= 0 && sb->next < sb->n) ? sb->next : 0;
+    int first = start / BITS_PER_PAGE;
+    int pno = first;
+    int free_bno = -1;
+    for (int scanned = 0; pno >= 0 && scanned < sb->pages; scanned++) {
+        if (!(sb->full[pno / 64] >> (pno % 64) & 1)) {
+            uint64_t *full = page_summary(dd, pno);
+            int from = (pno == first) ? start % BITS_PER_PAGE : 0;
+            int b = find_free_bit(page_bits(dd, pno), full, page_blocks(sb, pno), from);
+            if (b >= 0) {
+                free_bno = pno * BITS_PER_PAGE + b;
+                break;
+            }
+            sb->full[pno / 64] |= 1ULL << (pno % 64);  // stale hint: it is full
+        }
+        pno = next_clear_bit(sb->full, pno + 1, sb->pages);
+        if (pno < 0) {
+            pno = next_clear_bit(sb->full, 0, first + 1);
+        }
+    }
+
+    if (free_bno == -1) {
+        // No free block found
         return -1;
     }
 
-    // Read superblock
-    superblock_t sb;
-    if (read_superblock(fp, &sb) < 0) {
-        fclose(fp);
+    // Mark that block as used
+    int nblocks = page_blocks(sb, pno);
+    uint64_t *full = page_summary(dd, pno);
+    mark_used(page_bits(dd, pno), full, nblocks, free_bno % BITS_PER_PAGE);
+    mark_dirty(dd, pno);
+    if (next_clear_bit(full, 0, (nblocks + 63) / 64) < 0) {
+        sb->full[pno / 64] |= 1ULL << (pno % 64);
+    }
+    sb->next = free_bno + 1;
+    sb->ubn += 1;
+    sb->fbn -= 1;
+    if (dd->ix_ready && extents_take(&dd->ix, free_bno, 1) < 0) {
+        dd->ix_ready = 0;
+        extents_free(&dd->ix);
+    }
+
+    // Fill that block with 1's (0xFF) to show it's now used
+    if (fill_blocks(dd, free_bno, 1, 0xFF) < 0) {
         return -1;
     }
 
+    // Return the block number that was allocated
+    return free_bno;
+}
+
+int dd_free(dd_t *dd, int bno)
+{
+    superblock_t *sb = dd->sb;
+
     // Check if bno is valid
-    if (bno < 0 || bno >= sb.n) {
+    if (bno < 0 || bno >= sb->n) {
         fprintf(stderr, "Invalid block number\n");
-        fclose(fp);
         return 0; // or -1
     }
 
     // Check if this block is currently used
-    if (!test_bit(sb.ub, bno)) {
+    int pno = bno / BITS_PER_PAGE;
+    if (!test_bit(page_bits(dd, pno), bno % BITS_PER_PAGE)) {
         // It's already free, so do nothing
-        fclose(fp);
         return 0;
     }
 
     // Mark the block as free
-    clear_bit(sb.ub, bno);
-    sb.ubn -= 1;
-    sb.fbn += 1;
-
-    // Update superblock on disk
-    if (write_superblock(fp, &sb) < 0) {
-        fclose(fp);
-        return -1;
+    mark_free(page_bits(dd, pno), page_summary(dd, pno), bno % BITS_PER_PAGE);
+    mark_dirty(dd, pno);
+    sb->full[pno / 64] &= ~(1ULL << (pno % 64));
+    sb->ubn -= 1;
+    sb->fbn += 1;
+    if (dd->ix_ready && extents_give(&dd->ix, bno, 1) < 0) {
+        dd->ix_ready = 0;
+        extents_free(&dd->ix);
+    }
+    if (dd->buddy) {
+        buddy_release(dd, bno, 1);
     }
 
     // Fill the block with zeros
-    long block_offset = METADATA_SIZE + (long)bno * sb.s;
-    if (fseek(fp, block_offset, SEEK_SET) != 0) {
-        perror("fseek");
-        fclose(fp);
+    if (fill_blocks(dd, bno, 1, 0x00) < 0) {
         return -1;
     }
 
-    unsigned char *buf = (unsigned char*)calloc(sb.s, 1); // s bytes of 0x00
-    if (!buf) {
-        fprintf(stderr, "Memory allocation failed\n");
-        fclose(fp);
+    return 1; // success
+}
+
+int dd_alloc_run(dd_t *dd, int count, int *start, int policy)
+{
+    int run = reserve_run(dd, count, policy);
+    if (run < 0) {
         return -1;
     }
 
-    if (fwrite(buf, sb.s, 1, fp) != 1) {
-        perror("fwrite block");
-        free(buf);
-        fclose(fp);
+    // Fill the blocks with 1's (0xFF) to show they're now used
+    if (fill_blocks(dd, run, count, 0xFF) < 0) {
         return -1;
     }
 
-    free(buf);
-    fclose(fp);
-
-    return 1; // success
+    *start = run;
+    return 0;
 }
 
-// -----------------------------------------------
-// 4) check_fs
-// -----------------------------------------------
-int check_fs(const char *fname)
+int dd_free_run(dd_t *dd, int start, int count)
 {
-    FILE *fp = fopen(fname, "rb");
-    if (!fp) {
-        perror("fopen");
-        return 1; // can't open => fail
+    superblock_t *sb = dd->sb;
+
+    // Check if the range is valid
+    if (start < 0 || count <= 0 || count > sb->n - start) {
+        fprintf(stderr, "Invalid block range\n");
+        return -1;
     }
 
-    superblock_t sb;
-    if (read_superblock(fp, &sb) < 0) {
-        fclose(fp);
-        return 1;
+    long freed = release_run(dd, start, count);
+
+    // Fill the blocks with zeros
+    if (fill_blocks(dd, start, count, 0x00) < 0) {
+        return -1;
     }
 
+    return (int)freed;
+}
+
+// Returns 0 if the device is consistent, 1 if not (as check_fs). The
+// first check on a handle counts every page; later ones only the pages
+// changed through the handle since.
+int dd_check(dd_t *dd)
+{
+    const superblock_t *sb = dd->sb;
+    fold_counters(dd);
+
     // Basic consistency checks
-    if ((sb.ubn + sb.fbn) != sb.n) {
-        fclose(fp);
+    if ((sb->ubn + sb->fbn) != sb->n) {
         return 1; // mismatch in used+free vs total
     }
 
-    // Count how many bits are set in sb.ub
-    int used_count = count_used_bits(sb.ub, sb.n);
-    if (used_count != sb.ubn) {
-        fclose(fp);
+    // Count how many bits are set, one bitmap page at a time. Only the
+    // pages changed since the last check are counted again; the others
+    // keep their count. A summary bit may only claim a page is full when
+    // it really is; a stale clear bit only costs search time.
+    if (recount_pages(dd) < 0) {
+        return 1;
+    }
+    long used_count = 0;
+    for (int pno = 0; pno < sb->pages; pno++) {
+        int used = dd->page_used[pno];
+        if ((sb->full[pno / 64] >> (pno % 64) & 1) && used != page_blocks(sb, pno)) {
+            return 1;
+        }
+        used_count += used;
+    }
+    if (used_count != sb->ubn) {
         return 1; // mismatch in actual used bits
     }
+    if (dd->buddy && buddy_check(dd, 1, dd->buddy_top) != 0) {
+        return 1; // buddy tree disagrees with the bitmap
+    }
 
     // If we pass all checks, we consider it consistent
-    fclose(fp);
     return 0; // 0 => no inconsistency
 }
 
+// Writes the superblock, the bitmap and the data blocks to disk
+int dd_sync(dd_t *dd)
+{
+    fold_counters(dd);
+    if (msync(dd->sb, dd->map_len, MS_SYNC) < 0) {
+        perror("msync");
+        return -1;
+    }
+    if (bd_sync(dd->fd) < 0) {
+        perror("fdatasync");
+        return -1;
+    }
+    return 0;
+}
+
+// Releases the handle. Changes are already in the page cache; call
+// dd_sync first to wait until they are on disk.
+int dd_close(dd_t *dd)
+{
+    int ret = 0;
+    fold_counters(dd);
+    if (munmap(dd->sb, dd->map_len) < 0) {
+        perror("munmap");
+        ret = -1;
+    }
+    if (bd_close(dd->fd) < 0) {
+        perror("close");
+        ret = -1;
+    }
+    extents_free(&dd->ix);
+    free(dd->page_used);
+    free(dd->page_dirty);
+    free(dd->shards);
+    free(dd->sum);
+    free(dd);
+    return ret;
+}
+
+// -----------------------------------------------
+// 8) Concurrent allocation
+// -----------------------------------------------
+// Several threads may share one handle through dd_claim and dd_release:
+//
+//     dd_cursor_t c;                      // one per thread
+//     dd_cursor_init(dd, &c, t, nthreads);
+//     int bno = dd_claim(dd, &c);
+//     dd_release(dd, &c, bno);
+//
+// A block is claimed by setting its bit with an atomic fetch-or on the
+// 64-bit bitmap word, so no lock is taken and two threads can never get
+// the same block. Each cursor remembers the word where its thread last
+// found a free block, and the cursors start spread over the device, so
+// threads mostly work on different cache lines. The used-block count is
+// kept in per-thread shards and added to sb->ubn/fbn by dd_check, dd_sync,
+// dd_close and dd_alloc_run.
+//
+// Unlike dd_alloc/dd_free these only change the bitmap and the counters;
+// the data blocks are left to the caller. They must not run at the same
+// time as the other dd_ calls on the same handle.
+
+// The bitmap is used as an array of 64-bit words, with bit i of word w
+// for block 64w+i: that matches the byte layout only on little-endian
+_Static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+               "dd_claim needs a little-endian bitmap word layout");
+
+// Spreads the cursors of nthreads threads evenly over the bitmap
+void dd_cursor_init(dd_t *dd, dd_cursor_t *c, int thread, int nthreads)
+{
+    long nwords = (dd->sb->n + 63) / 64;
+    c->hint = nthreads > 0 ? (int)(nwords * thread / nthreads) : 0;
+    c->shard = thread % DD_SHARDS;
+}
+
+// Returns a free block, now marked used, or -1 if every block is used
+int dd_claim(dd_t *dd, dd_cursor_t *c)
+{
+    superblock_t *sb = dd->sb;
+    if (dd->buddy) {
+        fprintf(stderr, "dd_claim: not available in buddy mode\n");
+        return -1;
+    }
+    uint64_t *words = (uint64_t *)dd->bitmap;   // pages follow each other
+    int nwords = (sb->n + 63) / 64;
+    int w = (c->hint >= 0 && c->hint < nwords) ? c->hint : 0;
+
+    for (int scanned = 0; scanned < nwords; ) {
+        // Skip the rest of a page the superblock says is full
+        int pno = w / WORDS_PER_PAGE;
+        if (__atomic_load_n(&sb->full[pno / 64], __ATOMIC_RELAXED) >> (pno % 64) & 1) {
+            int skip = WORDS_PER_PAGE - w % WORDS_PER_PAGE;
+            scanned += skip;
+            w = w + skip < nwords ? w + skip : 0;
+            continue;
+        }
+
+        // Blocks past the end of the device count as used
+        int nbits = sb->n - w * 64;
+        uint64_t valid = nbits < 64 ? ~(~0ULL << nbits) : ~0ULL;
+        uint64_t old = __atomic_load_n(&words[w], __ATOMIC_RELAXED);
+        for (uint64_t free_bits = ~old & valid; free_bits; free_bits = ~old & valid) {
+            uint64_t bit = free_bits & -free_bits;
+            old = __atomic_fetch_or(&words[w], bit, __ATOMIC_ACQ_REL);
+            if (!(old & bit)) {
+                // Ours. The summaries may now miss a full word or page,
+                // which only costs search time; the extent index is stale.
+                c->hint = w;
+                mark_dirty(dd, pno);
+                if (__atomic_load_n(&dd->ix_ready, __ATOMIC_RELAXED)) {
+                    __atomic_store_n(&dd->ix_ready, 0, __ATOMIC_RELAXED);
+                }
+                __atomic_fetch_add(&dd->shards[c->shard].delta, 1, __ATOMIC_RELAXED);
+                return w * 64 + __builtin_ctzll(bit);
+            }
+            // Another thread took that bit first: retry with the new word
+        }
+        scanned++;
+        w = w + 1 < nwords ? w + 1 : 0;
+    }
+    return -1;
+}
+
+// Frees block bno; returns 1, or 0 if it was already free (as dd_free)
+int dd_release(dd_t *dd, dd_cursor_t *c, int bno)
+{
+    superblock_t *sb = dd->sb;
+    if (dd->buddy) {
+        fprintf(stderr, "dd_release: not available in buddy mode\n");
+        return 0;
+    }
+    if (bno < 0 || bno >= sb->n) {
+        fprintf(stderr, "Invalid block number\n");
+        return 0;
+    }
+
+    uint64_t bit = 1ULL << (bno % 64);
+    uint64_t old = __atomic_fetch_and((uint64_t *)dd->bitmap + bno / 64, ~bit, __ATOMIC_ACQ_REL);
+    if (!(old & bit)) {
+        return 0;
+    }
+
+    // The word and its page have a free block again: no summary may say
+    // they are full
+    int pno = bno / BITS_PER_PAGE;
+    int w = bno % BITS_PER_PAGE / 64;
+    mark_dirty(dd, pno);
+    page_summary_t *ps = &dd->sum[pno];
+    if (__atomic_load_n(&ps->ready, __ATOMIC_ACQUIRE) &&
+        (__atomic_load_n(&ps->full[w / 64], __ATOMIC_RELAXED) >> (w % 64) & 1)) {
+        __atomic_fetch_and(&ps->full[w / 64], ~(1ULL << (w % 64)), __ATOMIC_RELAXED);
+    }
+    if (__atomic_load_n(&sb->full[pno / 64], __ATOMIC_RELAXED) >> (pno % 64) & 1) {
+        __atomic_fetch_and(&sb->full[pno / 64], ~(1ULL << (pno % 64)), __ATOMIC_RELAXED);
+    }
+    if (__atomic_load_n(&dd->ix_ready, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&dd->ix_ready, 0, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_sub(&dd->shards[c->shard].delta, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// -----------------------------------------------
+// 9) Buddy mode
+// -----------------------------------------------
+// A device made by init_File_dd_buddy hands out each run as a region of
+// 2^k blocks aligned to its size, with k the smallest order that fits.
+// Its buddy tree sits in the pages after the bitmap: node 1 covers the
+// device rounded up to a power of two, node i has halves 2i and 2i+1, and
+// the leaves (order 0) are nodes 2^top .. 2^(top+1)-1. Each node holds 1 +
+// the largest order still free below it, 0 if none, so a wholly free node
+// of order k holds k + 1; the nodes holding k + 1 are the free list of
+// order k. Allocating sets a node to 0 and leaves its subtree as it was;
+// freeing sets it back. Both then walk up to the root, splitting and
+// coalescing buddies, so each costs O(log n) however fragmented the
+// device is.
+//
+// The bitmap is kept as on any device (a run of count blocks sets count
+// bits; the rest of its region stays clear), so check_fs counts it as
+// before and dd_check also checks the tree against it. dd_alloc,
+// dd_alloc_run, dd_free and dd_free_run use the tree on such a device,
+// whatever the policy; a region goes back to the tree when its last used
+// block is freed. dd_claim and dd_release are not available.
+
+// Tree pages for a device of nblocks blocks
+static int buddy_pages_for(int nblocks)
+{
+    long leaves = 1;
+    while (leaves < nblocks) {
+        leaves *= 2;
+    }
+    return (int)((2 * leaves + METADATA_SIZE - 1) / METADATA_SIZE);
+}
+
+// Value of a node of the given order from its halves': coalesced when
+// both halves are wholly free
+static int buddy_value(int left, int right, int order)
+{
+    if (left == order && right == order) {
+        return order + 1;
+    }
+    return left > right ? left : right;
+}
+
+// Recomputes the ancestors of 'node' (of the given order) up to the root
+static void buddy_update(unsigned char *t, long node, int order)
+{
+    for (node /= 2, order++; node >= 1; node /= 2, order++) {
+        t[node] = buddy_value(t[2 * node], t[2 * node + 1], order);
+    }
+}
+
+// First block of the region under 'node' of the given order
+static int buddy_start(const dd_t *dd, long node, int order)
+{
+    return (int)((node << order) - (1L << dd->buddy_top));
+}
+
+// Builds the tree from the bitmap, one level at a time; blocks past the
+// end of the device count as used
+static void buddy_build(dd_t *dd)
+{
+    unsigned char *t = dd->buddy;
+    long leaves = 1L << dd->buddy_top;
+    for (long i = 0; i < leaves; i++) {
+        t[leaves + i] = (i < dd->sb->n && !test_bit(dd->bitmap, (int)i)) ? 1 : 0;
+    }
+    for (int order = 1; order <= dd->buddy_top; order++) {
+        for (long node = leaves >> order; node < (leaves >> order) * 2; node++) {
+            t[node] = buddy_value(t[2 * node], t[2 * node + 1], order);
+        }
+    }
+}
+
+// Allocates a region of 2^order blocks, the lowest free one reached by
+// halving from the root; returns its first block, or -1
+static int buddy_take(dd_t *dd, int order)
+{
+    unsigned char *t = dd->buddy;
+    if (order > dd->buddy_top || t[1] < order + 1) {
+        return -1;
+    }
+    long node = 1;
+    for (int k = dd->buddy_top; k > order; k--) {
+        node = t[2 * node] >= order + 1 ? 2 * node : 2 * node + 1;
+    }
+    t[node] = 0;
+    buddy_update(t, node, order);
+    return buddy_start(dd, node, order);
+}
+
+// The allocated region holding block bno: its node, with its order in
+// *order, or -1 if bno is in none. Below an allocated node the tree still
+// says "wholly free", so it is the first node at 0 on the way up; a node
+// at 0 whose halves are not wholly free is only full, not allocated.
+static long buddy_find(const dd_t *dd, int bno, int *order)
+{
+    const unsigned char *t = dd->buddy;
+    long node = (1L << dd->buddy_top) + bno;
+    for (int k = 0; node >= 1; node /= 2, k++) {
+        if (t[node] == 0) {
+            if (k > 0 && (t[2 * node] != k || t[2 * node + 1] != k)) {
+                return -1;
+            }
+            *order = k;
+            return node;
+        }
+    }
+    return -1;
+}
+
+// Gives back to the tree every region in [start, start+count) whose
+// blocks are now all free
+static void buddy_release(dd_t *dd, int start, int count)
+{
+    for (int b = start; b < start + count; ) {
+        int order;
+        long node = buddy_find(dd, b, &order);
+        if (node < 0) {
+            b++;
+            continue;
+        }
+        int lo = buddy_start(dd, node, order);
+        if (blocks_used(dd, lo, 1 << order) == 0) {
+            dd->buddy[node] = order + 1;
+            buddy_update(dd->buddy, node, order);
+        }
+        b = lo + (1 << order);
+    }
+}
+
+// Checks that every node under a free or allocated region still says
+// "wholly free", as buddy_take and buddy_find expect
+static int buddy_check_whole(const unsigned char *t, long node, int order)
+{
+    if (t[node] != order + 1) {
+        return 1;
+    }
+    return order > 0 && (buddy_check_whole(t, 2 * node, order - 1) ||
+                         buddy_check_whole(t, 2 * node + 1, order - 1));
+}
+
+// Checks the subtree under 'node' (of the given order): every node
+// follows buddy_value or is an allocation, an allocated region holds a
+// used block, and a free one holds none. Returns 0 if consistent.
+static int buddy_check(dd_t *dd, long node, int order)
+{
+    const unsigned char *t = dd->buddy;
+    int n = dd->sb->n;
+    long lo = buddy_start(dd, node, order);
+    if (lo >= n) {
+        return t[node] != 0;    // past the end: never free
+    }
+    int len = lo + (1L << order) <= n ? 1 << order : n - (int)lo;
+    if (order == 0) {
+        return t[node] != !test_bit(dd->bitmap, (int)lo);
+    }
+    int left = t[2 * node], right = t[2 * node + 1];
+    if (t[node] == 0 && left == order && right == order) {
+        return blocks_used(dd, (int)lo, len) == 0 ||
+               buddy_check_whole(t, 2 * node, order - 1) || buddy_check_whole(t, 2 * node + 1, order - 1);
+    }
+    if (t[node] != buddy_value(left, right, order)) {
+        return 1;
+    }
+    if (t[node] == order + 1) {
+        return blocks_used(dd, (int)lo, len) != 0 || buddy_check_whole(t, node, order);
+    }
+    return buddy_check(dd, 2 * node, order - 1) || buddy_check(dd, 2 * node + 1, order - 1);
+}
+
 // -----------------------------------------------
 // HELPER FUNCTIONS
 // -----------------------------------------------
-static int read_superblock(FILE *fp, superblock_t *sb)
+
+// Opens a device and maps its superblock and bitmap (read-only for
+// check_fs, so a read-only image can still be checked)
+static dd_t *dd_map(const char *fname, int writable)
 {
-    if (fseek(fp, 0, SEEK_SET) != 0) {
-        perror("fseek");
+    int fd = bd_open(fname, writable ? O_RDWR : O_RDONLY, 0);
+    if (fd < 0) {
+        perror("open");
+        return NULL;
+    }
+
+    // Validate the superblock before trusting its page count
+    superblock_t head;
+    if (bd_pread(fd, &head, sizeof(head), 0) != (ssize_t)sizeof(head)) {
+        perror("pread superblock");
+        bd_close(fd);
+        return NULL;
+    }
+    if (head.magic != SB_MAGIC || head.n <= 0 || head.s <= 0 ||
+        head.pages != (head.n + BITS_PER_PAGE - 1) / BITS_PER_PAGE ||
+        (head.buddy_pages != 0 && head.buddy_pages != buddy_pages_for(head.n))) {
+        fprintf(stderr, "Not a block device file (bad superblock)\n");
+        bd_close(fd);
+        return NULL;
+    }
+
+    dd_t *dd = calloc(1, sizeof(dd_t));
+    if (dd) {
+        dd->sum = calloc(head.pages, sizeof(page_summary_t));
+        dd->shards = aligned_alloc(64, DD_SHARDS * sizeof(counter_shard_t));
+        dd->page_used = calloc(head.pages, sizeof(int));
+        dd->page_dirty = calloc((head.pages + 63) / 64, sizeof(uint64_t));
+    }
+    if (!dd || !dd->sum || !dd->shards || !dd->page_used || !dd->page_dirty) {
+        fprintf(stderr, "Memory allocation failed\n");
+        if (dd) {
+            free(dd->page_used);
+            free(dd->page_dirty);
+            free(dd->shards);
+            free(dd->sum);
+            free(dd);
+        }
+        bd_close(fd);
+        return NULL;
+    }
+    dd->fd = fd;
+    dd->map_len = (size_t)(1 + head.pages + head.buddy_pages) * METADATA_SIZE;
+    void *map = mmap(NULL, dd->map_len, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                     MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        free(dd->page_used);
+        free(dd->page_dirty);
+        free(dd->shards);
+        free(dd->sum);
+        free(dd);
+        bd_close(fd);
+        return NULL;
+    }
+    memset(dd->shards, 0, DD_SHARDS * sizeof(counter_shard_t));
+    memset(dd->page_dirty, 0xFF, (head.pages + 63) / 64 * sizeof(uint64_t));  // nothing counted yet
+    dd->sb = map;
+    dd->bitmap = (unsigned char *)map + METADATA_SIZE;
+    if (head.buddy_pages) {
+        dd->buddy = (unsigned char *)map + (size_t)(1 + head.pages) * METADATA_SIZE;
+        while ((1L << dd->buddy_top) < head.n) {
+            dd->buddy_top++;
+        }
+    }
+    return dd;
+}
+
+static int write_superblock(int fd, const superblock_t *sb)
+{
+    if (bd_pwrite(fd, sb, sizeof(*sb), 0) != (ssize_t)sizeof(*sb)) {
+        perror("pwrite superblock");
         return -1;
     }
-    if (fread(sb, sizeof(*sb), 1, fp) != 1) {
-        perror("fread superblock");
+    return 0;
+}
+
+// Bits of bitmap page pno, in the mapping
+static unsigned char *page_bits(const dd_t *dd, int pno)
+{
+    return dd->bitmap + (size_t)pno * METADATA_SIZE;
+}
+
+// Blocks covered by bitmap page pno; the last page may be partial
+static int page_blocks(const superblock_t *sb, int pno)
+{
+    int left = sb->n - pno * BITS_PER_PAGE;
+    return left < BITS_PER_PAGE ? left : BITS_PER_PAGE;
+}
+
+// Word summary of bitmap page pno, built on first use
+static uint64_t *page_summary(dd_t *dd, int pno)
+{
+    page_summary_t *ps = &dd->sum[pno];
+    if (!ps->ready) {
+        const unsigned char *bits = page_bits(dd, pno);
+        int nblocks = page_blocks(dd->sb, pno);
+        memset(ps->full, 0, sizeof(ps->full));
+        for (int w = 0; w < (nblocks + 63) / 64; w++) {
+            if (~load_word(bits, nblocks, w) == 0) {
+                ps->full[w / 64] |= 1ULL << (w % 64);
+            }
+        }
+        ps->ready = 1;
+    }
+    return ps->full;
+}
+
+// Data blocks start after the superblock, the bitmap and the buddy tree
+static long block_offset(const superblock_t *sb, int bno)
+{
+    return (long)(1 + sb->pages + sb->buddy_pages) * METADATA_SIZE + (long)bno * sb->s;
+}
+
+// Fill data blocks [bno, bno+count) with the given byte value
+static int fill_blocks(dd_t *dd, int bno, int count, int byte)
+{
+    const superblock_t *sb = dd->sb;
+
+    // Create a buffer of up to FILL_BYTES (at least one block), filled with 'byte'
+    long chunk = (long)count * sb->s;
+    if (chunk > FILL_BYTES) {
+        chunk = sb->s > FILL_BYTES ? sb->s : FILL_BYTES / sb->s * sb->s;
+    }
+    unsigned char *buf = (unsigned char*)malloc(chunk);
+    if (!buf) {
+        fprintf(stderr, "Memory allocation failed\n");
         return -1;
     }
+    memset(buf, byte, chunk);
+
+    long offset = block_offset(sb, bno);
+    for (long left = (long)count * sb->s; left > 0; left -= chunk) {
+        long len = left < chunk ? left : chunk;
+        if (bd_pwrite(dd->fd, buf, len, offset) != len) {
+            perror("pwrite block");
+            free(buf);
+            return -1;
+        }
+        offset += len;
+    }
+    free(buf);
     return 0;
 }
 
-static int write_superblock(FILE *fp, const superblock_t *sb)
+// Marks blocks [start, start+count) used or free, one bitmap page at a
+// time, and keeps both summaries in step; returns how many blocks changed
+// state
+static long update_range(dd_t *dd, int start, int count, int used)
+{
+    superblock_t *sb = dd->sb;
+    long changed = 0;
+    int end = start + count;
+    for (int pno = start / BITS_PER_PAGE; pno < sb->pages && pno * BITS_PER_PAGE < end; pno++) {
+        unsigned char *bits = page_bits(dd, pno);
+        uint64_t *full = page_summary(dd, pno);
+        int nblocks = page_blocks(sb, pno);
+        int base = pno * BITS_PER_PAGE;
+        int lo = start > base ? start - base : 0;
+        int hi = end - base < nblocks ? end - base : nblocks;
+        int before = count_range(bits, nblocks, lo, hi);
+        set_range(bits, full, nblocks, lo, hi, used);
+        mark_dirty(dd, pno);
+        changed += used ? (hi - lo) - before : before;
+        if (!used) {
+            sb->full[pno / 64] &= ~(1ULL << (pno % 64));
+        } else if (next_clear_bit(full, 0, (nblocks + 63) / 64) < 0) {
+            sb->full[pno / 64] |= 1ULL << (pno % 64);
+        }
+    }
+    return changed;
+}
+
+// The bitmap side of dd_alloc_run: picks a free run of 'count' blocks by
+// policy from the free-extent index and marks it used; returns its start,
+// or -1. The data blocks are not touched.
+static int reserve_run(dd_t *dd, int count, int policy)
 {
-    if (fseek(fp, 0, SEEK_SET) != 0) {
-        perror("fseek");
+    superblock_t *sb = dd->sb;
+    fold_counters(dd);
+    if (count <= 0 || count > sb->fbn) {
+        return -1;
+    }
+
+    // Buddy mode: the smallest power-of-two region that holds the run
+    if (dd->buddy) {
+        int order = 0;
+        while ((1L << order) < count) {
+            order++;
+        }
+        int run = buddy_take(dd, order);
+        if (run < 0) {
+            return -1;
+        }
+        update_range(dd, run, count, 1);
+        sb->ubn += count;
+        sb->fbn -= count;
+        return run;
+    }
+
+    // Pick a run from the free-extent index
+    if (!dd->ix_ready) {
+        extents_free(&dd->ix);      // dd_claim/dd_release only mark it stale
+        if (extents_build(dd, &dd->ix) < 0) {
+            return -1;
+        }
+        dd->ix_ready = 1;
+    }
+    int run = extents_find(&dd->ix, count, policy, sb->next);
+    if (run < 0) {
         return -1;
     }
-    if (fwrite(sb, sizeof(*sb), 1, fp) != 1) {
-        perror("fwrite superblock");
+
+    // Mark the whole run as used, a page at a time
+    update_range(dd, run, count, 1);
+    if (extents_take(&dd->ix, run, count) < 0) {
+        dd->ix_ready = 0;
+        extents_free(&dd->ix);
+    }
+    sb->next = run + count < sb->n ? run + count : 0;
+    sb->ubn += count;
+    sb->fbn -= count;
+    return run;
+}
+
+// The bitmap side of dd_free_run, for a valid range; returns how many
+// blocks were freed
+static long release_run(dd_t *dd, int start, int count)
+{
+    superblock_t *sb = dd->sb;
+    long freed = update_range(dd, start, count, 0);
+    sb->ubn -= freed;
+    sb->fbn += freed;
+    if (dd->ix_ready && extents_give(&dd->ix, start, count) < 0) {
+        dd->ix_ready = 0;
+        extents_free(&dd->ix);
+    }
+    if (dd->buddy) {
+        buddy_release(dd, start, count);
+    }
+    return freed;
+}
+
+// Adds the used-block changes counted in the shards to the superblock
+static void fold_counters(dd_t *dd)
+{
+    long delta = 0;
+    for (int i = 0; i < DD_SHARDS; i++) {
+        delta += __atomic_exchange_n(&dd->shards[i].delta, 0, __ATOMIC_RELAXED);
+    }
+    if (delta != 0) {       // check_fs maps read-only and never has any
+        dd->sb->ubn += delta;
+        dd->sb->fbn -= delta;
+    }
+}
+
+// Notes that bitmap page pno changed, for the next dd_check (safe to call
+// from several threads)
+static void mark_dirty(dd_t *dd, int pno)
+{
+    uint64_t bit = 1ULL << (pno % 64);
+    if (!(__atomic_load_n(&dd->page_dirty[pno / 64], __ATOMIC_RELAXED) & bit)) {
+        __atomic_fetch_or(&dd->page_dirty[pno / 64], bit, __ATOMIC_RELAXED);
+    }
+}
+
+// Pages for the recount threads to share out, as batch_run does in 8.2
+typedef struct {
+    dd_t *dd;
+    const int *pages;
+    int count;
+    int next;           // next index to hand out
+} recount_t;
+
+static void *recount_worker(void *arg)
+{
+    recount_t *r = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED)) < r->count) {
+        int pno = r->pages[i];
+        r->dd->page_used[pno] = count_used_bits(page_bits(r->dd, pno), page_blocks(r->dd->sb, pno));
+    }
+    return NULL;
+}
+
+// Counts the used blocks of every page changed since the last call into
+// page_used, on up to CHECK_THREADS threads when there are many
+static int recount_pages(dd_t *dd)
+{
+    int npages = dd->sb->pages;
+    int *pages = malloc(sizeof(int) * npages);
+    if (!pages) {
+        fprintf(stderr, "Memory allocation failed\n");
         return -1;
     }
+    int count = 0;
+    for (int w = 0; w * 64 < npages; w++) {
+        for (uint64_t bits = dd->page_dirty[w]; bits; bits &= bits - 1) {
+            int pno = w * 64 + __builtin_ctzll(bits);
+            if (pno < npages) {
+                pages[count++] = pno;
+            }
+        }
+        dd->page_dirty[w] = 0;
+    }
+
+    recount_t r = { dd, pages, count, 0 };
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = count / CHECK_PAGES_PER_THREAD;
+    if (threads > cpus) {
+        threads = (int)cpus;
+    }
+    if (threads > CHECK_THREADS) {
+        threads = CHECK_THREADS;
+    }
+    pthread_t tids[CHECK_THREADS];
+    int started = 0;
+    for (; started < threads - 1; started++) {
+        if (pthread_create(&tids[started], NULL, recount_worker, &r) != 0) {
+            break;
+        }
+    }
+    recount_worker(&r);     // the calling thread counts too
+    for (int t = 0; t < started; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    free(pages);
     return 0;
 }
 
@@ -324,11 +1216,169 @@ static int test_bit(const unsigned char *bitmap, int bno)
     return (bitmap[bno / 8] & (1 << (bno % 8))) != 0;
 }
 
-// Count how many bits are set to 1 in the first 'total_blocks' bits
+// Bitmap word w (blocks 64w..64w+63, bit i = block 64w+i). Blocks past
+// the end of the device read as used, so they are never handed out.
+static uint64_t load_word(const unsigned char *bitmap, int nblocks, int w)
+{
+    uint64_t word = 0;
+    int nbits = nblocks - w * 64;
+    for (int i = 0; i < 8 && i * 8 < nbits; i++) {
+        word |= (uint64_t)bitmap[w * 8 + i] << (i * 8);
+    }
+    if (nbits < 64) {
+        word |= ~0ULL << nbits;
+    }
+    return word;
+}
+
+// set_bit plus the summary: sets word bno/64's summary bit once it fills up
+static void mark_used(unsigned char *bitmap, uint64_t *full, int nblocks, int bno)
+{
+    set_bit(bitmap, bno);
+    int w = bno / 64;
+    if (~load_word(bitmap, nblocks, w) == 0) {
+        full[w / 64] |= 1ULL << (w % 64);
+    }
+}
+
+// clear_bit plus the summary: word bno/64 now has a free block
+static void mark_free(unsigned char *bitmap, uint64_t *full, int bno)
+{
+    clear_bit(bitmap, bno);
+    int w = bno / 64;
+    full[w / 64] &= ~(1ULL << (w % 64));
+}
+
+// First clear bit in bits [from, to), 64 at a time; -1 if there is none
+static int next_clear_bit(const uint64_t *bits, int from, int to)
+{
+    for (int w = from / 64; w * 64 < to; w++) {
+        uint64_t cand = ~bits[w];
+        if (w * 64 < from) {
+            cand &= ~0ULL << (from - w * 64);
+        }
+        if (cand) {
+            int i = w * 64 + __builtin_ctzll(cand);
+            return i < to ? i : -1;
+        }
+    }
+    return -1;
+}
+
+// First free block in bitmap words [from, to), skipping words whose summary
+// bit says they are full; -1 if there is none
+static int scan_words(const unsigned char *bitmap, const uint64_t *full,
+                      int nblocks, int from, int to)
+{
+    for (int w = next_clear_bit(full, from, to); w >= 0; w = next_clear_bit(full, w + 1, to)) {
+        uint64_t free_bits = ~load_word(bitmap, nblocks, w);
+        if (free_bits) {
+            return w * 64 + __builtin_ctzll(free_bits);
+        }
+    }
+    return -1;
+}
+
+// First free block at or after 'start', wrapping around to block 0;
+// -1 if every block is used
+static int find_free_bit(const unsigned char *bitmap, const uint64_t *full, int nblocks, int start)
+{
+    int nwords = (nblocks + 63) / 64;
+    int w = start / 64;
+    uint64_t free_bits = ~load_word(bitmap, nblocks, w) & (~0ULL << (start % 64));
+    if (free_bits) {
+        return w * 64 + __builtin_ctzll(free_bits);
+    }
+    int bno = scan_words(bitmap, full, nblocks, w + 1, nwords);
+    if (bno < 0) {
+        bno = scan_words(bitmap, full, nblocks, 0, w + 1);
+    }
+    return bno;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// 512 bits at a time with the AVX-512 VPOPCNTQ instruction
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static long popcount_avx512(const unsigned char *p, long nlines)
+{
+    __m512i acc = _mm512_setzero_si512();
+    for (long i = 0; i < nlines; i++) {
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_loadu_si512(p + i * 64)));
+    }
+    return _mm512_reduce_add_epi64(acc);
+}
+
+// AVX2 has no popcount instruction: each nibble's count is looked up
+// with a byte shuffle, and the byte counts are summed with SAD
+__attribute__((target("avx2")))
+static long popcount_avx2(const unsigned char *p, long nlines)
+{
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    __m256i acc = _mm256_setzero_si256();
+    for (long i = 0; i < nlines * 2; i++) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i * 32));
+        __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, nibble));
+        __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+    }
+    return _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) +
+           _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3);
+}
+
+__attribute__((target("popcnt")))
+static long popcount_popcnt(const unsigned char *p, long nwords)
+{
+    long count = 0;
+    for (long w = 0; w < nwords; w++) {
+        uint64_t word;
+        memcpy(&word, p + w * 8, 8);
+        count += __builtin_popcountll(word);
+    }
+    return count;
+}
+#endif
+
+// Set bits in the first nwords 64-bit words at p, with the widest popcount
+// the CPU has
+static long popcount_words(const unsigned char *p, long nwords)
+{
+    long count = 0, done = 0;
+#if defined(__x86_64__) && defined(__GNUC__)
+    static int level = -1;      // 3 AVX-512 VPOPCNT, 2 AVX2, 1 POPCNT, 0 none
+    int lv = __atomic_load_n(&level, __ATOMIC_RELAXED);
+    if (lv < 0) {
+        __builtin_cpu_init();
+        lv = __builtin_cpu_supports("avx512vpopcntdq") ? 3 :
+             __builtin_cpu_supports("avx2") ? 2 : __builtin_cpu_supports("popcnt") ? 1 : 0;
+        __atomic_store_n(&level, lv, __ATOMIC_RELAXED);
+    }
+    if (lv == 3) {
+        count = popcount_avx512(p, nwords / 8);
+        done = nwords / 8 * 8;
+    } else if (lv == 2) {
+        count = popcount_avx2(p, nwords / 8);
+        done = nwords / 8 * 8;
+    }
+    if (lv >= 1) {
+        return count + popcount_popcnt(p + done * 8, nwords - done);
+    }
+#endif
+    for (long w = done; w < nwords; w++) {
+        uint64_t word;
+        memcpy(&word, p + w * 8, 8);
+        count += __builtin_popcountll(word);
+    }
+    return count;
+}
+
+// Count how many bits are set to 1 in the first 'total_blocks' bits: whole
+// words with popcount, the last few bits one at a time
 static int count_used_bits(const unsigned char *bitmap, int total_blocks)
 {
-    int count = 0;
-    for (int i = 0; i < total_blocks; i++) {
+    int count = (int)popcount_words(bitmap, total_blocks / 64);
+    for (int i = total_blocks / 64 * 64; i < total_blocks; i++) {
         if (test_bit(bitmap, i)) {
             count++;
         }
@@ -336,6 +1386,252 @@ static int count_used_bits(const unsigned char *bitmap, int total_blocks)
     return count;
 }
 
+// Blocks [lo, hi) of a page marked used or free: the edges bit by bit,
+// everything between a whole byte at a time; then the word summary of the
+// words touched is brought up to date
+static void set_range(unsigned char *bitmap, uint64_t *full, int nblocks, int lo, int hi, int used)
+{
+    int from = lo, to = hi;
+    for (; lo < hi && lo % 8; lo++) {
+        used ? set_bit(bitmap, lo) : clear_bit(bitmap, lo);
+    }
+    for (; hi > lo && hi % 8; hi--) {
+        used ? set_bit(bitmap, hi - 1) : clear_bit(bitmap, hi - 1);
+    }
+    if (lo < hi) {
+        memset(bitmap + lo / 8, used ? 0xFF : 0x00, (hi - lo) / 8);
+    }
+    for (int w = from / 64; w * 64 < to; w++) {
+        if (~load_word(bitmap, nblocks, w) == 0) {
+            full[w / 64] |= 1ULL << (w % 64);
+        } else {
+            full[w / 64] &= ~(1ULL << (w % 64));
+        }
+    }
+}
+
+// Used blocks among [lo, hi) of a page, a word at a time
+static int count_range(const unsigned char *bitmap, int nblocks, int lo, int hi)
+{
+    int count = 0;
+    for (int w = lo / 64; w * 64 < hi; w++) {
+        uint64_t bits = load_word(bitmap, nblocks, w);
+        if (w * 64 < lo) {
+            bits &= ~0ULL << (lo - w * 64);
+        }
+        if (hi - w * 64 < 64) {
+            bits &= ~(~0ULL << (hi - w * 64));
+        }
+        count += __builtin_popcountll(bits);
+    }
+    return count;
+}
+
+// Used blocks among [start, start+count) of the device, page by page
+static long blocks_used(dd_t *dd, int start, int count)
+{
+    long used = 0;
+    int end = start + count;
+    for (int pno = start / BITS_PER_PAGE; pno * BITS_PER_PAGE < end; pno++) {
+        int base = pno * BITS_PER_PAGE;
+        int nblocks = page_blocks(dd->sb, pno);
+        int lo = start > base ? start - base : 0;
+        int hi = end - base < nblocks ? end - base : nblocks;
+        used += count_range(page_bits(dd, pno), nblocks, lo, hi);
+    }
+    return used;
+}
+
+// Adds a free run at the end of the index, merging it with the last run
+// when they touch (runs that cross a word or page boundary)
+static int extents_append(extent_index_t *ix, int start, int len)
+{
+    if (ix->count > 0) {
+        extent_t *last = &ix->ext[ix->count - 1];
+        if (last->start + last->len == start) {
+            last->len += len;
+            return 0;
+        }
+    }
+    if (ix->count == ix->cap) {
+        int cap = ix->cap ? ix->cap * 2 : 64;
+        extent_t *grown = realloc(ix->ext, cap * sizeof(extent_t));
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failed\n");
+            return -1;
+        }
+        ix->ext = grown;
+        ix->cap = cap;
+    }
+    ix->ext[ix->count].start = start;
+    ix->ext[ix->count].len = len;
+    ix->count++;
+    return 0;
+}
+
+// Builds the free-extent index. Full pages are skipped through the
+// superblock summary, full words through the page summary, and each run
+// inside a word is found with two ctz.
+static int extents_build(dd_t *dd, extent_index_t *ix)
+{
+    const superblock_t *sb = dd->sb;
+    ix->ext = NULL;
+    ix->count = ix->cap = 0;
+    for (int pno = next_clear_bit(sb->full, 0, sb->pages); pno >= 0;
+         pno = next_clear_bit(sb->full, pno + 1, sb->pages)) {
+        const unsigned char *bits = page_bits(dd, pno);
+        const uint64_t *full = page_summary(dd, pno);
+        int nblocks = page_blocks(sb, pno);
+        int nwords = (nblocks + 63) / 64;
+        for (int w = next_clear_bit(full, 0, nwords); w >= 0; w = next_clear_bit(full, w + 1, nwords)) {
+            uint64_t free_bits = ~load_word(bits, nblocks, w);
+            while (free_bits) {
+                int bit = __builtin_ctzll(free_bits);
+                uint64_t used_after = ~(free_bits >> bit);
+                int len = used_after ? __builtin_ctzll(used_after) : 64 - bit;
+                if (extents_append(ix, pno * BITS_PER_PAGE + w * 64 + bit, len) < 0) {
+                    extents_free(ix);
+                    return -1;
+                }
+                free_bits = bit + len >= 64 ? 0 : free_bits & (~0ULL << (bit + len));
+            }
+        }
+    }
+    return 0;
+}
+
+static void extents_free(extent_index_t *ix)
+{
+    free(ix->ext);
+    ix->ext = NULL;
+    ix->count = ix->cap = 0;
+}
+
+// Start of 'count' free blocks chosen by policy, or -1. FIT_NEXT looks
+// from the run holding block 'from' onwards, wrapping around; FIT_BUDDY
+// places the blocks on a multiple of count rounded up to a power of two,
+// as a buddy allocator would.
+static int extents_find(const extent_index_t *ix, int count, int policy, int from)
+{
+    if (policy == FIT_NEXT) {
+        int first = extents_locate(ix, from);
+        for (int k = 0; k < ix->count; k++) {
+            const extent_t *e = &ix->ext[(first + k) % ix->count];
+            if (e->len >= count) {
+                return e->start;
+            }
+        }
+        return -1;
+    }
+    if (policy == FIT_BUDDY) {
+        long align = 1;
+        while (align < count) {
+            align *= 2;
+        }
+        for (int i = 0; i < ix->count; i++) {
+            long start = (ix->ext[i].start + align - 1) / align * align;
+            if (start + count <= (long)ix->ext[i].start + ix->ext[i].len) {
+                return (int)start;
+            }
+        }
+        return -1;
+    }
+
+    int best = -1;
+    for (int i = 0; i < ix->count; i++) {
+        if (ix->ext[i].len < count) {
+            continue;
+        }
+        if (policy == FIT_FIRST || ix->ext[i].len == count) {
+            return ix->ext[i].start;
+        }
+        if (best < 0 || ix->ext[i].len < ix->ext[best].len) {
+            best = i;
+        }
+    }
+    return best < 0 ? -1 : ix->ext[best].start;
+}
+
+// Index of the first run that ends after 'bno' (binary search)
+static int extents_locate(const extent_index_t *ix, int bno)
+{
+    int lo = 0, hi = ix->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ix->ext[mid].start + ix->ext[mid].len <= bno) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Removes [start, start+len), which lies inside one free run, from the
+// index; the run shrinks or splits in two
+static int extents_take(extent_index_t *ix, int start, int len)
+{
+    int i = extents_locate(ix, start);
+    if (i == ix->count || ix->ext[i].start > start ||
+        ix->ext[i].start + ix->ext[i].len < start + len) {
+        return -1;  // not a free run: the index is out of date
+    }
+    extent_t *e = &ix->ext[i];
+    int tail_start = start + len, tail_len = e->start + e->len - tail_start;
+    e->len = start - e->start;
+    if (e->len == 0) {
+        if (tail_len == 0) {
+            memmove(e, e + 1, sizeof(extent_t) * (ix->count - i - 1));
+            ix->count--;
+        } else {
+            e->start = tail_start;
+            e->len = tail_len;
+        }
+        return 0;
+    }
+    if (tail_len > 0) {
+        if (extents_append(ix, 0, 0) < 0) {   // grow by one slot
+            return -1;
+        }
+        e = &ix->ext[i];
+        memmove(e + 2, e + 1, sizeof(extent_t) * (ix->count - i - 2));
+        e[1].start = tail_start;
+        e[1].len = tail_len;
+    }
+    return 0;
+}
+
+// Adds [start, start+len), now entirely free, to the index, merging it
+// with the runs it overlaps or touches
+static int extents_give(extent_index_t *ix, int start, int len)
+{
+    int end = start + len;
+    int i = extents_locate(ix, start - 1 >= 0 ? start - 1 : 0);
+    int j = i;
+    while (j < ix->count && ix->ext[j].start <= end) {
+        if (ix->ext[j].start < start) {
+            start = ix->ext[j].start;
+        }
+        if (ix->ext[j].start + ix->ext[j].len > end) {
+            end = ix->ext[j].start + ix->ext[j].len;
+        }
+        j++;
+    }
+    if (j == i) {
+        // Nothing to merge with: insert a new run at i
+        if (extents_append(ix, 0, 0) < 0) {
+            return -1;
+        }
+        memmove(&ix->ext[i + 1], &ix->ext[i], sizeof(extent_t) * (ix->count - i - 1));
+    } else {
+        memmove(&ix->ext[i + 1], &ix->ext[j], sizeof(extent_t) * (ix->count - j));
+        ix->count -= j - i - 1;
+    }
+    ix->ext[i].start = start;
+    ix->ext[i].len = end - start;
+    return 0;
+}
+
 // -----------------------------------------------
 // DEMO main()
 // -----------------------------------------------
@@ -380,4 +1676,3 @@ int main(void)
 
     return 0;
 }
-
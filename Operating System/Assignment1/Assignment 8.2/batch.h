@@ -0,0 +1,116 @@
+/* Filename: batch.h */
+
+/* Many-file mode shared by mycopy_to, mycopy_from and myrm.
+
+   Each tool takes either one file (the original interface), several files
+   ("tool a b c dd1"), or "-" to read one file name per line from stdin. The
+   metadata is loaded once and flushed once for the whole list; the per-file
+   data copies touch one independent block each, so they are spread over a
+   small pool of threads. */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define BATCH_MAX_THREADS 8
+
+typedef struct {
+    char **names;
+    int count;
+    int many;        // more than one file, or a list from stdin: prefix messages with the name
+} BatchList;
+
+// batch_list: file names from "tool name... dd1", or from stdin when the only name is "-"
+static inline int batch_list(int argc, char *argv[], BatchList *list) {
+    list->many = argc > 3;
+    if (argc == 3 && strcmp(argv[1], "-") == 0) {
+        size_t cap = 256;
+        char line[4096];
+        list->many = 1;
+        list->count = 0;
+        list->names = malloc(cap * sizeof(char *));
+        while (list->names && fgets(line, sizeof(line), stdin)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] == '\0')
+                continue;
+            if ((size_t)list->count == cap) {
+                char **grown = realloc(list->names, (cap *= 2) * sizeof(char *));
+                if (!grown)
+                    break;
+                list->names = grown;
+            }
+            if (!(list->names[list->count++] = strdup(line)))
+                return -1;
+        }
+        if (!list->names || ferror(stdin)) {
+            perror("reading file list");
+            return -1;
+        }
+        return 0;
+    }
+    list->names = argv + 1;
+    list->count = argc - 2;
+    return 0;
+}
+
+// batch_warn: reports a failure for one file
+static inline void batch_warn(const BatchList *list, const char *name, const char *msg) {
+    if (list->many)
+        fprintf(stderr, "%s: %s\n", name, msg);
+    else
+        fprintf(stderr, "%s\n", msg);
+}
+
+// batch_perror: perror(what), naming the file in many-file mode
+static inline void batch_perror(const BatchList *list, const char *name, const char *what) {
+    if (list->many)
+        fprintf(stderr, "%s: %s: %s\n", name, what, strerror(errno));
+    else
+        perror(what);
+}
+
+typedef int (*batch_job)(int index, void *ctx);
+
+typedef struct {
+    batch_job job;
+    void *ctx;
+    int count;
+    int next;        // next index to hand out
+    int failed;
+} BatchPool;
+
+static inline void *batch_worker(void *arg) {
+    BatchPool *pool = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count)
+        if (pool->job(i, pool->ctx) != 0)
+            __atomic_fetch_add(&pool->failed, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// batch_run: calls job(i, ctx) for every i < count on up to BATCH_MAX_THREADS
+// threads (one per CPU) and returns the number of calls that failed
+static inline int batch_run(int count, batch_job job, void *ctx) {
+    BatchPool pool = { job, ctx, count, 0, 0 };
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < 1 ? 1 : cpus > BATCH_MAX_THREADS ? BATCH_MAX_THREADS : (int)cpus;
+    if (threads > count)
+        threads = count;
+    pthread_t tids[BATCH_MAX_THREADS];
+    int started = 0;
+    for (; started < threads - 1; started++)
+        if (pthread_create(&tids[started], NULL, batch_worker, &pool) != 0)
+            break;
+    batch_worker(&pool);  // the calling thread works too
+    for (int t = 0; t < started; t++)
+        pthread_join(tids[t], NULL);
+    return pool.failed;
+}
+
+#endif
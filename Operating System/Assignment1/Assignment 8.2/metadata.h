@@ -0,0 +1,137 @@
+/* Filename: metadata.h */
+
+/* In-memory copy of the metadata area shared by the Assignment 8.2 tools.
+
+   dd1 starts with METADATA_BLOCKS blocks of 16-byte entries, one per data
+   block; an entry whose name starts with '\0' is free. metadata_load reads the
+   whole area with one pread and indexes it: a bitmap of used slots (so a free
+   slot is found with a few word tests) and a hash table of names. Changes are
+   made in memory and metadata_sync writes back only the blocks they touched,
+   so an insert, lookup or remove costs one metadata read and at most one
+   metadata write. */
+
+#ifndef METADATA_H
+#define METADATA_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define METADATA_BLOCKS 8
+#define BLOCK_SIZE 4096
+#define MAX_FILENAME_LEN 12
+#define METADATA_ENTRIES_PER_BLOCK (BLOCK_SIZE / 16)
+#define TOTAL_METADATA_ENTRIES (METADATA_BLOCKS * METADATA_ENTRIES_PER_BLOCK)
+#define METADATA_HASH_BUCKETS 4096
+
+typedef struct __attribute__((packed)) {
+    char name[MAX_FILENAME_LEN];
+    uint32_t size;
+} MetadataEntry;
+
+typedef struct {
+    MetadataEntry entries[TOTAL_METADATA_ENTRIES];
+    uint64_t used[TOTAL_METADATA_ENTRIES / 64];  // bit set = slot holds a file
+    int16_t buckets[METADATA_HASH_BUCKETS];      // first slot per name hash (-1 = none)
+    int16_t next[TOTAL_METADATA_ENTRIES];        // next slot with the same hash
+    uint8_t dirty[METADATA_BLOCKS];
+} MetadataTable;
+
+// Names are compared as stored: padded with '\0' to MAX_FILENAME_LEN bytes.
+static inline void metadata_key(const char *filename, char key[MAX_FILENAME_LEN]) {
+    memset(key, 0, MAX_FILENAME_LEN);
+    strncpy(key, filename, MAX_FILENAME_LEN);
+}
+
+static inline uint32_t metadata_hash(const char key[MAX_FILENAME_LEN]) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    for (int i = 0; i < MAX_FILENAME_LEN; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 16777619u;
+    }
+    return h % METADATA_HASH_BUCKETS;
+}
+
+static inline void metadata_link(MetadataTable *t, int index) {
+    uint32_t b = metadata_hash(t->entries[index].name);
+    t->next[index] = t->buckets[b];
+    t->buckets[b] = (int16_t)index;
+    t->used[index / 64] |= 1ULL << (index % 64);
+}
+
+static inline void metadata_unlink(MetadataTable *t, int index) {
+    int16_t *link = &t->buckets[metadata_hash(t->entries[index].name)];
+    while (*link != -1 && *link != index) link = &t->next[*link];
+    if (*link == index) *link = t->next[index];
+    t->used[index / 64] &= ~(1ULL << (index % 64));
+}
+
+// metadata_load: reads all metadata blocks in one call and builds the indexes
+static inline int metadata_load(int fd, MetadataTable *t) {
+    if (pread(fd, t->entries, sizeof(t->entries), 0) != (ssize_t)sizeof(t->entries)) {
+        perror("pread metadata");
+        return -1;
+    }
+    memset(t->used, 0, sizeof(t->used));
+    memset(t->buckets, 0xff, sizeof(t->buckets));
+    memset(t->dirty, 0, sizeof(t->dirty));
+    // Link in reverse so each hash chain lists slots in ascending order.
+    for (int i = TOTAL_METADATA_ENTRIES - 1; i >= 0; i--)
+        if (t->entries[i].name[0] != '\0')
+            metadata_link(t, i);
+    return 0;
+}
+
+// metadata_find: slot of the file called filename (the lowest one if the name
+// was stored twice), or -1
+static inline int metadata_find(const MetadataTable *t, const char *filename) {
+    char key[MAX_FILENAME_LEN];
+    metadata_key(filename, key);
+    for (int i = t->buckets[metadata_hash(key)]; i != -1; i = t->next[i])
+        if (memcmp(t->entries[i].name, key, MAX_FILENAME_LEN) == 0)
+            return i;
+    return -1;
+}
+
+// metadata_free_slot: lowest free slot, or -1 when dd1 is full
+static inline int metadata_free_slot(const MetadataTable *t) {
+    for (int w = 0; w < TOTAL_METADATA_ENTRIES / 64; w++)
+        if (~t->used[w])
+            return w * 64 + __builtin_ctzll(~t->used[w]);
+    return -1;
+}
+
+// metadata_set: stores a file entry in slot index
+static inline void metadata_set(MetadataTable *t, int index, const char *filename, uint32_t size) {
+    if (t->used[index / 64] & (1ULL << (index % 64)))
+        metadata_unlink(t, index);
+    metadata_key(filename, t->entries[index].name);
+    t->entries[index].size = size;
+    metadata_link(t, index);
+    t->dirty[index / METADATA_ENTRIES_PER_BLOCK] = 1;
+}
+
+// metadata_clear: frees slot index
+static inline void metadata_clear(MetadataTable *t, int index) {
+    metadata_unlink(t, index);
+    memset(&t->entries[index], 0, sizeof(MetadataEntry));
+    t->dirty[index / METADATA_ENTRIES_PER_BLOCK] = 1;
+}
+
+// metadata_sync: writes back the metadata blocks changed since the load
+static inline int metadata_sync(int fd, MetadataTable *t) {
+    for (int b = 0; b < METADATA_BLOCKS; b++) {
+        if (!t->dirty[b])
+            continue;
+        const MetadataEntry *block = &t->entries[b * METADATA_ENTRIES_PER_BLOCK];
+        if (pwrite(fd, block, BLOCK_SIZE, (off_t)b * BLOCK_SIZE) != BLOCK_SIZE) {
+            perror("pwrite metadata");
+            return -1;
+        }
+        t->dirty[b] = 0;
+    }
+    return 0;
+}
+
+#endif
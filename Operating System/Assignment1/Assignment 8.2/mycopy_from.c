@@ -4,48 +4,59 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
+#include "metadata.h"
+#include "batch.h"
 
-#define METADATA_BLOCKS 8
-#define BLOCK_SIZE 4096
-#define MAX_FILENAME_LEN 12
-#define METADATA_ENTRIES_PER_BLOCK (BLOCK_SIZE / 16)
-#define TOTAL_METADATA_ENTRIES (METADATA_BLOCKS * METADATA_ENTRIES_PER_BLOCK)
+typedef struct {
+    const BatchList *list;
+    int fd;
+    const MetadataTable *table;
+    int *slots;          // slot per file, -1 if it was not found
+} CopyFrom;
 
-typedef struct __attribute__((packed)) {
-    char name[MAX_FILENAME_LEN];
-    uint32_t size;
-} MetadataEntry;
+// copy_one: reads one data block and writes it to a file of the same name
+static int copy_one(int i, void *arg) {
+    CopyFrom *c = arg;
+    const char *filename = c->list->names[i];
+    if (c->slots[i] == -1)
+        return 0;
+    MetadataEntry entry = c->table->entries[c->slots[i]];
 
-int find_entry_by_name(int fd, const char *filename, MetadataEntry *out_entry, int *out_index) {
-    char target_name[MAX_FILENAME_LEN] = {0};
-    strncpy(target_name, filename, MAX_FILENAME_LEN);
+    char buffer[BLOCK_SIZE];
+    off_t data_offset = (off_t)(METADATA_BLOCKS + c->slots[i]) * BLOCK_SIZE;
+    if (pread(c->fd, buffer, entry.size, data_offset) != entry.size) {
+        batch_perror(c->list, filename, "pread data");
+        return -1;
+    }
 
-    MetadataEntry entry;
-    for (int i = 0; i < TOTAL_METADATA_ENTRIES; i++) {
-        off_t block = i / METADATA_ENTRIES_PER_BLOCK;
-        off_t offset_in_block = (i % METADATA_ENTRIES_PER_BLOCK) * sizeof(MetadataEntry);
-        off_t offset = block * BLOCK_SIZE + offset_in_block;
-        if (pread(fd, &entry, sizeof(entry), offset) != sizeof(entry)) {
-            perror("pread");
-            return -1;
-        }
-        if (entry.name[0] != '\0' && memcmp(entry.name, target_name, MAX_FILENAME_LEN) == 0) {
-            *out_entry = entry;
-            *out_index = i;
-            return 0;
-        }
+    // The stored name is not terminated when it is MAX_FILENAME_LEN long.
+    char name[MAX_FILENAME_LEN + 1] = {0};
+    memcpy(name, entry.name, MAX_FILENAME_LEN);
+    FILE *dest = fopen(name, "wb");
+    if (!dest) {
+        batch_perror(c->list, filename, "fopen");
+        return -1;
     }
-    return -1;
+    if (fwrite(buffer, 1, entry.size, dest) != entry.size) {
+        batch_perror(c->list, filename, "fwrite");
+        fclose(dest);
+        return -1;
+    }
+    fclose(dest);
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s filename dd1\n", argv[0]);
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s filename... dd1\n", argv[0]);
+        fprintf(stderr, "       %s - dd1   (file names listed on stdin)\n", argv[0]);
         exit(1);
     }
 
-    const char *filename = argv[1];
-    const char *dd1 = argv[2];
+    BatchList list;
+    if (batch_list(argc, argv, &list) == -1)
+        exit(1);
+    const char *dd1 = argv[argc - 1];
 
     int fd = open(dd1, O_RDONLY);
     if (fd == -1) {
@@ -53,35 +64,30 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    MetadataEntry entry;
-    int entry_index;
-    if (find_entry_by_name(fd, filename, &entry, &entry_index) == -1) {
-        fprintf(stderr, "File not found\n");
-        close(fd);
-        exit(1);
-    }
-
-    char buffer[BLOCK_SIZE];
-    off_t data_offset = (METADATA_BLOCKS + entry_index) * BLOCK_SIZE;
-    if (pread(fd, buffer, entry.size, data_offset) != entry.size) {
-        perror("pread data");
+    MetadataTable table;
+    if (metadata_load(fd, &table) == -1) {
         close(fd);
         exit(1);
     }
 
-    FILE *dest = fopen(entry.name, "wb");
-    if (!dest) {
-        perror("fopen");
+    int failed = 0;
+    int *slots = malloc(sizeof(int) * (list.count + 1));
+    if (!slots) {
+        perror("malloc");
         close(fd);
         exit(1);
     }
-    if (fwrite(buffer, 1, entry.size, dest) != entry.size) {
-        perror("fwrite");
-        fclose(dest);
-        close(fd);
-        exit(1);
+    for (int i = 0; i < list.count; i++) {
+        if ((slots[i] = metadata_find(&table, list.names[i])) == -1) {
+            batch_warn(&list, list.names[i], "File not found");
+            failed++;
+        }
     }
-    fclose(dest);
+
+    CopyFrom copy = { &list, fd, &table, slots };
+    failed += batch_run(list.count, copy_one, &copy);
+
+    free(slots);
     close(fd);
-    return 0;
+    return failed ? 1 : 0;
 }
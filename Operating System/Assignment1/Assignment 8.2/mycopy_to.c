@@ -4,66 +4,62 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
+#include "metadata.h"
+#include "batch.h"
+
+typedef struct {
+    const BatchList *list;
+    int fd;
+    int *slots;          // reserved slot per file, -1 if it was rejected
+    long *sizes;         // bytes copied, -1 until the copy succeeds
+} CopyTo;
+
+// copy_one: reads one source file and writes its data block
+static int copy_one(int i, void *arg) {
+    CopyTo *c = arg;
+    const char *sourcefile = c->list->names[i];
+    if (c->slots[i] == -1)
+        return 0;
 
-#define METADATA_BLOCKS 8
-#define BLOCK_SIZE 4096
-#define MAX_FILENAME_LEN 12
-#define METADATA_ENTRIES_PER_BLOCK (BLOCK_SIZE / 16)
-#define TOTAL_METADATA_ENTRIES (METADATA_BLOCKS * METADATA_ENTRIES_PER_BLOCK)
-
-typedef struct __attribute__((packed)) {
-    char name[MAX_FILENAME_LEN];
-    uint32_t size;
-} MetadataEntry;
-
-int find_empty_entry(int fd) {
-    MetadataEntry entry;
-    for (int i = 0; i < TOTAL_METADATA_ENTRIES; i++) {
-        off_t block = i / METADATA_ENTRIES_PER_BLOCK;
-        off_t offset_in_block = (i % METADATA_ENTRIES_PER_BLOCK) * sizeof(MetadataEntry);
-        off_t offset = block * BLOCK_SIZE + offset_in_block;
-        if (pread(fd, &entry, sizeof(entry), offset) != sizeof(entry)) {
-            perror("pread");
-            return -1;
-        }
-        if (entry.name[0] == '\0') {
-            return i;
-        }
+    FILE *src = fopen(sourcefile, "rb");
+    if (!src) {
+        batch_perror(c->list, sourcefile, "fopen");
+        return -1;
     }
-    return -1;
-}
-
-int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s sourcefile dd1\n", argv[0]);
-        exit(1);
+    // One byte more than a block tells a full block from a file that is too large.
+    char buffer[BLOCK_SIZE + 1] = {0};
+    size_t file_size = fread(buffer, 1, sizeof(buffer), src);
+    if (ferror(src)) {
+        batch_perror(c->list, sourcefile, "fread");
+        fclose(src);
+        return -1;
+    }
+    fclose(src);
+    if (file_size > BLOCK_SIZE) {
+        batch_warn(c->list, sourcefile, "File too large");
+        return -1;
     }
 
-    const char *sourcefile = argv[1];
-    const char *dd1 = argv[2];
-
-    FILE *src = fopen(sourcefile, "rb");
-    if (!src) {
-        perror("fopen");
-        exit(1);
+    off_t data_offset = (off_t)(METADATA_BLOCKS + c->slots[i]) * BLOCK_SIZE;
+    if (pwrite(c->fd, buffer, BLOCK_SIZE, data_offset) != BLOCK_SIZE) {
+        batch_perror(c->list, sourcefile, "pwrite data");
+        return -1;
     }
+    c->sizes[i] = (long)file_size;
+    return 0;
+}
 
-    fseek(src, 0, SEEK_END);
-    long file_size = ftell(src);
-    if (file_size > BLOCK_SIZE) {
-        fprintf(stderr, "File too large\n");
-        fclose(src);
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s sourcefile... dd1\n", argv[0]);
+        fprintf(stderr, "       %s - dd1   (source files listed on stdin)\n", argv[0]);
         exit(1);
     }
-    fseek(src, 0, SEEK_SET);
 
-    char buffer[BLOCK_SIZE] = {0};
-    if (fread(buffer, 1, file_size, src) != (size_t)file_size) {
-        perror("fread");
-        fclose(src);
+    BatchList list;
+    if (batch_list(argc, argv, &list) == -1)
         exit(1);
-    }
-    fclose(src);
+    const char *dd1 = argv[argc - 1];
 
     int fd = open(dd1, O_RDWR);
     if (fd == -1) {
@@ -71,42 +67,64 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    int entry_index = find_empty_entry(fd);
-    if (entry_index == -1) {
-        fprintf(stderr, "No space in dd1\n");
+    MetadataTable table;
+    if (metadata_load(fd, &table) == -1) {
         close(fd);
         exit(1);
     }
 
-    const char *filename = strrchr(sourcefile, '/');
-    filename = filename ? filename + 1 : sourcefile;
-
-    if (strlen(filename) > MAX_FILENAME_LEN) {
-        fprintf(stderr, "Filename too long\n");
+    int failed = 0;
+    int *slots = malloc(sizeof(int) * (list.count + 1));
+    long *sizes = malloc(sizeof(long) * (list.count + 1));
+    if (!slots || !sizes) {
+        perror("malloc");
         close(fd);
         exit(1);
     }
 
-    MetadataEntry entry;
-    memset(&entry, 0, sizeof(entry));
-    strncpy(entry.name, filename, MAX_FILENAME_LEN);
-    entry.size = file_size;
+    // Reserve a slot per file up front so the copies can run in parallel.
+    for (int i = 0; i < list.count; i++) {
+        const char *filename = strrchr(list.names[i], '/');
+        filename = filename ? filename + 1 : list.names[i];
+        slots[i] = -1;
+        sizes[i] = -1;
+        if (strlen(filename) > MAX_FILENAME_LEN) {
+            batch_warn(&list, list.names[i], "Filename too long");
+            failed++;
+            continue;
+        }
+        if ((slots[i] = metadata_free_slot(&table)) == -1) {
+            batch_warn(&list, list.names[i], "No space in dd1");
+            failed++;
+            continue;
+        }
+        metadata_set(&table, slots[i], filename, 0);
+    }
 
-    off_t metadata_offset = (entry_index / METADATA_ENTRIES_PER_BLOCK) * BLOCK_SIZE;
-    metadata_offset += (entry_index % METADATA_ENTRIES_PER_BLOCK) * sizeof(entry);
-    if (pwrite(fd, &entry, sizeof(entry), metadata_offset) != sizeof(entry)) {
-        perror("pwrite metadata");
-        close(fd);
-        exit(1);
+    // Data first, so no entry on disk points at a block that was not written.
+    CopyTo copy = { &list, fd, slots, sizes };
+    failed += batch_run(list.count, copy_one, &copy);
+    // One barrier for the whole batch: the entries must not reach the disk before the data.
+    int synced = fdatasync(fd) == 0;
+    if (!synced) {
+        perror("fdatasync");
+        failed++;
     }
 
-    off_t data_offset = (METADATA_BLOCKS + entry_index) * BLOCK_SIZE;
-    if (pwrite(fd, buffer, BLOCK_SIZE, data_offset) != BLOCK_SIZE) {
-        perror("pwrite data");
-        close(fd);
-        exit(1);
+    for (int i = 0; i < list.count; i++) {
+        if (slots[i] == -1)
+            continue;
+        if (sizes[i] == -1) {
+            metadata_clear(&table, slots[i]);
+            continue;
+        }
+        table.entries[slots[i]].size = (uint32_t)sizes[i];
     }
+    if (synced && metadata_sync(fd, &table) == -1)
+        failed++;
 
+    free(slots);
+    free(sizes);
     close(fd);
-    return 0;
+    return failed ? 1 : 0;
 }
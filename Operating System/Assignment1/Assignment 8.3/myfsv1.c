@@ -33,6 +33,7 @@ Your code should properly indented and documented.
 
 */
 
+#define _GNU_SOURCE /* O_DIRECT for BLOCKDEV=direct */
 #include <stdio.h>
 #include <stdio.h>
 #include <string.h> /* strcmp(), strrchr() */
@@ -43,6 +44,7 @@ Your code should properly indented and documented.
 #include <sys/stat.h> /* stat() */
 #include <sys/sysmacros.h> /* stat() */
 #include <stdint.h> /* stat() */
+#include "../blockdev.h" /* bd_open(), bd_pread(), bd_pwrite() */
 
 
 
@@ -51,17 +53,34 @@ Your code should properly indented and documented.
 #define BNO 2048
 #define NOFILES 2048
 #define FNLEN 12
+#define HASHSIZE 4096 /* slots in the name index, a power of 2 above 2 * NOFILES */
 
 char buf[4096];
 char sbuf[8*4096];
 
+/* Indexes over sbuf, rebuilt by mybuildIndex() after every myreadSBlocks().
+   nameidx is an open-addressing (linear probing) hash table of the names in
+   use: each cell holds a descriptor number + 1, or 0 if the cell is empty.
+   freestack holds the free descriptor numbers, highest on top. */
+short nameidx[HASHSIZE];
+short freestack[NOFILES];
+int nfree;
+
+/* sdirty[i] is set when metadata block i of sbuf was changed since it was
+   read; mywriteSBlocks() writes back only those blocks. */
+char sdirty[8];
+
 /* prototypes of function define later */
 int mymkfs(const char *fname); /* returns 0 if successfull, -1 if error */
 int mycopyFrom(char *mfname, char *fname);
 int mycopyTo(char *fname, char *mfname);
 int myrm(char *);
 int myreadSBlocks(int fd, char *sbuf); /* returns 0 if successfull, -1 if error */
-int mywriteSBlocks(int fd, char *sbuf);
+void mybuildIndex(char *sbuf);
+int mylookup(char *sbuf, char *name); /* returns the descriptor number of name, -1 if not found */
+int myfreeSlot(void); /* returns a free descriptor number, -1 if myfs is full */
+int mywriteSBlocks(int fd, char *sbuf); /* writes back the dirty metadata blocks */
+void mymarkDirty(int i); /* descriptor i of sbuf was changed */
 int myreadBlock(int fd, int bno, char *buf); /* returns 0 if successfull, -1 if error */
 int mywriteBlock(int fd, int bno, char *buf); /* returns 0 if successfull, -1 if error */
 
@@ -129,7 +148,7 @@ int mymkfs(const char *fname) {
 	int fd;
 	int i;
 	int flag;
-	fd = open(fname, O_CREAT | O_WRONLY, S_IRWXU);
+	fd = bd_open(fname, O_CREAT | O_WRONLY, S_IRWXU);
 	if (fd == -1) {
 		fprintf(stderr,"%s: ", fname);
 		perror("File cannot be opened for writing");
@@ -139,13 +158,14 @@ int mymkfs(const char *fname) {
 	// void *memset(void s[.n], int c, size_t n);
 	memset(buf, 0, BS);
 	for (i=0; i < BNO + 8; i++) {
-		flag = write(fd, buf, BS);
+		flag = mywriteBlock(fd, i, buf);
 		if(flag == -1) {
 			fprintf(stderr,"%s: ", fname);
 			perror("File write failed!");
 			return (-1);
 		}
 	}
+	bd_close(fd);
 	return (0);
 
 }
@@ -153,7 +173,6 @@ int mycopyTo(char *fname, char *mfname) {
 	/* linux file fname to be copied to mfname on myfs */
 	int fd;
 	int fdTo;
-	int i;
 	int flag;       
 	int hole;
         struct stat sb;
@@ -185,7 +204,7 @@ int mycopyTo(char *fname, char *mfname) {
 		return (-1);
 	}
 
-	fdTo = open(mfname, O_RDWR);
+	fdTo = bd_open(mfname, O_RDWR, 0);
 	if (fdTo == -1) {
 		fprintf(stderr,"%s: ", mfname);
 		perror("Cannot be opened for writing: ");
@@ -194,22 +213,20 @@ int mycopyTo(char *fname, char *mfname) {
 
 	/* initialize sbuf */
 	flag = myreadSBlocks(fdTo, sbuf);
+	mybuildIndex(sbuf);
 
 	/* check whether fname exists in myfs */
-	hole = -1;
-	for (i = 0; i < NOFILES; i++) { /* check all the myfile names in 16 byte myfile descriptors.*/
-		if (sbuf[i*16] == 0) {
-			hole = i;
-		}
-		if (strncmp(fname, &(sbuf[i*16]), FNLEN) == 0) {
-			break;
+	if (mylookup(sbuf, fname) == -1) {
+		hole = myfreeSlot();
+		if (hole == -1) {
+			fprintf(stderr, "File %s cannot be copied to myfs on %s!\n", fname, mfname);
+			fprintf(stderr, "myfs is full!\n");
+			return (-1);
 		}
-	}
-
-	if (i >= NOFILES) {
 		strcpy(&(sbuf[hole*16]), fname); /* copy the fname in the myfile descriptor */
 		*((int *)&(sbuf[hole*16 + 12])) = (int)(sb.st_size); /* copy the fname size in the myfile descriptor */
 		//sprintf(&(sbuf[hole*16 + 12]), "%d", sb.st_size);
+		mymarkDirty(hole);
 
 	} else {
 		/** Error: File exists */
@@ -232,17 +249,26 @@ int mycopyTo(char *fname, char *mfname) {
 		fprintf(stderr, "mywriteBlock() failed!\n");
 		return (-1);
 	}
+
+	/* The data block must be on disk before the descriptor naming it, so a
+	   crash never leaves a name pointing at a block that was not written. */
+	flag = bd_sync(fdTo);
+	if (flag == -1) {
+		fprintf(stderr,"%s: ", mfname);
+		perror("fdatasync() failed: ");
+		return (-1);
+	}
 	
 	//int mywriteSBlocks(int fd, char *sbuf) 
 	flag = mywriteSBlocks(fdTo, sbuf);
 	if (flag == -1) {
 		fprintf(stderr, "File %s cannot be copied to myfs on %s!\n", fname, mfname);
 		fprintf(stderr, "mywriteSBlocks() failed!\n");
-		close(fdTo);
+		bd_close(fdTo);
 		return (-1);
 	}
 	close(fd);
-	close(fdTo);
+	bd_close(fdTo);
 	return (0);
 
 }
@@ -277,7 +303,7 @@ int mycopyFrom(char *mfname, char *fname) {
 		return (-1);
 	}
 
-	fdFrom = open(myfsname, O_RDWR);
+	fdFrom = bd_open(myfsname, O_RDWR, 0);
 	if (fdFrom == -1) {
 		fprintf(stderr,"%s: ", myfsname);
 		perror("Cannot be opened for reading: ");
@@ -286,15 +312,12 @@ int mycopyFrom(char *mfname, char *fname) {
 
 	/* initialize sbuf */
 	flag = myreadSBlocks(fdFrom, sbuf);
+	mybuildIndex(sbuf);
 
 	/* check whether myfilename exists in myfs */
-	for (i = 0; i < NOFILES; i++) { /* check all the myfile names in 16 byte myfile descriptors.*/
-		if (strncmp(myfilename, &(sbuf[i*16]), FNLEN) == 0) { /* myfile found */
-			break;
-		}
-	}
+	i = mylookup(sbuf, myfilename);
 
-	if (i >= NOFILES) { /* myfile not found */
+	if (i == -1) { /* myfile not found */
 		/** Error: File not found at myfs */
 		fprintf(stderr, "File %s cannot be found in  myfs on %s!\n", myfilename, myfsname);
 		return (-1);
@@ -321,7 +344,7 @@ int mycopyFrom(char *mfname, char *fname) {
 	}
 	
 	close(fd);
-	close(fdFrom);
+	bd_close(fdFrom);
 	return (0);
 
 }
@@ -345,7 +368,7 @@ int myrm(char *mfname) {
 	}
 
 
-	fdFrom = open(myfsname, O_RDWR);
+	fdFrom = bd_open(myfsname, O_RDWR, 0);
 	if (fdFrom == -1) {
 		fprintf(stderr,"%s: ", myfsname);
 		perror("Cannot be opened for reading-writing: ");
@@ -354,16 +377,12 @@ int myrm(char *mfname) {
 
 	/* initialize sbuf */
 	flag = myreadSBlocks(fdFrom, sbuf);
+	mybuildIndex(sbuf);
 
 	/* check whether myfilename exists in myfs at myfsname */
-	for (i = 0; i < BNO; i++) { /* check all the myfile names in 16 byte myfile descriptors.*/
-		if (strncmp(myfilename, &(sbuf[i*16]), FNLEN) == 0) { /* myfile found */
-			break;
-		}
-	}
-
+	i = mylookup(sbuf, myfilename);
 
-	if (i >= NOFILES) { /* myfile not found */
+	if (i == -1) { /* myfile not found */
 		/** Error: File not found at myfs */
 		fprintf(stderr, "File %s cannot be found in  myfs on %s!\n", myfilename, myfsname);
 		return (-1);
@@ -372,6 +391,7 @@ int myrm(char *mfname) {
 	/* delete the file in the myfile descriptor */
 	sbuf[i*16] = '\0';
 	*((int *)&(sbuf[i*16 + 12])) = 0; /* make myfilename size in the myfile descriptor to be 0. optional */
+	mymarkDirty(i);
 
 
 	//int mywriteSBlocks(int fd, char *sbuf) 
@@ -379,10 +399,10 @@ int myrm(char *mfname) {
 	if (flag == -1) {
 		fprintf(stderr, "File %s cannot be removed from myfs on %s!\n", myfilename, myfsname);
 		fprintf(stderr, "mywriteSBlocks() failed!\n");
-		close(fdFrom);
+		bd_close(fdFrom);
 		return (-1);
 	}
-	close(fdFrom);
+	bd_close(fdFrom);
 	return (0);
 
 }
@@ -391,39 +411,77 @@ int myrm(char *mfname) {
 int myreadSBlocks(int fd, char *sbuf) {
 	int i;
 	int flag;
-	flag = lseek(fd, 0, SEEK_SET); /* Going to the beginning of the file */
-        if (flag == -1) {
-                perror("lseek() at myreadSBlocks() fails: ");
-                return (flag);
-        }
 	flag = 0;
 	for (i = 0; i < 8 && flag != -1; i++) {
 		flag = myreadBlock(fd, i, &(sbuf[i*BS]));
 	}
+	memset(sdirty, 0, sizeof(sdirty));
 	return (flag);
 }
+/* hash of a myfile name: FNV-1a over its first FNLEN characters */
+unsigned int myhash(char *name) {
+	unsigned int h = 2166136261u;
+	int i;
+	for (i = 0; i < FNLEN && name[i] != '\0'; i++) {
+		h = (h ^ (unsigned char)name[i]) * 16777619u;
+	}
+	return (h & (HASHSIZE - 1));
+}
+
+void mybuildIndex(char *sbuf) {
+	int i;
+	unsigned int h;
+	memset(nameidx, 0, sizeof(nameidx));
+	nfree = 0;
+	for (i = 0; i < NOFILES; i++) {
+		if (sbuf[i*16] == '\0') {
+			freestack[nfree++] = i; /* the highest free descriptor ends up on top */
+			continue;
+		}
+		/* Descriptors go in ascending order, so a name stored twice resolves
+		   to the lower one, as the linear scan did. */
+		for (h = myhash(&(sbuf[i*16])); nameidx[h] != 0; h = (h + 1) & (HASHSIZE - 1))
+			;
+		nameidx[h] = i + 1;
+	}
+}
+
+int mylookup(char *sbuf, char *name) {
+	unsigned int h;
+	for (h = myhash(name); nameidx[h] != 0; h = (h + 1) & (HASHSIZE - 1)) {
+		if (strncmp(name, &(sbuf[(nameidx[h] - 1)*16]), FNLEN) == 0) {
+			return (nameidx[h] - 1);
+		}
+	}
+	return (-1);
+}
+
+int myfreeSlot(void) {
+	if (nfree == 0) {
+		return (-1);
+	}
+	return (freestack[--nfree]);
+}
+
 int mywriteSBlocks(int fd, char *sbuf) {
 	int i;
 	int flag;
-	flag = lseek(fd, 0, SEEK_SET); /* Going to the beginning of the file */
-        if (flag == -1) {
-                perror("lseek() at mywriteSBlocks() fails: ");
-                return (-1);
-        }
 	flag = 0;
 	for (i = 0; i < 8 && flag != -1; i++) {
-		flag = mywriteBlock(fd, i, &(sbuf[i*BS]));
+		if (sdirty[i]) {
+			flag = mywriteBlock(fd, i, &(sbuf[i*BS]));
+			sdirty[i] = (flag == -1);
+		}
 	}
 	return (flag);
 }
+
+void mymarkDirty(int i) {
+	sdirty[(i*16) / BS] = 1;
+}
 int myreadBlock(int fd, int bno, char *buf) {
         int flag;
-        flag = lseek(fd, bno * BS, SEEK_SET);
-        if (flag == -1) {
-                perror("lseek() at myreadBlock() fails: ");
-                return (flag);
-        }
-        flag = read(fd, buf, BS);
+        flag = bd_pread(fd, buf, BS, (off_t)bno * BS);
         if (flag == -1) {
                 perror("read() at myreadBlock() fails: ");
                 return (-1);
@@ -433,14 +491,9 @@ int myreadBlock(int fd, int bno, char *buf) {
 
 int mywriteBlock(int fd, int bno, char *buf) {
         int flag;
-        flag = lseek(fd, bno * BS, SEEK_SET);
+        flag = bd_pwrite(fd, buf, BS, (off_t)bno * BS);
         if (flag == -1) {
-                perror("lseek() at myreadBlock() fails: ");
-                return (flag);
-        }
-        flag = write(fd, buf, BS);
-        if (flag == -1) {
-                perror("read() at myreadBlock() fails: ");
+                perror("write() at mywriteBlock() fails: ");
                 return (-1);
         }
         return (0);
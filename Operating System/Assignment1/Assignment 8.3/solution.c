@@ -1,13 +1,20 @@
+#define _GNU_SOURCE   // O_DIRECT for BLOCKDEV=direct, SEEK_DATA
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include "../blockdev.h"
 
 // Constants
 #define BLOCK_SIZE 4096
 // Last 4 bytes reserved for pointer to next block; effective data bytes per block:
 #define DATA_SIZE (BLOCK_SIZE - sizeof(uint32_t))
 #define MAX_NAME_LEN 12
+#define DEFAULT_BLOCKS 1000
+// Blocks moved per pread/pwritev when a file's chain is written, read or freed.
+#define CHAIN_BATCH 256
 
 // File types
 #define TYPE_FILE 'f'
@@ -32,16 +39,19 @@ typedef struct {
 #pragma pack(pop)
 
 // Function prototypes for our four commands.
-int mymkfs(const char *linuxfile);
+int mymkfs(const char *linuxfile, uint32_t total_blocks);
 int mycopyto(const char *linuxfile, const char *myfspath);
 int mycopyfrom(const char *myfspath, const char *linuxfile);
 int myrm(const char *myfspath);
 
-// Helper functions for block-level I/O.
-uint32_t allocate_block(FILE *fp, SuperBlock *sb);
-void free_block(FILE *fp, SuperBlock *sb, uint32_t block_num);
-int read_block(FILE *fp, uint32_t block_num, void *buffer);
-int write_block(FILE *fp, uint32_t block_num, const void *buffer);
+// Helper functions for block-level I/O on dd1 (through the shared block device layer).
+int reserve_chain(int fd, SuperBlock *sb, uint32_t *blocks, uint32_t count);
+int write_chain(int fd, const uint32_t *blocks, uint32_t count, FILE *src, uint32_t filesize);
+uint32_t read_run(int fd, const SuperBlock *sb, uint32_t block, uint32_t max, char *buf, uint32_t *next);
+int free_run(int fd, SuperBlock *sb, uint32_t block, uint32_t count);
+int read_block(int fd, uint32_t block_num, void *buffer);
+int write_block(int fd, uint32_t block_num, const void *buffer);
+int write_superblock(int fd, const SuperBlock *sb);
 
 // Main parses command-line arguments and calls the appropriate function.
 int main(int argc, char *argv[]) {
@@ -51,7 +61,13 @@ int main(int argc, char *argv[]) {
     }
     
     if (strcmp(argv[1], "mymkfs") == 0) {
-        return mymkfs(argv[2]);
+        // Optional block count; a 1 GB file needs about 262,000 blocks.
+        long blocks = argc > 3 ? atol(argv[3]) : DEFAULT_BLOCKS;
+        if (blocks < 2 || blocks > UINT32_MAX) {
+            fprintf(stderr, "Usage: mymkfs <linuxfile> [blocks >= 2]\n");
+            exit(1);
+        }
+        return mymkfs(argv[2], (uint32_t)blocks);
     } else if (strcmp(argv[1], "mycopyto") == 0) {
         if (argc < 4) {
             fprintf(stderr, "Usage: mycopyto <linuxfile> <myfspath>\n");
@@ -76,19 +92,16 @@ int main(int argc, char *argv[]) {
 
 /*
  * mymkfs: Formats the given Linux file (dd1) as a new myfs.
- * - Creates a file system with a fixed number of blocks (here, 1000 as an example).
+ * - Creates a file system with total_blocks blocks (1000 unless given on the command line).
  * - Writes the superblock in block 0 and initializes an empty root directory in block 1.
  */
-int mymkfs(const char *linuxfile) {
-    FILE *fp = fopen(linuxfile, "w+b");
-    if (!fp) {
-        perror("fopen");
+int mymkfs(const char *linuxfile, uint32_t total_blocks) {
+    int fd = bd_open(linuxfile, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        perror("open");
         return -1;
     }
     
-    // For demonstration, we create a file system with 1000 blocks.
-    uint32_t total_blocks = 1000;
-    
     SuperBlock sb;
     sb.total_blocks = total_blocks;
     // Reserve block 0 (superblock) and block 1 (root directory).
@@ -96,24 +109,27 @@ int mymkfs(const char *linuxfile) {
     sb.root_dir_block = 1;
     
     // Write the superblock to block 0.
-    fseek(fp, 0, SEEK_SET);
-    if (fwrite(&sb, sizeof(SuperBlock), 1, fp) != 1) {
-        perror("fwrite");
-        fclose(fp);
+    if (write_superblock(fd, &sb) != 0) {
+        bd_close(fd);
+        return -1;
+    }
+    
+    // Extend dd1 to its full size so every block can be read back (unused blocks are zero).
+    if (ftruncate(fd, (off_t)total_blocks * BLOCK_SIZE) != 0) {
+        perror("ftruncate");
+        bd_close(fd);
         return -1;
     }
     
     // Initialize an empty root directory block (all bytes zero).
     char root_block[BLOCK_SIZE];
     memset(root_block, 0, BLOCK_SIZE);
-    fseek(fp, BLOCK_SIZE, SEEK_SET);  // Block 1
-    if (fwrite(root_block, BLOCK_SIZE, 1, fp) != 1) {
-        perror("fwrite");
-        fclose(fp);
+    if (write_block(fd, 1, root_block) != 0) {
+        bd_close(fd);
         return -1;
     }
     
-    fclose(fp);
+    bd_close(fd);
     printf("File system created with %u blocks.\n", total_blocks);
     return 0;
 }
@@ -121,89 +137,188 @@ int mymkfs(const char *linuxfile) {
 /*
  * read_block: Reads block number 'block_num' from dd1 into the provided buffer.
  */
-int read_block(FILE *fp, uint32_t block_num, void *buffer) {
-    if (fseek(fp, block_num * BLOCK_SIZE, SEEK_SET) != 0) {
-        perror("fseek");
+int read_block(int fd, uint32_t block_num, void *buffer) {
+    if (bd_pread(fd, buffer, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE) != BLOCK_SIZE) {
+        perror("pread");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * write_block: Writes the provided buffer to block number 'block_num' in dd1.
+ */
+int write_block(int fd, uint32_t block_num, const void *buffer) {
+    if (bd_pwrite(fd, buffer, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE) != BLOCK_SIZE) {
+        perror("pwrite");
         return -1;
     }
-    if (fread(buffer, BLOCK_SIZE, 1, fp) != 1) {
-        perror("fread");
+    return 0;
+}
+
+/*
+ * write_superblock: Writes the superblock to block 0.
+ */
+int write_superblock(int fd, const SuperBlock *sb) {
+    if (bd_pwrite(fd, sb, sizeof(SuperBlock), 0) != sizeof(SuperBlock)) {
+        perror("pwrite superblock");
         return -1;
     }
     return 0;
 }
 
+// Never written: compared against to spot free blocks and written to free them.
+static char zeros[CHAIN_BATCH * BLOCK_SIZE];
+
 /*
- * write_block: Writes the provided buffer to block number 'block_num' in dd1.
+ * reserve_chain: Finds the 'count' lowest free blocks (all bytes zero, starting
+ * from block 2) for one file in a single pass and takes them from the in-memory
+ * free_block_count; the caller writes the superblock once the data is on disk.
+ * Blocks wholly inside a hole of dd1 are zero without being read; the rest are
+ * read CHAIN_BATCH at a time. Returns 0, or -1 if there are not enough free blocks.
  */
-int write_block(FILE *fp, uint32_t block_num, const void *buffer) {
-    if (fseek(fp, block_num * BLOCK_SIZE, SEEK_SET) != 0) {
-        perror("fseek");
+int reserve_chain(int fd, SuperBlock *sb, uint32_t *blocks, uint32_t count) {
+    if (count > sb->free_block_count) {
+        fprintf(stderr, "No free block available.\n");
+        return -1;
+    }
+    char *buf = malloc((size_t)CHAIN_BATCH * BLOCK_SIZE);
+    if (!buf) {
+        perror("malloc");
         return -1;
     }
-    if (fwrite(buffer, BLOCK_SIZE, 1, fp) != 1) {
-        perror("fwrite");
+    uint32_t found = 0, b = 2;
+    while (found < count && b < sb->total_blocks) {
+        off_t data = lseek(fd, (off_t)b * BLOCK_SIZE, SEEK_DATA);
+        if (data < 0)  // ENXIO: nothing but holes from here; otherwise no SEEK_DATA, read everything
+            data = errno == ENXIO ? (off_t)sb->total_blocks * BLOCK_SIZE : (off_t)b * BLOCK_SIZE;
+        for (; b < data / BLOCK_SIZE && b < sb->total_blocks && found < count; b++)
+            blocks[found++] = b;
+        if (found == count || b >= sb->total_blocks)
+            break;
+
+        uint32_t n = sb->total_blocks - b < CHAIN_BATCH ? sb->total_blocks - b : CHAIN_BATCH;
+        off_t hole = lseek(fd, (off_t)b * BLOCK_SIZE, SEEK_HOLE);
+        if (hole > (off_t)b * BLOCK_SIZE && (hole + BLOCK_SIZE - 1) / BLOCK_SIZE - b < n)
+            n = (hole + BLOCK_SIZE - 1) / BLOCK_SIZE - b;
+        ssize_t got = bd_pread(fd, buf, (size_t)n * BLOCK_SIZE, (off_t)b * BLOCK_SIZE);
+        if (got < BLOCK_SIZE)
+            break;  // end of dd1 or a read error: no more blocks to offer
+        n = got / BLOCK_SIZE;
+        for (uint32_t i = 0; i < n && found < count; i++)
+            if (memcmp(buf + (size_t)i * BLOCK_SIZE, zeros, BLOCK_SIZE) == 0)
+                blocks[found++] = b + i;
+        b += n;
+    }
+    free(buf);
+    if (found < count) {
+        fprintf(stderr, "No free block available.\n");
         return -1;
     }
+    sb->free_block_count -= count;
     return 0;
 }
 
 /*
- * allocate_block: Naively searches for a free block (all bytes zero)
- * starting from block 2 (since blocks 0 and 1 are reserved).
- * When found, it “allocates” the block by initializing it (and sets its
- * next pointer to 0) then updates the superblock's free count.
+ * write_chain: Writes filesize bytes from src into the reserved chain, each block
+ * holding DATA_SIZE bytes followed by the number of the next block (0 in the last).
+ * The source is read CHAIN_BATCH blocks at a time and each run of consecutive
+ * block numbers goes out in one pwritev.
  */
-uint32_t allocate_block(FILE *fp, SuperBlock *sb) {
-    char buffer[BLOCK_SIZE];
-    for (uint32_t i = 2; i < sb->total_blocks; i++) {
-        if (read_block(fp, i, buffer) != 0)
-            continue;
-        int free = 1;
-        for (int j = 0; j < BLOCK_SIZE; j++) {
-            if (buffer[j] != 0) {
-                free = 0;
-                break;
-            }
+int write_chain(int fd, const uint32_t *blocks, uint32_t count, FILE *src, uint32_t filesize) {
+    char *data = malloc((size_t)CHAIN_BATCH * DATA_SIZE);
+    uint32_t next[CHAIN_BATCH];
+    struct iovec iov[2 * CHAIN_BATCH];
+    if (!data) {
+        perror("malloc");
+        return -1;
+    }
+    uint32_t bytes_remaining = filesize;
+    for (uint32_t i = 0; i < count; i += CHAIN_BATCH) {
+        uint32_t n = count - i < CHAIN_BATCH ? count - i : CHAIN_BATCH;
+        size_t to_read = bytes_remaining < n * DATA_SIZE ? bytes_remaining : n * DATA_SIZE;
+        if (fread(data, 1, to_read, src) != to_read) {
+            perror("fread");
+            free(data);
+            return -1;
         }
-        if (free) {
-            memset(buffer, 0, BLOCK_SIZE);
-            uint32_t next = 0;
-            memcpy(buffer + BLOCK_SIZE - sizeof(uint32_t), &next, sizeof(uint32_t));
-            write_block(fp, i, buffer);
-            sb->free_block_count--;
-            // Update the superblock on disk.
-            fseek(fp, 0, SEEK_SET);
-            fwrite(sb, sizeof(SuperBlock), 1, fp);
-            return i;
+        memset(data + to_read, 0, n * DATA_SIZE - to_read);  // the last block is zero padded
+        bytes_remaining -= to_read;
+
+        uint32_t run = 0;  // blocks gathered for the current pwritev
+        for (uint32_t j = 0; j < n; j++) {
+            next[j] = i + j + 1 < count ? blocks[i + j + 1] : 0;
+            iov[2 * run].iov_base = data + (size_t)j * DATA_SIZE;
+            iov[2 * run].iov_len = DATA_SIZE;
+            iov[2 * run + 1].iov_base = &next[j];
+            iov[2 * run + 1].iov_len = sizeof(uint32_t);
+            run++;
+            if (j + 1 < n && next[j] == blocks[i + j] + 1)
+                continue;
+            off_t offset = (off_t)blocks[i + j + 1 - run] * BLOCK_SIZE;
+            if (bd_pwritev(fd, iov, 2 * run, offset) != (ssize_t)run * BLOCK_SIZE) {
+                perror("pwritev");
+                free(data);
+                return -1;
+            }
+            run = 0;
         }
     }
-    return 0; // Return 0 on failure (block 0 is reserved, so 0 is invalid)
+    free(data);
+    return 0;
 }
 
 /*
- * free_block: Releases a block by zeroing it and updating the free block count.
+ * read_run: Reads at most 'max' blocks of a chain, starting at 'block', with one
+ * pread and stops where the chain leaves consecutive block numbers. Returns how
+ * many blocks of the chain are in buf (0 on error) and sets *next to the block
+ * that follows them (0 at the end of the chain).
  */
-void free_block(FILE *fp, SuperBlock *sb, uint32_t block_num) {
-    char buffer[BLOCK_SIZE];
-    memset(buffer, 0, BLOCK_SIZE);
-    write_block(fp, block_num, buffer);
-    sb->free_block_count++;
-    fseek(fp, 0, SEEK_SET);
-    fwrite(sb, sizeof(SuperBlock), 1, fp);
+uint32_t read_run(int fd, const SuperBlock *sb, uint32_t block, uint32_t max, char *buf, uint32_t *next) {
+    if (block >= sb->total_blocks) {
+        fprintf(stderr, "Block %u is outside the file system.\n", block);
+        return 0;
+    }
+    uint32_t n = sb->total_blocks - block < max ? sb->total_blocks - block : max;
+    ssize_t got = bd_pread(fd, buf, (size_t)n * BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
+    if (got < BLOCK_SIZE) {
+        perror("pread");
+        return 0;
+    }
+    n = got / BLOCK_SIZE;
+    for (uint32_t j = 0; j < n; j++) {
+        memcpy(next, buf + (size_t)j * BLOCK_SIZE + DATA_SIZE, sizeof(uint32_t));
+        if (*next != block + j + 1 || j + 1 == n)
+            return j + 1;
+    }
+    return n;
+}
+
+/*
+ * free_run: Releases 'count' consecutive blocks by zeroing them with one write
+ * and adds them to the in-memory free_block_count.
+ */
+int free_run(int fd, SuperBlock *sb, uint32_t block, uint32_t count) {
+    if (bd_pwrite(fd, zeros, (size_t)count * BLOCK_SIZE, (off_t)block * BLOCK_SIZE) !=
+        (ssize_t)count * BLOCK_SIZE) {
+        perror("pwrite");
+        return -1;
+    }
+    sb->free_block_count += count;
+    return 0;
 }
 
 /*
  * mycopyto: Copies a Linux file into myfs.
  * Steps:
  * 1. Open the source Linux file and determine its size.
- * 2. Open the dd1 file (our myfs) and read the superblock.
- * 3. Allocate as many blocks as needed to store the file.
- *    For each block, write up to DATA_SIZE bytes from the file.
- *    At the end of each block (last 4 bytes), store the block number of the next block.
- * 4. Create a MyFSEntry descriptor (with name, type, starting block, and size)
- *    and add it to the root directory (for simplicity, we assume the file is added
- *    to the root folder).
+ * 2. Open the dd1 file (our myfs), read the superblock and find an empty slot
+ *    in the root directory (for simplicity, files are always added to the root folder).
+ * 3. Reserve the whole chain of blocks the file needs in one pass over dd1.
+ * 4. Write the data, DATA_SIZE bytes per block; the last 4 bytes of each block
+ *    store the block number of the next block.
+ * 5. Write the superblock once, then the MyFSEntry descriptor (with name, type,
+ *    starting block, and size), so the entry never names unwritten blocks.
  */
 int mycopyto(const char *linuxfile, const char *myfspath) {
     FILE *src = fopen(linuxfile, "rb");
@@ -211,88 +326,80 @@ int mycopyto(const char *linuxfile, const char *myfspath) {
         perror("fopen src");
         return -1;
     }
+    setvbuf(src, NULL, _IONBF, 0);  // write_chain reads whole batches; no copy through a stdio buffer
     
     // Here we assume the myfs file is always named "dd1"
-    FILE *fp = fopen("dd1", "r+b");
-    if (!fp) {
-        perror("fopen dd1");
+    int fd = bd_open("dd1", O_RDWR, 0);
+    if (fd < 0) {
+        perror("open dd1");
         fclose(src);
         return -1;
     }
     
     // Read superblock.
     SuperBlock sb;
-    fseek(fp, 0, SEEK_SET);
-    fread(&sb, sizeof(SuperBlock), 1, fp);
+    bd_pread(fd, &sb, sizeof(SuperBlock), 0);
     
     // Determine source file size.
     fseek(src, 0, SEEK_END);
-    uint32_t filesize = ftell(src);
+    long srcsize = ftell(src);
     fseek(src, 0, SEEK_SET);
-    
-    uint32_t first_block = 0, current_block = 0;
-    char block_data[BLOCK_SIZE];
-    uint32_t bytes_remaining = filesize;
-    
-    // Allocate and write blocks, chaining them via the last 4 bytes.
-    while (bytes_remaining > 0) {
-        uint32_t new_block = allocate_block(fp, &sb);
-        if (new_block == 0) {
-            fprintf(stderr, "No free block available.\n");
-            fclose(src);
-            fclose(fp);
-            return -1;
-        }
-        if (first_block == 0) {
-            first_block = new_block;
-            current_block = new_block;
-        } else {
-            // Update previous block's last 4 bytes with new_block number.
-            memcpy(block_data + BLOCK_SIZE - sizeof(uint32_t), &new_block, sizeof(uint32_t));
-            write_block(fp, current_block, block_data);
-            current_block = new_block;
-        }
-        
-        memset(block_data, 0, BLOCK_SIZE);
-        uint32_t to_read = (bytes_remaining > DATA_SIZE) ? DATA_SIZE : bytes_remaining;
-        fread(block_data, 1, to_read, src);
-        bytes_remaining -= to_read;
-        // Set the next pointer to 0 for now.
-        uint32_t next = 0;
-        memcpy(block_data + BLOCK_SIZE - sizeof(uint32_t), &next, sizeof(uint32_t));
-        write_block(fp, current_block, block_data);
+    if (srcsize < 0 || srcsize > UINT32_MAX) {
+        fprintf(stderr, "File '%s' is too large for myfs.\n", linuxfile);
+        fclose(src);
+        bd_close(fd);
+        return -1;
     }
+    uint32_t filesize = (uint32_t)srcsize;
     
-    // Create a new directory entry for this file.
-    MyFSEntry entry;
-    memset(&entry, 0, sizeof(MyFSEntry));
-    strncpy(entry.name, myfspath, MAX_NAME_LEN);
-    entry.type = TYPE_FILE;
-    entry.start_block = first_block;
-    entry.size = filesize;
-    
-    // Add the entry into the root directory block (block 1).
+    // Find an empty slot in the root directory block (block 1) before allocating anything.
     char root_dir[BLOCK_SIZE];
-    read_block(fp, sb.root_dir_block, root_dir);
-    int found = 0;
+    read_block(fd, sb.root_dir_block, root_dir);
+    MyFSEntry *slot = NULL;
     for (int i = 0; i < BLOCK_SIZE / sizeof(MyFSEntry); i++) {
         MyFSEntry *e = (MyFSEntry *)(root_dir + i * sizeof(MyFSEntry));
         if (e->name[0] == '\0') {  // empty slot found
-            memcpy(e, &entry, sizeof(MyFSEntry));
-            found = 1;
+            slot = e;
             break;
         }
     }
-    if (!found) {
+    if (!slot) {
         fprintf(stderr, "Root directory is full.\n");
         fclose(src);
-        fclose(fp);
+        bd_close(fd);
+        return -1;
+    }
+    
+    // Reserve the chain up front and write the data blocks into it.
+    uint32_t count = (uint32_t)((filesize + DATA_SIZE - 1) / DATA_SIZE);
+    uint32_t *blocks = malloc(((size_t)count + 1) * sizeof(uint32_t));
+    if (!blocks) {
+        perror("malloc");
+        fclose(src);
+        bd_close(fd);
+        return -1;
+    }
+    if (reserve_chain(fd, &sb, blocks, count) != 0 || write_chain(fd, blocks, count, src, filesize) != 0 ||
+        write_superblock(fd, &sb) != 0) {
+        free(blocks);
+        fclose(src);
+        bd_close(fd);
         return -1;
     }
-    write_block(fp, sb.root_dir_block, root_dir);
     
+    // Create a new directory entry for this file.
+    MyFSEntry entry;
+    memset(&entry, 0, sizeof(MyFSEntry));
+    strncpy(entry.name, myfspath, MAX_NAME_LEN);
+    entry.type = TYPE_FILE;
+    entry.start_block = count ? blocks[0] : 0;
+    entry.size = filesize;
+    memcpy(slot, &entry, sizeof(MyFSEntry));
+    write_block(fd, sb.root_dir_block, root_dir);
+    
+    free(blocks);
     fclose(src);
-    fclose(fp);
+    bd_close(fd);
     printf("File '%s' copied to myfs as '%s'\n", linuxfile, myfspath);
     return 0;
 }
@@ -304,20 +411,20 @@ int mycopyto(const char *linuxfile, const char *myfspath) {
  * 2. Locate the file’s MyFSEntry by matching its name.
  * 3. Using the start_block and the file size, traverse the block chain,
  *    reading up to DATA_SIZE bytes per block and writing to the destination file.
+ *    Consecutive blocks of the chain are read with one pread.
  */
 int mycopyfrom(const char *myfspath, const char *linuxfile) {
-    FILE *fp = fopen("dd1", "rb");
-    if (!fp) {
-        perror("fopen dd1");
+    int fd = bd_open("dd1", O_RDONLY, 0);
+    if (fd < 0) {
+        perror("open dd1");
         return -1;
     }
     
     SuperBlock sb;
-    fseek(fp, 0, SEEK_SET);
-    fread(&sb, sizeof(SuperBlock), 1, fp);
+    bd_pread(fd, &sb, sizeof(SuperBlock), 0);
     
     char root_dir[BLOCK_SIZE];
-    read_block(fp, sb.root_dir_block, root_dir);
+    read_block(fd, sb.root_dir_block, root_dir);
     
     MyFSEntry *entry = NULL;
     for (int i = 0; i < BLOCK_SIZE / sizeof(MyFSEntry); i++) {
@@ -329,39 +436,55 @@ int mycopyfrom(const char *myfspath, const char *linuxfile) {
     }
     if (entry == NULL) {
         fprintf(stderr, "File not found in myfs.\n");
-        fclose(fp);
+        bd_close(fd);
         return -1;
     }
     
     if (entry->type != TYPE_FILE) {
         fprintf(stderr, "Specified path is not a file.\n");
-        fclose(fp);
+        bd_close(fd);
         return -1;
     }
     
     FILE *dst = fopen(linuxfile, "wb");
     if (!dst) {
         perror("fopen dst");
-        fclose(fp);
+        bd_close(fd);
         return -1;
     }
     
+    char *run = malloc((size_t)CHAIN_BATCH * BLOCK_SIZE);
+    if (!run) {
+        perror("malloc");
+        fclose(dst);
+        bd_close(fd);
+        return -1;
+    }
     uint32_t filesize = entry->size;
     uint32_t current_block = entry->start_block;
-    char block_data[BLOCK_SIZE];
+    int rc = 0;
     while (filesize > 0 && current_block != 0) {
-        read_block(fp, current_block, block_data);
-        uint32_t to_write = (filesize > DATA_SIZE) ? DATA_SIZE : filesize;
-        fwrite(block_data, 1, to_write, dst);
-        filesize -= to_write;
-        // Get the next block pointer from the last 4 bytes.
-        memcpy(&current_block, block_data + BLOCK_SIZE - sizeof(uint32_t), sizeof(uint32_t));
+        uint32_t left = (uint32_t)((filesize + DATA_SIZE - 1) / DATA_SIZE);
+        uint32_t next_block;
+        uint32_t n = read_run(fd, &sb, current_block, left < CHAIN_BATCH ? left : CHAIN_BATCH, run, &next_block);
+        if (n == 0) {
+            rc = -1;
+            break;
+        }
+        for (uint32_t j = 0; j < n; j++) {
+            uint32_t to_write = (filesize > DATA_SIZE) ? DATA_SIZE : filesize;
+            fwrite(run + (size_t)j * BLOCK_SIZE, 1, to_write, dst);
+            filesize -= to_write;
+        }
+        current_block = next_block;
     }
     
+    free(run);
     fclose(dst);
-    fclose(fp);
-    printf("File '%s' copied from myfs to '%s'\n", myfspath, linuxfile);
-    return 0;
+    bd_close(fd);
+    if (rc == 0)
+        printf("File '%s' copied from myfs to '%s'\n", myfspath, linuxfile);
+    return rc;
 }
 
 /*
@@ -369,22 +492,22 @@ int mycopyfrom(const char *myfspath, const char *linuxfile) {
  * Steps:
  * 1. Open dd1 and read the superblock and root directory.
  * 2. Locate the file’s directory entry in the root directory.
- * 3. Traverse the chain of blocks used by the file, freeing each block.
+ * 3. Traverse the chain of blocks used by the file, freeing each run of
+ *    consecutive blocks with one write, then write the superblock once.
  * 4. Remove the directory entry (clear it) from the root directory.
  */
 int myrm(const char *myfspath) {
-    FILE *fp = fopen("dd1", "r+b");
-    if (!fp) {
-        perror("fopen dd1");
+    int fd = bd_open("dd1", O_RDWR, 0);
+    if (fd < 0) {
+        perror("open dd1");
         return -1;
     }
     
     SuperBlock sb;
-    fseek(fp, 0, SEEK_SET);
-    fread(&sb, sizeof(SuperBlock), 1, fp);
+    bd_pread(fd, &sb, sizeof(SuperBlock), 0);
     
     char root_dir[BLOCK_SIZE];
-    read_block(fp, sb.root_dir_block, root_dir);
+    read_block(fd, sb.root_dir_block, root_dir);
     
     int found_index = -1;
     MyFSEntry entry;
@@ -398,33 +521,48 @@ int myrm(const char *myfspath) {
     }
     if (found_index == -1) {
         fprintf(stderr, "File not found in myfs.\n");
-        fclose(fp);
+        bd_close(fd);
         return -1;
     }
     
     if (entry.type != TYPE_FILE) {
         fprintf(stderr, "Specified path is not a file.\n");
-        fclose(fp);
+        bd_close(fd);
         return -1;
     }
     
-    // Free the chain of blocks.
+    char *run = malloc((size_t)CHAIN_BATCH * BLOCK_SIZE);
+    if (!run) {
+        perror("malloc");
+        bd_close(fd);
+        return -1;
+    }
+    
+    // Free the chain of blocks; its length follows from the file size.
     uint32_t current_block = entry.start_block;
-    char block_data[BLOCK_SIZE];
-    while (current_block != 0) {
-        read_block(fp, current_block, block_data);
-        uint32_t next_block = 0;
-        memcpy(&next_block, block_data + BLOCK_SIZE - sizeof(uint32_t), sizeof(uint32_t));
-        free_block(fp, &sb, current_block);
+    uint32_t left = (uint32_t)((entry.size + DATA_SIZE - 1) / DATA_SIZE);
+    int rc = 0;
+    while (current_block != 0 && left > 0) {
+        uint32_t next_block;
+        uint32_t n = read_run(fd, &sb, current_block, left < CHAIN_BATCH ? left : CHAIN_BATCH, run, &next_block);
+        if (n == 0 || free_run(fd, &sb, current_block, n) != 0) {
+            rc = -1;
+            break;
+        }
+        left -= n;
         current_block = next_block;
     }
+    free(run);
+    if (write_superblock(fd, &sb) != 0)
+        rc = -1;
     
     // Remove the directory entry.
     memset(root_dir + found_index * sizeof(MyFSEntry), 0, sizeof(MyFSEntry));
-    write_block(fp, sb.root_dir_block, root_dir);
+    write_block(fd, sb.root_dir_block, root_dir);
     
-    fclose(fp);
-    printf("File '%s' removed from myfs.\n", myfspath);
-    return 0;
+    bd_close(fd);
+    if (rc == 0)
+        printf("File '%s' removed from myfs.\n", myfspath);
+    return rc;
 }
 
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE               // F_OFD_SETLKW
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -7,12 +8,27 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <libgen.h>
+#include <time.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if defined(__SSE2__) || (defined(__x86_64__) && defined(__GNUC__))
+#include <immintrin.h>        // SSE2 entry match; AVX2 one chosen at run time
+#endif
+#include "../blockdev.h"          // Image I/O: backend, page cache and counters shared with 8.1/8.3
 
 // ----------------------------------------------------------------
 // Constants
 // ----------------------------------------------------------------
 #define MAX_NAME_LEN 12           // Maximum length for file/dir name
-#define DESCRIPTOR_SIZE 21        // Fixed size for each directory entry (12+1+4+4)
+#define DESCRIPTOR_SIZE 32        // Fixed size for each directory entry (4+1+1+2+12+4+4+4)
+#define MYFS_VERSION 5            // On-disk format: 32-byte hashed entries, packed file tails, usage counters,
+                                  // allocation groups
+#define MYFS_COUNTERS_VERSION 4   // First version whose superblock keeps usage counters
+#define MYFS_MIN_VERSION 2        // Version 2 images (no fragment blocks) are still readable
 // We use dynamic block sizes; block size is stored in the superblock.
 #define ENTRY_PER_BLOCK(bs) ((bs - sizeof(uint32_t)) / sizeof(MyFSEntry))
 // Last 4 bytes of any block are reserved as "next block" pointer for chaining
@@ -21,6 +37,48 @@
 #define FILE_TYPE 1
 #define DIR_TYPE  2
 
+// Snapshots are reached read-only through this top-level path component.
+#define SNAP_DIR_NAME ".snap"
+
+// fcntl OFD byte-range locks let several processes share one image. Lock keys:
+//   superblock bytes        allocator state (free chain head, root pointer, counters)
+//   LOCK_TREE_OFF           shared by every mutating command, exclusive for snapshots
+//   LOCK_ROOT_OFF           root directory (its head block moves when copied on write)
+//   LOCK_FRAG_OFF           fragment blocks and the fragment list
+//   first byte of a block   any other directory, keyed by its head block
+//   refcount table entry    that block's reference count
+// Directories are always locked top-down and one at a time (hand over hand), and the
+// allocator and refcount locks are only held for a single update, so there is no cycle.
+// Locks still held when a command closes the image are released by close().
+// The fixed keys lie past the end of the image, so with any block size they cannot
+// share a byte with a block or refcount key (locks on one open file merge).
+#define LOCK_END(sb) ((off_t)(sb)->total_blocks * (sb)->block_size)
+#define LOCK_TREE_OFF(sb) (LOCK_END(sb) + 0)
+#define LOCK_ROOT_OFF(sb) (LOCK_END(sb) + 1)
+#define LOCK_FRAG_OFF(sb) (LOCK_END(sb) + 2)
+
+// Tail packing: a file's last partial block, if it fills at most half a block, is
+// stored as a fragment inside a shared fragment block instead of a block of its own.
+// A fragment block starts with a bitmap of FRAG_UNIT-byte units (the units under the
+// bitmap are permanently in use) and ends with the usual next pointer, which links all
+// fragment blocks into one list. Each fragment starts with a FragHeader.
+#define FRAG_UNIT 64
+#define FRAG_SCAN_LIMIT 16        // Fragment blocks searched before starting a new one
+#define FRAG_UNITS(bs) (((bs) - sizeof(uint32_t)) / FRAG_UNIT)
+
+// Block placement. Version 5 images split the blocks into at most MYFS_GROUPS
+// allocation groups and keep a bitmap of the blocks on the free chain; free blocks
+// also store their predecessor in the chain in their first 4 bytes, so any free
+// block can be unlinked in O(1). Under the "group" policy (the default on such
+// images) file blocks go to the first free block at or after the previous block
+// of the file (the parent directory for the first one), and new directories go
+// to a group with at least the average number of free blocks, chosen by hashing
+// the parent and name so sibling directories spread out. MYFS_ALLOC=chain
+// restores plain free-chain order.
+#define MYFS_GROUPS 32
+#define ALLOC_GROUP 0
+#define ALLOC_CHAIN 1
+
 // ----------------------------------------------------------------
 // Data Structures
 // ----------------------------------------------------------------
@@ -31,17 +89,81 @@ typedef struct {
     uint32_t total_blocks;     // Total number of blocks in fs
     uint32_t first_free_block; // Free block chain pointer
     uint32_t root_dir_block;   // Block number for root directory (we use block 1)
+    uint32_t refcount_block;   // First block of the 16-bit per-block reference count table (0 = none)
+    uint32_t snap_dir_block;   // Directory block listing snapshot roots (0 = none)
+    uint32_t version;          // MYFS_VERSION
+    uint32_t snap_count;       // Live snapshots; directory blocks can only be shared while > 0
+    uint32_t frag_head;        // First fragment block (0 = none)
+    // Usage counters (version >= MYFS_COUNTERS_VERSION), updated under the superblock lock.
+    uint32_t free_blocks;      // Blocks on the free chain
+    uint32_t used_blocks;      // All other blocks, metadata included
+    uint32_t inode_count;      // Files and directories reachable from the root, root included
+    uint32_t entry_count;      // Directory entries stored on disk, snapshot copies included
+    uint32_t free_map_block;   // First block of the free-block bitmap (0 = none: chain order only)
+    uint32_t group_blocks;     // Blocks per allocation group (a multiple of 64)
+    uint32_t group_free[MYFS_GROUPS]; // Free blocks in each group
+    uint32_t mod_count;        // Bumped by every superblock update (0 on images from older builds)
 } SuperBlock;
 
-// Directory entry (MyFSEntry) is exactly 21 bytes.
-#pragma pack(push, 1)
+// Directory entry (MyFSEntry) is exactly 32 bytes, so entries never straddle a
+// cache line. The name hash leads the record so a block's hashes sit at a fixed
+// stride and can be compared several at a time; name_len == 0 marks a free slot.
 typedef struct {
-    char name[MAX_NAME_LEN];   // 12 bytes: name (padded with 0 if needed)
+    uint32_t name_hash;        // 4 bytes: FNV-1a hash of the name
+    uint8_t name_len;          // 1 byte: length of name (0 = free slot)
     uint8_t type;              // 1 byte: FILE_TYPE or DIR_TYPE
+    uint16_t tail_offset;      // 2 bytes: offset of the tail fragment in tail_block
+    char name[MAX_NAME_LEN];   // 12 bytes: name (padded with 0 if needed, not terminated at 12)
     uint32_t start_block;      // 4 bytes: pointer to first data block (or dir block)
     uint32_t size;             // 4 bytes: file size (or for dir: total bytes used for descriptors)
+    uint32_t tail_block;       // 4 bytes: fragment block holding the file tail (0 = no tail)
 } MyFSEntry;
-#pragma pack(pop)
+
+// Header in front of every fragment; the fragment is shared like a block.
+typedef struct {
+    uint16_t refcount;         // Entries pointing at this fragment
+    uint16_t units;            // FRAG_UNITs covered, header included
+} FragHeader;
+
+_Static_assert(sizeof(MyFSEntry) == DESCRIPTOR_SIZE, "MyFSEntry must be 32 bytes");
+
+// Per-command I/O statistics, enabled with --stats or MYFS_STATS=1 and
+// reported as one JSON object on stderr when the command finishes.
+#define LAT_BUCKETS 32            // Latency histogram bucket i counts calls taking < 2^i ns
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[LAT_BUCKETS];
+} LatencyHist;
+
+typedef struct {
+    int enabled;
+    uint64_t block_reads;
+    uint64_t block_writes;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t superblock_reads;
+    uint64_t superblock_writes;
+    uint64_t refcount_reads;
+    uint64_t refcount_writes;
+    uint64_t blocks_allocated;
+    uint64_t blocks_freed;
+    uint64_t dir_blocks_scanned;
+    uint64_t dcache_hits;
+    uint64_t dcache_negative_hits;
+    uint64_t dcache_misses;
+    uint64_t fragments_allocated;
+    uint64_t fragments_freed;
+    uint64_t freemap_reads;
+    uint64_t freemap_writes;
+    LatencyHist read_latency;
+    LatencyHist write_latency;
+} IoStats;
+
+static IoStats stats;
+static int alloc_policy = ALLOC_GROUP;    // MYFS_ALLOC=group|chain
 
 // ----------------------------------------------------------------
 // Helper Functions
@@ -65,14 +187,241 @@ int parse_path(const char *fullpath, char **fsname, char **path) {
     return 0;
 }
 
+/*
+ * name_hash: 32-bit FNV-1a hash of the first len bytes of name.
+ */
+uint32_t name_hash(const char *name, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * entry_set_name: Stores name (truncated to MAX_NAME_LEN) with its length and hash.
+ */
+void entry_set_name(MyFSEntry *entry, const char *name) {
+    size_t len = strnlen(name, MAX_NAME_LEN);
+    memset(entry->name, 0, MAX_NAME_LEN);
+    memcpy(entry->name, name, len);
+    entry->name_len = (uint8_t)len;
+    entry->name_hash = name_hash(name, len);
+}
+
+/*
+ * stats_now_ns: Monotonic clock in nanoseconds (0 while statistics are off).
+ */
+static uint64_t stats_now_ns(void) {
+    if (!stats.enabled) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/*
+ * stats_record_latency: Adds one call that started at start_ns to hist.
+ */
+static void stats_record_latency(LatencyHist *hist, uint64_t start_ns) {
+    if (!stats.enabled) return;
+    uint64_t ns = stats_now_ns() - start_ns;
+    int bucket = 0;
+    while (bucket < LAT_BUCKETS - 1 && ns >= (1ull << bucket)) bucket++;
+    hist->count++;
+    hist->sum_ns += ns;
+    if (ns > hist->max_ns) hist->max_ns = ns;
+    hist->buckets[bucket]++;
+}
+
+/*
+ * stats_print_latency: Emits hist as a JSON object; only non-empty buckets are listed.
+ */
+static void stats_print_latency(FILE *out, const char *name, const LatencyHist *hist) {
+    fprintf(out, "\"%s\":{\"count\":%llu,\"sum_ns\":%llu,\"max_ns\":%llu,\"buckets\":[",
+            name, (unsigned long long)hist->count, (unsigned long long)hist->sum_ns,
+            (unsigned long long)hist->max_ns);
+    int first = 1;
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+        if (!hist->buckets[i]) continue;
+        fprintf(out, "%s{\"lt_ns\":%llu,\"count\":%llu}", first ? "" : ",",
+                1ull << i, (unsigned long long)hist->buckets[i]);
+        first = 0;
+    }
+    fprintf(out, "]}");
+}
+
+/*
+ * stats_print: Emits the statistics of one command as a single-line JSON object.
+ */
+static void stats_print(FILE *out, const char *command, int status, uint64_t elapsed_ns) {
+    fprintf(out, "{\"command\":\"%s\",\"status\":%d,\"elapsed_ns\":%llu,", command, status,
+            (unsigned long long)elapsed_ns);
+    fprintf(out, "\"block_reads\":%llu,\"block_writes\":%llu,\"bytes_read\":%llu,\"bytes_written\":%llu,",
+            (unsigned long long)stats.block_reads, (unsigned long long)stats.block_writes,
+            (unsigned long long)stats.bytes_read, (unsigned long long)stats.bytes_written);
+    fprintf(out, "\"superblock_reads\":%llu,\"superblock_writes\":%llu,",
+            (unsigned long long)stats.superblock_reads, (unsigned long long)stats.superblock_writes);
+    fprintf(out, "\"refcount_reads\":%llu,\"refcount_writes\":%llu,",
+            (unsigned long long)stats.refcount_reads, (unsigned long long)stats.refcount_writes);
+    fprintf(out, "\"blocks_allocated\":%llu,\"blocks_freed\":%llu,\"dir_blocks_scanned\":%llu,",
+            (unsigned long long)stats.blocks_allocated, (unsigned long long)stats.blocks_freed,
+            (unsigned long long)stats.dir_blocks_scanned);
+    fprintf(out, "\"fragments_allocated\":%llu,\"fragments_freed\":%llu,",
+            (unsigned long long)stats.fragments_allocated, (unsigned long long)stats.fragments_freed);
+    fprintf(out, "\"freemap_reads\":%llu,\"freemap_writes\":%llu,",
+            (unsigned long long)stats.freemap_reads, (unsigned long long)stats.freemap_writes);
+    fprintf(out, "\"dcache_hits\":%llu,\"dcache_negative_hits\":%llu,\"dcache_misses\":%llu,",
+            (unsigned long long)stats.dcache_hits, (unsigned long long)stats.dcache_negative_hits,
+            (unsigned long long)stats.dcache_misses);
+    fprintf(out, "\"blockdev\":{\"backend\":\"%s\",\"reads\":%llu,\"writes\":%llu,\"cache_hits\":%llu,"
+            "\"cache_misses\":%llu,\"syncs\":%llu},", bd_backend_name(bd_backend),
+            (unsigned long long)bd_stats.reads, (unsigned long long)bd_stats.writes,
+            (unsigned long long)bd_stats.cache_hits, (unsigned long long)bd_stats.cache_misses,
+            (unsigned long long)bd_stats.syncs);
+    stats_print_latency(out, "read_block_latency", &stats.read_latency);
+    fprintf(out, ",");
+    stats_print_latency(out, "write_block_latency", &stats.write_latency);
+    fprintf(out, "}\n");
+}
+
+// ----------------------------------------------------------------
+// Dentry cache
+// ----------------------------------------------------------------
+
+// Batch mode runs many commands in one process, so dir_find_entry results are kept
+// in a hash table keyed by (directory head block, name), including negative
+// results. Inserts and removals forget the affected key; freeing or copying a
+// directory block flushes everything, since cached block numbers may then be
+// stale. Other processes are noticed through the superblock's modification
+// counter, which every mutating command bumps before releasing its locks: the
+// superblock is re-read after each directory lock is taken, and a counter other
+// than the one this process last read or wrote flushes the cache.
+#define DCACHE_BUCKETS 4096
+#define DCACHE_MAX 16384          // Entries kept before the cache is flushed
+
+typedef struct {
+    uint32_t parent;           // Head block of the directory searched
+    int32_t next;              // Next entry in the bucket (-1 = end)
+    uint8_t found;             // 0 = negative entry: the name is known to be absent
+    int entry_index;
+    uint32_t found_block;
+    MyFSEntry entry;           // For negative entries only the name fields are set
+} Dentry;
+
+static struct {
+    int enabled;
+    dev_t dev;                 // Image the cache describes
+    ino_t ino;
+    SuperBlock sb;             // Superblock as last read or written by this process
+    int32_t buckets[DCACHE_BUCKETS];
+    Dentry *entries;
+    int32_t count;
+} dcache;
+
+static void dcache_flush(void) {
+    memset(dcache.buckets, 0xff, sizeof(dcache.buckets));
+    dcache.count = 0;
+}
+
+/*
+ * dcache_enable: Turns the cache on for the rest of the process.
+ */
+int dcache_enable(void) {
+    dcache.entries = malloc(DCACHE_MAX * sizeof(Dentry));
+    if (!dcache.entries) return -1;
+    dcache_flush();
+    dcache.enabled = 1;
+    return 0;
+}
+
+/*
+ * dcache_sync: Called with every superblock read from fd: flushes the cache if
+ * fd is another image or another process modified it since this one last looked.
+ */
+static void dcache_sync(int fd, const SuperBlock *sb) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_dev != dcache.dev || st.st_ino != dcache.ino ||
+        sb->mod_count != dcache.sb.mod_count) {
+        dcache_flush();
+        dcache.dev = st.st_dev;
+        dcache.ino = st.st_ino;
+    }
+    dcache.sb = *sb;
+}
+
+static uint32_t dcache_bucket(uint32_t parent, uint32_t hash) {
+    return (parent * 2654435761u ^ hash) % DCACHE_BUCKETS;
+}
+
+/*
+ * dcache_lookup: Returns the cached entry for (parent, name), or NULL on a miss.
+ */
+static Dentry *dcache_lookup(uint32_t parent, const char *name, size_t len, uint32_t hash) {
+    if (!dcache.enabled) return NULL;
+    for (int32_t i = dcache.buckets[dcache_bucket(parent, hash)]; i >= 0; i = dcache.entries[i].next) {
+        Dentry *d = &dcache.entries[i];
+        if (d->parent == parent && d->entry.name_hash == hash && d->entry.name_len == len &&
+            memcmp(d->entry.name, name, len) == 0)
+            return d;
+    }
+    return NULL;
+}
+
+/*
+ * dcache_insert: Records the outcome of a directory search (entry NULL: not found).
+ */
+static void dcache_insert(uint32_t parent, const char *name, const MyFSEntry *entry,
+                          uint32_t found_block, int entry_index) {
+    if (!dcache.enabled) return;
+    if (dcache.count == DCACHE_MAX) dcache_flush();
+    Dentry *d = &dcache.entries[dcache.count];
+    memset(d, 0, sizeof(*d));
+    d->parent = parent;
+    if (entry) {
+        d->found = 1;
+        d->entry = *entry;
+        d->found_block = found_block;
+        d->entry_index = entry_index;
+    } else {
+        entry_set_name(&d->entry, name);
+    }
+    uint32_t b = dcache_bucket(parent, d->entry.name_hash);
+    d->next = dcache.buckets[b];
+    dcache.buckets[b] = dcache.count++;
+}
+
+/*
+ * dcache_forget: Drops the cached entry for (parent, name) after the directory changed.
+ */
+void dcache_forget(uint32_t parent, const char *name) {
+    if (!dcache.enabled) return;
+    size_t len = strnlen(name, MAX_NAME_LEN);
+    uint32_t hash = name_hash(name, len);
+    for (int32_t *link = &dcache.buckets[dcache_bucket(parent, hash)]; *link >= 0; link = &dcache.entries[*link].next) {
+        Dentry *d = &dcache.entries[*link];
+        if (d->parent == parent && d->entry.name_hash == hash && d->entry.name_len == len &&
+            memcmp(d->entry.name, name, len) == 0) {
+            *link = d->next;
+            return;
+        }
+    }
+}
+
 /*
  * read_superblock: Reads superblock (block 0) from fd.
  */
 int read_superblock(int fd, SuperBlock *sb) {
-    if (pread(fd, sb, sizeof(SuperBlock), 0) != sizeof(SuperBlock)) {
+    stats.superblock_reads++;
+    if (bd_pread(fd, sb, sizeof(SuperBlock), 0) != sizeof(SuperBlock)) {
         perror("read_superblock");
         return -1;
     }
+    if (sb->version < MYFS_MIN_VERSION || sb->version > MYFS_VERSION) {
+        fprintf(stderr, "read_superblock: Unsupported format version %u (re-run mymkfs)\n", sb->version);
+        return -1;
+    }
+    if (dcache.enabled) dcache_sync(fd, sb);
     return 0;
 }
 
@@ -80,10 +429,12 @@ int read_superblock(int fd, SuperBlock *sb) {
  * write_superblock: Writes superblock to block 0.
  */
 int write_superblock(int fd, SuperBlock *sb) {
-    if (pwrite(fd, sb, sizeof(SuperBlock), 0) != sizeof(SuperBlock)) {
+    stats.superblock_writes++;
+    if (bd_pwrite(fd, sb, sizeof(SuperBlock), 0) != sizeof(SuperBlock)) {
         perror("write_superblock");
         return -1;
     }
+    if (dcache.enabled) dcache.sb = *sb;
     return 0;
 }
 
@@ -91,11 +442,15 @@ int write_superblock(int fd, SuperBlock *sb) {
  * read_block: Reads a block (by number) into buffer.
  */
 int read_block(int fd, uint32_t block_num, void *buffer, uint32_t bs) {
-    off_t offset = block_num * bs;
-    if (pread(fd, buffer, bs, offset) != bs) {
+    off_t offset = (off_t)block_num * bs;
+    uint64_t start = stats_now_ns();
+    if (bd_pread(fd, buffer, bs, offset) != bs) {
         perror("read_block");
         return -1;
     }
+    stats_record_latency(&stats.read_latency, start);
+    stats.block_reads++;
+    stats.bytes_read += bs;
     return 0;
 }
 
@@ -103,137 +458,838 @@ int read_block(int fd, uint32_t block_num, void *buffer, uint32_t bs) {
  * write_block: Writes buffer to block number block_num.
  */
 int write_block(int fd, uint32_t block_num, const void *buffer, uint32_t bs) {
-    off_t offset = block_num * bs;
-    if (pwrite(fd, buffer, bs, offset) != bs) {
+    off_t offset = (off_t)block_num * bs;
+    uint64_t start = stats_now_ns();
+    if (bd_pwrite(fd, buffer, bs, offset) != bs) {
         perror("write_block");
         return -1;
     }
+    stats_record_latency(&stats.write_latency, start);
+    stats.block_writes++;
+    stats.bytes_written += bs;
+    return 0;
+}
+
+/*
+ * lock_range: Takes an OFD lock (F_RDLCK or F_WRLCK) or releases one (F_UNLCK)
+ * on len bytes at start, waiting for conflicting locks held by other processes.
+ */
+int lock_range(int fd, off_t start, off_t len, short type) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+    while (fcntl(fd, F_OFD_SETLKW, &fl) == -1) {
+        if (errno != EINTR) {
+            perror("lock_range");
+            return -1;
+        }
+    }
+    // Whatever the lock protects may have been written by the previous holder.
+    if (type != F_UNLCK) bd_invalidate(fd);
+    return 0;
+}
+
+/*
+ * unlock_all: Releases every lock this open file description holds on the image.
+ */
+void unlock_all(int fd) {
+    lock_range(fd, 0, 0, F_UNLCK);
+}
+
+/*
+ * dir_lock_offset: Lock key of the directory whose head block is dir_block.
+ */
+off_t dir_lock_offset(SuperBlock *sb, uint32_t dir_block) {
+    if (dir_block == sb->root_dir_block) return LOCK_ROOT_OFF(sb);
+    return (off_t)dir_block * sb->block_size;
+}
+
+/*
+ * superblock_lock: Locks the allocator state and reloads *sb, which another
+ * process may have changed since it was read. Pair with superblock_unlock.
+ */
+int superblock_lock(int fd, SuperBlock *sb) {
+    if (lock_range(fd, 0, sizeof(SuperBlock), F_WRLCK) < 0) return -1;
+    if (read_superblock(fd, sb) < 0) {
+        lock_range(fd, 0, sizeof(SuperBlock), F_UNLCK);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * superblock_unlock: Writes *sb back and releases the allocator lock. The
+ * modification counter moves with every such write, and every mutating command
+ * ends with one after its last block write (see superblock_account), so a reader
+ * that sees the same counter twice knows nothing changed in between.
+ */
+int superblock_unlock(int fd, SuperBlock *sb) {
+    sb->mod_count++;
+    int rc = write_superblock(fd, sb);
+    lock_range(fd, 0, sizeof(SuperBlock), F_UNLCK);
+    return rc;
+}
+
+/*
+ * superblock_account: Adds the given deltas to the inode and entry counters and
+ * bumps the modification counter. Called last by every command that changes a
+ * directory, on images of any version.
+ */
+void superblock_account(int fd, SuperBlock *sb, int inodes, int entries) {
+    if (superblock_lock(fd, sb) < 0) return;
+    if (sb->version >= MYFS_COUNTERS_VERSION) {
+        sb->inode_count += inodes;
+        sb->entry_count += entries;
+    }
+    superblock_unlock(fd, sb);
+}
+
+/*
+ * dir_live_entries: Number of used slots in a directory block.
+ */
+int dir_live_entries(SuperBlock *sb, const char *buffer) {
+    int n = ENTRY_PER_BLOCK(sb->block_size), live = 0;
+    const MyFSEntry *entries = (const MyFSEntry *)buffer;
+    for (int i = 0; i < n; i++)
+        if (entries[i].name_len) live++;
+    return live;
+}
+
+/*
+ * get_refcount: Returns the number of pointers to block. Images formatted
+ * without a reference count table never share blocks, so every block counts 1.
+ */
+uint16_t get_refcount(int fd, SuperBlock *sb, uint32_t block) {
+    if (sb->refcount_block == 0) return 1;
+    uint16_t rc;
+    off_t offset = (off_t)sb->refcount_block * sb->block_size + (off_t)block * sizeof(uint16_t);
+    stats.refcount_reads++;
+    if (bd_pread(fd, &rc, sizeof(rc), offset) != sizeof(rc)) {
+        perror("get_refcount");
+        return 1;
+    }
+    return rc;
+}
+
+/*
+ * set_refcount: Stores the reference count of block in the table.
+ */
+int set_refcount(int fd, SuperBlock *sb, uint32_t block, uint16_t rc) {
+    if (sb->refcount_block == 0) return 0;
+    off_t offset = (off_t)sb->refcount_block * sb->block_size + (off_t)block * sizeof(uint16_t);
+    stats.refcount_writes++;
+    if (bd_pwrite(fd, &rc, sizeof(rc), offset) != sizeof(rc)) {
+        perror("set_refcount");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * adjust_refcount: Adds delta to the reference count of block under that entry's
+ * lock and returns the new count (0 on images without a table).
+ */
+int adjust_refcount(int fd, SuperBlock *sb, uint32_t block, int delta) {
+    if (sb->refcount_block == 0) return 0;
+    off_t offset = (off_t)sb->refcount_block * sb->block_size + (off_t)block * sizeof(uint16_t);
+    if (lock_range(fd, offset, sizeof(uint16_t), F_WRLCK) < 0) return -1;
+    int rc = (int)get_refcount(fd, sb, block) + delta;
+    if (rc < 0 || rc > UINT16_MAX) {
+        fprintf(stderr, "adjust_refcount: Reference count of block %u out of range\n", block);
+        rc = -1;
+    } else {
+        set_refcount(fd, sb, block, (uint16_t)rc);
+    }
+    lock_range(fd, offset, sizeof(uint16_t), F_UNLCK);
+    return rc;
+}
+
+/*
+ * free_link_set: Stores one link of a free block: its predecessor in the chain
+ * (first 4 bytes, version 5 images) or its successor (last 4 bytes).
+ */
+static int free_link_set(int fd, SuperBlock *sb, uint32_t block, int successor, uint32_t value) {
+    off_t offset = (off_t)block * sb->block_size + (successor ? sb->block_size - sizeof(uint32_t) : 0);
+    if (bd_pwrite(fd, &value, sizeof(value), offset) != sizeof(value)) {
+        perror("free_link_set");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * freemap_mark: Records in the free-block bitmap and the group counts whether
+ * block is on the free chain. Called with the superblock lock held.
+ */
+static int freemap_mark(int fd, SuperBlock *sb, uint32_t block, int is_free) {
+    if (sb->free_map_block == 0) return 0;
+    off_t offset = (off_t)sb->free_map_block * sb->block_size + block / 8;
+    uint8_t byte;
+    stats.freemap_reads++;
+    if (bd_pread(fd, &byte, 1, offset) != 1) {
+        perror("freemap_mark");
+        return -1;
+    }
+    byte = is_free ? (byte | (1u << (block % 8))) : (byte & ~(1u << (block % 8)));
+    stats.freemap_writes++;
+    if (bd_pwrite(fd, &byte, 1, offset) != 1) {
+        perror("freemap_mark");
+        return -1;
+    }
+    if (is_free) sb->group_free[block / sb->group_blocks]++;
+    else sb->group_free[block / sb->group_blocks]--;
+    return 0;
+}
+
+/*
+ * freemap_scan: Returns the first free block in [from, to), or 0 if there is none.
+ */
+static uint32_t freemap_scan(int fd, SuperBlock *sb, uint32_t from, uint32_t to) {
+    uint64_t words[64];
+    if (to > sb->total_blocks) to = sb->total_blocks;
+    uint32_t word = from / 64;
+    while ((uint64_t)word * 64 < to) {
+        uint32_t count = ((to + 63) / 64 - word < 64) ? (to + 63) / 64 - word : 64;
+        off_t offset = (off_t)sb->free_map_block * sb->block_size + (off_t)word * sizeof(uint64_t);
+        stats.freemap_reads++;
+        if (bd_pread(fd, words, count * sizeof(uint64_t), offset) != (ssize_t)(count * sizeof(uint64_t))) {
+            perror("freemap_scan");
+            return 0;
+        }
+        for (uint32_t i = 0; i < count; i++, word++) {
+            uint64_t bits = words[i];
+            if ((uint64_t)word * 64 < from) bits &= ~0ULL << (from % 64);
+            if (bits == 0) continue;
+            uint32_t block = word * 64 + __builtin_ctzll(bits);
+            return block < to ? block : 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * freemap_find: Returns the first free block at or after goal, trying goal's group
+ * first and then the following groups (wrapping around), or 0 if none is found.
+ * Groups with no free blocks are skipped without reading their part of the bitmap.
+ */
+static uint32_t freemap_find(int fd, SuperBlock *sb, uint32_t goal) {
+    uint32_t gb = sb->group_blocks;
+    uint32_t ngroups = (sb->total_blocks + gb - 1) / gb;
+    uint32_t first = goal / gb;
+    for (uint32_t i = 0; i <= ngroups; i++) {
+        uint32_t g = (first + i) % ngroups;
+        if (sb->group_free[g] == 0) continue;
+        uint32_t from = (i == 0) ? goal : g * gb;
+        uint32_t to = (i == ngroups) ? goal : (g + 1) * gb;
+        uint32_t block = freemap_scan(fd, sb, from, to);
+        if (block != 0) return block;
+    }
     return 0;
 }
 
 /*
- * allocate_block: Allocates a free block from the free-chain.
+ * dir_goal: Placement goal for a new directory called name under parent: the start
+ * of a group with at least the average free space, searched from a group picked by
+ * hashing parent and name.
+ */
+uint32_t dir_goal(SuperBlock *sb, uint32_t parent, const char *name) {
+    if (sb->free_map_block == 0) return 0;
+    uint32_t gb = sb->group_blocks;
+    uint32_t ngroups = (sb->total_blocks + gb - 1) / gb;
+    uint32_t average = sb->free_blocks / ngroups;
+    uint32_t first = (parent * 2654435761u ^ name_hash(name, strnlen(name, MAX_NAME_LEN))) % ngroups;
+    for (uint32_t i = 0; i < ngroups; i++) {
+        uint32_t g = (first + i) % ngroups;
+        if (sb->group_free[g] > 0 && sb->group_free[g] >= average)
+            return g ? g * gb : 1;
+    }
+    return 0;
+}
+
+/*
+ * allocate_block_near: Allocates a free block, as close after goal as the placement
+ * policy allows (goal 0: no preference, take the head of the free chain).
  * In a free block, the last 4 bytes store the next free block pointer.
  */
-uint32_t allocate_block(int fd, SuperBlock *sb) {
+uint32_t allocate_block_near(int fd, SuperBlock *sb, uint32_t goal) {
+    if (superblock_lock(fd, sb) < 0) return 0;
     if (sb->first_free_block == 0) {
+        lock_range(fd, 0, sizeof(SuperBlock), F_UNLCK);
         fprintf(stderr, "allocate_block: No free block available\n");
         return 0;
     }
     uint32_t alloc = sb->first_free_block;
+    if (goal != 0 && sb->free_map_block != 0 && alloc_policy == ALLOC_GROUP) {
+        uint32_t near = freemap_find(fd, sb, goal);
+        if (near != 0) alloc = near;
+    }
     char *buffer = malloc(sb->block_size);
-    if (!buffer) return 0;
-    if (read_block(fd, alloc, buffer, sb->block_size) < 0) {
+    if (!buffer || read_block(fd, alloc, buffer, sb->block_size) < 0) {
+        lock_range(fd, 0, sizeof(SuperBlock), F_UNLCK);
         free(buffer);
         return 0;
     }
-    // Next free block is stored in last 4 bytes.
-    memcpy(&sb->first_free_block, buffer + sb->block_size - sizeof(uint32_t), sizeof(uint32_t));
+    // Unlink the block: next free block is stored in last 4 bytes, the previous one
+    // (version 5 images) in the first 4.
+    uint32_t next, prev = 0;
+    memcpy(&next, buffer + sb->block_size - sizeof(uint32_t), sizeof(uint32_t));
+    if (sb->free_map_block != 0) {
+        memcpy(&prev, buffer, sizeof(uint32_t));
+        if (next != 0) free_link_set(fd, sb, next, 0, prev);
+        freemap_mark(fd, sb, alloc, 0);
+    }
+    if (prev == 0) sb->first_free_block = next;
+    else free_link_set(fd, sb, prev, 1, next);
+    if (sb->version >= MYFS_COUNTERS_VERSION) {
+        sb->free_blocks--;
+        sb->used_blocks++;
+    }
     // Mark allocated block: zero it and set next pointer to 0.
     memset(buffer, 0, sb->block_size);
-    uint32_t next = 0;
-    memcpy(buffer + sb->block_size - sizeof(uint32_t), &next, sizeof(uint32_t));
     write_block(fd, alloc, buffer, sb->block_size);
     free(buffer);
-    write_superblock(fd, sb);
+    superblock_unlock(fd, sb);
+    set_refcount(fd, sb, alloc, 1);
+    stats.blocks_allocated++;
     return alloc;
 }
 
+/*
+ * allocate_block: Allocates a free block with no placement preference.
+ */
+uint32_t allocate_block(int fd, SuperBlock *sb) {
+    return allocate_block_near(fd, sb, 0);
+}
+
 /*
  * free_block: Frees a block by linking it into the free-chain.
  */
 void free_block(int fd, SuperBlock *sb, uint32_t block) {
     char *buffer = malloc(sb->block_size);
     if (!buffer) return;
+    if (superblock_lock(fd, sb) < 0) {
+        free(buffer);
+        return;
+    }
     memset(buffer, 0, sb->block_size);
     // Link freed block to current free-chain head.
     memcpy(buffer + sb->block_size - sizeof(uint32_t), &sb->first_free_block, sizeof(uint32_t));
     write_block(fd, block, buffer, sb->block_size);
+    if (sb->free_map_block != 0) {
+        if (sb->first_free_block != 0) free_link_set(fd, sb, sb->first_free_block, 0, block);
+        freemap_mark(fd, sb, block, 1);
+    }
     sb->first_free_block = block;
-    write_superblock(fd, sb);
+    if (sb->version >= MYFS_COUNTERS_VERSION) {
+        sb->free_blocks++;
+        sb->used_blocks--;
+    }
+    superblock_unlock(fd, sb);
+    stats.blocks_freed++;
     free(buffer);
 }
 
 /*
- * dir_find_entry: Searches a directory (possibly spanning multiple blocks)
- * for an entry with name. Returns 0 on success (entry found) and sets *entry,
- * *block_found (the block number where the entry resides) and *entry_index.
- * Returns -1 if not found.
+ * frag_reserved_units: Units at the start of a fragment block taken by its bitmap.
  */
-int dir_find_entry(int fd, SuperBlock *sb, uint32_t dir_block, const char *name,
-                     MyFSEntry *entry, uint32_t *block_found, int *entry_index) {
-    uint32_t current = dir_block;
-    char *buffer = malloc(sb->block_size);
-    if (!buffer) return -1;
-    while (current != 0) {
-        if (read_block(fd, current, buffer, sb->block_size) < 0) {
-            free(buffer);
-            return -1;
-        }
-        int n = ENTRY_PER_BLOCK(sb->block_size);
-        MyFSEntry *entries = (MyFSEntry *)buffer;
-        for (int i = 0; i < n; i++) {
-            if (entries[i].name[0] && strcmp(entries[i].name, name) == 0) {
-                *entry = entries[i];
-                *block_found = current;
-                *entry_index = i;
-                free(buffer);
-                return 0;
-            }
+static uint32_t frag_reserved_units(uint32_t bs) {
+    uint32_t bitmap_bytes = (FRAG_UNITS(bs) + 7) / 8;
+    return (bitmap_bytes + FRAG_UNIT - 1) / FRAG_UNIT;
+}
+
+/*
+ * frag_fits: Tail packing applies to a tail of len bytes if the image supports it
+ * and the tail (with its header) fills at most half a block.
+ */
+int frag_fits(SuperBlock *sb, uint32_t len) {
+    return sb->version >= 3 && len > 0 && len + sizeof(FragHeader) <= sb->block_size / 2;
+}
+
+/*
+ * frag_find_run: Returns the first unit of a run of need clear bits in bitmap, or -1.
+ */
+static int frag_find_run(const unsigned char *bitmap, uint32_t units, uint32_t need) {
+    uint32_t run = 0;
+    for (uint32_t u = 0; u < units; u++) {
+        if (bitmap[u / 8] & (1 << (u % 8))) {
+            run = 0;
+        } else if (++run == need) {
+            return (int)(u + 1 - need);
         }
-        // Read next directory block pointer from last 4 bytes.
-        uint32_t next;
-        memcpy(&next, buffer + sb->block_size - sizeof(uint32_t), sizeof(uint32_t));
-        current = next;
     }
-    free(buffer);
     return -1;
 }
 
 /*
- * dir_insert_entry: Inserts a new entry into a directory.
- * It traverses the directory chain starting at dir_block.
- * If no free slot is found in the existing blocks, it allocates a new directory block,
- * chains it to the end, and inserts the entry there.
- * Returns 0 on success, -1 on failure.
+ * frag_alloc: Stores len bytes of data as a new fragment with one reference.
+ * Sets *frag_block and *frag_offset; returns 0 on success, -1 on failure.
  */
-int dir_insert_entry(int fd, SuperBlock *sb, uint32_t dir_block, MyFSEntry *new_entry) {
-    uint32_t current = dir_block;
+int frag_alloc(int fd, SuperBlock *sb, const char *data, uint32_t len,
+               uint32_t *frag_block, uint16_t *frag_offset) {
+    uint32_t units = FRAG_UNITS(sb->block_size);
+    uint32_t need = (len + sizeof(FragHeader) + FRAG_UNIT - 1) / FRAG_UNIT;
     char *buffer = malloc(sb->block_size);
     if (!buffer) return -1;
-    uint32_t prev = 0;
-    while (current != 0) {
-        if (read_block(fd, current, buffer, sb->block_size) < 0) {
+    if (lock_range(fd, LOCK_FRAG_OFF(sb), 1, F_WRLCK) < 0 || read_superblock(fd, sb) < 0) {
+        free(buffer);
+        return -1;
+    }
+    uint32_t block = sb->frag_head;
+    int first = -1;
+    for (int scanned = 0; block != 0 && scanned < FRAG_SCAN_LIMIT; scanned++) {
+        if (read_block(fd, block, buffer, sb->block_size) < 0) break;
+        first = frag_find_run((unsigned char *)buffer, units, need);
+        if (first >= 0) break;
+        memcpy(&block, buffer + sb->block_size - sizeof(uint32_t), sizeof(uint32_t));
+    }
+    if (first < 0) {
+        // Start a new fragment block at the head of the list.
+        block = allocate_block(fd, sb);
+        if (block == 0) {
+            lock_range(fd, LOCK_FRAG_OFF(sb), 1, F_UNLCK);
             free(buffer);
             return -1;
         }
-        int n = ENTRY_PER_BLOCK(sb->block_size);
-        MyFSEntry *entries = (MyFSEntry *)buffer;
-        for (int i = 0; i < n; i++) {
-            if (entries[i].name[0] == '\0') {
-                // Found free slot.
-                entries[i] = *new_entry;
-                if (write_block(fd, current, buffer, sb->block_size) < 0) {
-                    free(buffer);
-                    return -1;
-                }
-                free(buffer);
-                return 0;
-            }
+        memset(buffer, 0, sb->block_size);
+        for (uint32_t u = 0; u < frag_reserved_units(sb->block_size); u++)
+            buffer[u / 8] |= 1 << (u % 8);
+        if (superblock_lock(fd, sb) == 0) {
+            memcpy(buffer + sb->block_size - sizeof(uint32_t), &sb->frag_head, sizeof(uint32_t));
+            sb->frag_head = block;
+            superblock_unlock(fd, sb);
         }
-        // No free slot: go to next directory block.
-        memcpy(&prev, buffer + sb->block_size - sizeof(uint32_t), sizeof(uint32_t));
-        if (prev == 0) break;
-        current = prev;
-    }
-    // No free slot in current chain; allocate new directory block.
-    uint32_t new_block = allocate_block(fd, sb);
-    if (new_block == 0) {
-        free(buffer);
+        first = frag_find_run((unsigned char *)buffer, units, need);
+    }
+    for (uint32_t u = first; u < first + need; u++)
+        buffer[u / 8] |= 1 << (u % 8);
+    FragHeader hdr = { 1, (uint16_t)need };
+    memcpy(buffer + first * FRAG_UNIT, &hdr, sizeof(hdr));
+    memcpy(buffer + first * FRAG_UNIT + sizeof(hdr), data, len);
+    int rc = write_block(fd, block, buffer, sb->block_size);
+    lock_range(fd, LOCK_FRAG_OFF(sb), 1, F_UNLCK);
+    free(buffer);
+    if (rc < 0) return -1;
+    *frag_block = block;
+    *frag_offset = (uint16_t)(first * FRAG_UNIT);
+    stats.fragments_allocated++;
+    return 0;
+}
+
+/*
+ * frag_read: Reads len bytes of the fragment at (frag_block, frag_offset) into buf.
+ */
+int frag_read(int fd, SuperBlock *sb, uint32_t frag_block, uint16_t frag_offset, char *buf, uint32_t len) {
+    off_t offset = (off_t)frag_block * sb->block_size + frag_offset + sizeof(FragHeader);
+    if (bd_pread(fd, buf, len, offset) != (ssize_t)len) {
+        perror("frag_read");
         return -1;
     }
-    // Initialize new block as directory block (zeroed, with next pointer 0)
-    char *newbuf = calloc(1, sb->block_size);
+    stats.bytes_read += len;
+    return 0;
+}
+
+/*
+ * frag_incref: Records one more entry pointing at a fragment (clone or copied directory).
+ */
+int frag_incref(int fd, SuperBlock *sb, uint32_t frag_block, uint16_t frag_offset) {
+    off_t offset = (off_t)frag_block * sb->block_size + frag_offset;
+    FragHeader hdr;
+    int rc = -1;
+    if (lock_range(fd, LOCK_FRAG_OFF(sb), 1, F_WRLCK) < 0) return -1;
+    if (bd_pread(fd, &hdr, sizeof(hdr), offset) == sizeof(hdr) && hdr.refcount < UINT16_MAX) {
+        hdr.refcount++;
+        if (bd_pwrite(fd, &hdr, sizeof(hdr), offset) == sizeof(hdr)) rc = 0;
+    }
+    lock_range(fd, LOCK_FRAG_OFF(sb), 1, F_UNLCK);
+    return rc;
+}
+
+/*
+ * frag_release: Drops one reference to a fragment. The last reference clears its
+ * units; a fragment block left empty is unlinked from the list and freed.
+ */
+void frag_release(int fd, SuperBlock *sb, uint32_t frag_block, uint16_t frag_offset) {
+    char *buffer = malloc(sb->block_size);
+    if (!buffer) return;
+    if (lock_range(fd, LOCK_FRAG_OFF(sb), 1, F_WRLCK) < 0) {
+        free(buffer);
+        return;
+    }
+    if (read_block(fd, frag_block, buffer, sb->block_size) < 0) goto out;
+    FragHeader hdr;
+    memcpy(&hdr, buffer + frag_offset, sizeof(hdr));
+    if (hdr.refcount > 1) {
+        hdr.refcount--;
+        memcpy(buffer + frag_offset, &hdr, sizeof(hdr));
+        write_block(fd, frag_block, buffer, sb->block_size);
+        goto out;
+    }
+    uint32_t first = frag_offset / FRAG_UNIT;
+    for (uint32_t u = first; u < first + hdr.units; u++)
+        buffer[u / 8] &= ~(1 << (u % 8));
+    memset(buffer + frag_offset, 0, hdr.units * FRAG_UNIT);
+    stats.fragments_freed++;
+    uint32_t units = FRAG_UNITS(sb->block_size);
+    if (frag_find_run((unsigned char *)buffer, units, units - frag_reserved_units(sb->block_size)) < 0) {
+        write_block(fd, frag_block, buffer, sb->block_size);
+        goto out;
+    }
+    // Empty: unlink it from the fragment list and give the block back.
+    uint32_t next;
+    memcpy(&next, buffer + sb->block_size - sizeof(uint32_t), sizeof(uint32_t));
+    if (read_superblock(fd, sb) < 0) goto out;
+    if (sb->frag_head == frag_block) {
+        if (superblock_lock(fd, sb) == 0) {
+            sb->frag_head = next;
+            superblock_unlock(fd, sb);
+        }
+    } else {
+        uint32_t prev = sb->frag_head;
+        while (prev != 0) {
+            uint32_t link;
+            if (read_block(fd, prev, buffer, sb->block_size) < 0) goto out;
+            memcpy(&link, buffer + sb->block_size - sizeof(uint32_t), sizeof(uint32_t));
+            if (link == frag_block) {
+                memcpy(buffer + sb->block_size - sizeof(uint32_t), &next, sizeof(uint32_t));
+                write_block(fd, prev, buffer, sb->block_size);
+                break;
+            }
+            prev = link;
+        }
+    }
+    if (adjust_refcount(fd, sb, frag_block, -1) == 0)
+        free_block(fd, sb, frag_block);
+out:
+    lock_range(fd, LOCK_FRAG_OFF(sb), 1, F_UNLCK);
+    free(buffer);
+}
+
+/*
+ * incref_block: Records one more pointer to block (a clone, a snapshot or
+ * a copied parent block now shares it).
+ */
+int incref_block(int fd, SuperBlock *sb, uint32_t block) {
+    if (block == 0) return 0;
+    return adjust_refcount(fd, sb, block, 1) < 0 ? -1 : 0;
+}
+
+/*
+ * release_block: Drops one reference to a chain starting at block.
+ * A block is only returned to the free-chain once its count reaches zero,
+ * at which point the references it holds (its next pointer and, for a
+ * directory block, the start blocks of its entries) are dropped as well.
+ */
+void release_block(int fd, SuperBlock *sb, uint32_t block, int is_dir) {
+    char *buffer = malloc(sb->block_size);
+    if (!buffer) return;
+    while (block != 0) {
+        if (adjust_refcount(fd, sb, block, -1) != 0) break;
+        if (read_block(fd, block, buffer, sb->block_size) < 0) break;
+        if (is_dir) {
+            int n = ENTRY_PER_BLOCK(sb->block_size);
+            MyFSEntry *entries = (MyFSEntry *)buffer;
+            superblock_account(fd, sb, 0, -dir_live_entries(sb, buffer));
+            dcache_flush();
+            for (int i = 0; i < n; i++) {
+                if (!entries[i].name_len) continue;
+                release_block(fd, sb, entries[i].start_block, entries[i].type == DIR_TYPE);
+                if (entries[i].tail_block)
+                    frag_release(fd, sb, entries[i].tail_block, entries[i].tail_offset);
+            }
+        }
+        uint32_t next;
+        memcpy(&next, buffer + sb->block_size - sizeof(uint32_t), sizeof(uint32_t));
+        free_block(fd, sb, block);
+        block = next;
+    }
+    free(buffer);
+}
+
+/*
+ * cow_block: Makes block private to the caller. A shared block is copied
+ * into a freshly allocated one, every block it points to gains a reference
+ * and the original loses the caller's reference.
+ * Returns the (possibly new) block number, or 0 on failure.
+ */
+uint32_t cow_block(int fd, SuperBlock *sb, uint32_t block, int is_dir) {
+    uint16_t rc = get_refcount(fd, sb, block);
+    if (rc <= 1) return block;
+    char *buffer = malloc(sb->block_size);
+    if (!buffer) return 0;
+    if (read_block(fd, block, buffer, sb->block_size) < 0) {
+        free(buffer);
+        return 0;
+    }
+    uint32_t copy = allocate_block_near(fd, sb, block);
+    if (copy == 0) {
+        free(buffer);
+        return 0;
+    }
+    if (is_dir) {
+        int n = ENTRY_PER_BLOCK(sb->block_size);
+        MyFSEntry *entries = (MyFSEntry *)buffer;
+        superblock_account(fd, sb, 0, dir_live_entries(sb, buffer));
+        dcache_flush();
+        for (int i = 0; i < n; i++) {
+            if (!entries[i].name_len) continue;
+            incref_block(fd, sb, entries[i].start_block);
+            if (entries[i].tail_block)
+                frag_incref(fd, sb, entries[i].tail_block, entries[i].tail_offset);
+        }
+    }
+    uint32_t next;
+    memcpy(&next, buffer + sb->block_size - sizeof(uint32_t), sizeof(uint32_t));
+    incref_block(fd, sb, next);
+    if (write_block(fd, copy, buffer, sb->block_size) < 0) {
+        free(buffer);
+        return 0;
+    }
+    free(buffer);
+    adjust_refcount(fd, sb, block, -1);
+    return copy;
+}
+
+/*
+ * entry_tail_len: Bytes of the file stored in its tail fragment (0 = none).
+ */
+uint32_t entry_tail_len(SuperBlock *sb, const MyFSEntry *entry) {
+    if (entry->tail_block == 0) return 0;
+    return entry->size % (sb->block_size - sizeof(uint32_t));
+}
+
+/*
+ * entry_incref: Shares a file's data (block chain and tail fragment) with one more entry.
+ */
+int entry_incref(int fd, SuperBlock *sb, const MyFSEntry *entry) {
+    if (incref_block(fd, sb, entry->start_block) < 0) return -1;
+    if (entry->tail_block && frag_incref(fd, sb, entry->tail_block, entry->tail_offset) < 0) {
+        release_block(fd, sb, entry->start_block, 0);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * entry_release: Drops one entry's reference to a file's data.
+ */
+void entry_release(int fd, SuperBlock *sb, const MyFSEntry *entry) {
+    release_block(fd, sb, entry->start_block, entry->type == DIR_TYPE);
+    if (entry->tail_block) frag_release(fd, sb, entry->tail_block, entry->tail_offset);
+}
+
+/*
+ * dir_privatize_chain: Copies every shared block of the directory chain
+ * starting at head and relinks the chain through the copies.
+ * Returns the (possibly new) head block, or 0 on failure.
+ */
+uint32_t dir_privatize_chain(int fd, SuperBlock *sb, uint32_t head) {
+    // Only snapshots share directory blocks (clones share file data only).
+    if (sb->refcount_block == 0 || sb->snap_count == 0) return head;
+    uint32_t new_head = cow_block(fd, sb, head, 1);
+    if (new_head == 0) return 0;
+    char *buffer = malloc(sb->block_size);
+    if (!buffer) return 0;
+    uint32_t current = new_head;
+    while (current != 0) {
+        if (read_block(fd, current, buffer, sb->block_size) < 0) {
+            free(buffer);
+            return 0;
+        }
+        uint32_t next, copy;
+        memcpy(&next, buffer + sb->block_size - sizeof(uint32_t), sizeof(uint32_t));
+        if (next == 0) break;
+        copy = cow_block(fd, sb, next, 1);
+        if (copy == 0) {
+            free(buffer);
+            return 0;
+        }
+        if (copy != next) {
+            memcpy(buffer + sb->block_size - sizeof(uint32_t), &copy, sizeof(uint32_t));
+            write_block(fd, current, buffer, sb->block_size);
+        }
+        current = copy;
+    }
+    free(buffer);
+    return new_head;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/*
+ * dir_match_avx2: dir_match_candidates for the first n / 8 * 8 entries, eight
+ * hashes gathered and compared per instruction. Built for AVX2 whatever -m flags
+ * the file is compiled with; only called when the CPU has it.
+ */
+__attribute__((target("avx2")))
+static uint32_t dir_match_avx2(const MyFSEntry *entries, int n, uint32_t hash, uint8_t len) {
+    const __m256i stride = _mm256_setr_epi32(0, 8, 16, 24, 32, 40, 48, 56);
+    const __m256i key = _mm256_set1_epi32((int)hash);
+    uint32_t mask = 0;
+    for (int i = 0; i + 8 <= n; i += 8) {
+        __m256i h = _mm256_i32gather_epi32((const int *)&entries[i], stride, 4);
+        uint32_t m = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(h, key)));
+        while (m) {
+            int j = __builtin_ctz(m);
+            if (entries[i + j].name_len == len) mask |= 1u << (i + j);
+            m &= m - 1;
+        }
+    }
+    return mask;
+}
+#endif
+
+/*
+ * dir_match_candidates: Returns a bit mask of the entries among entries[0..n-1]
+ * (n <= 32) whose hash and length both equal the key. On a CPU with AVX2, eight
+ * hashes are gathered and compared per instruction; with SSE2, each record's
+ * 16-byte head is compared in one instruction. Candidates still need a memcmp of
+ * the name.
+ */
+static uint32_t dir_match_candidates(const MyFSEntry *entries, int n, uint32_t hash, uint8_t len) {
+    uint32_t mask = 0;
+    int i = 0;
+#if defined(__x86_64__) && defined(__GNUC__)
+    static int avx2 = -1;      // CPU check, done on the first call
+    int has = __atomic_load_n(&avx2, __ATOMIC_RELAXED);
+    if (has < 0) {
+        __builtin_cpu_init();
+        has = __builtin_cpu_supports("avx2") ? 1 : 0;
+        __atomic_store_n(&avx2, has, __ATOMIC_RELAXED);
+    }
+    if (has) {
+        mask = dir_match_avx2(entries, n, hash, len);
+        i = n / 8 * 8;
+    }
+#endif
+#if defined(__SSE2__)
+    // Bytes 0-3 hold the hash and byte 4 the length; only those five lanes matter.
+    const __m128i key16 = _mm_setr_epi32((int)hash, len, 0, 0);
+    for (; i < n; i++) {
+        __m128i head = _mm_loadu_si128((const __m128i *)&entries[i]);
+        if ((_mm_movemask_epi8(_mm_cmpeq_epi8(head, key16)) & 0x1F) == 0x1F) mask |= 1u << i;
+    }
+#endif
+    for (; i < n; i++) {
+        if (entries[i].name_hash == hash && entries[i].name_len == len) mask |= 1u << i;
+    }
+    return mask;
+}
+
+/*
+ * dir_find_entry: Searches a directory (possibly spanning multiple blocks)
+ * for an entry with name. Returns 0 on success (entry found) and sets *entry,
+ * *block_found (the block number where the entry resides) and *entry_index.
+ * Returns -1 if not found.
+ */
+int dir_find_entry(int fd, SuperBlock *sb, uint32_t dir_block, const char *name,
+                     MyFSEntry *entry, uint32_t *block_found, int *entry_index) {
+    // A path ending in '/' (the root included) leaves no final name to look up.
+    if (!name) return -1;
+    size_t len = strnlen(name, MAX_NAME_LEN);
+    uint32_t hash = name_hash(name, len);
+    Dentry *cached = dcache_lookup(dir_block, name, len, hash);
+    if (cached) {
+        if (!cached->found) {
+            stats.dcache_negative_hits++;
+            return -1;
+        }
+        stats.dcache_hits++;
+        *entry = cached->entry;
+        *block_found = cached->found_block;
+        *entry_index = cached->entry_index;
+        return 0;
+    }
+    if (dcache.enabled) stats.dcache_misses++;
+    uint32_t current = dir_block;
+    char *buffer = malloc(sb->block_size);
+    if (!buffer) return -1;
+    while (current != 0) {
+        if (read_block(fd, current, buffer, sb->block_size) < 0) {
+            free(buffer);
+            return -1;
+        }
+        stats.dir_blocks_scanned++;
+        int n = ENTRY_PER_BLOCK(sb->block_size);
+        MyFSEntry *entries = (MyFSEntry *)buffer;
+        for (int base = 0; base < n; base += 32) {
+            int chunk = (n - base < 32) ? n - base : 32;
+            uint32_t mask = dir_match_candidates(entries + base, chunk, hash, (uint8_t)len);
+            while (mask) {
+                int i = base + __builtin_ctz(mask);
+                if (memcmp(entries[i].name, name, len) == 0) {
+                    *entry = entries[i];
+                    *block_found = current;
+                    *entry_index = i;
+                    dcache_insert(dir_block, name, entry, current, i);
+                    free(buffer);
+                    return 0;
+                }
+                mask &= mask - 1;
+            }
+        }
+        // Read next directory block pointer from last 4 bytes.
+        uint32_t next;
+        memcpy(&next, buffer + sb->block_size - sizeof(uint32_t), sizeof(uint32_t));
+        current = next;
+    }
+    free(buffer);
+    dcache_insert(dir_block, name, NULL, 0, 0);
+    return -1;
+}
+
+/*
+ * dir_insert_entry: Inserts a new entry into a directory.
+ * It traverses the directory chain starting at dir_block.
+ * If no free slot is found in the existing blocks, it allocates a new directory block,
+ * chains it to the end, and inserts the entry there.
+ * Returns 0 on success, -1 on failure.
+ */
+int dir_insert_entry(int fd, SuperBlock *sb, uint32_t dir_block, MyFSEntry *new_entry) {
+    if (dcache.enabled) {
+        char name[MAX_NAME_LEN + 1];
+        memcpy(name, new_entry->name, new_entry->name_len);
+        name[new_entry->name_len] = '\0';
+        dcache_forget(dir_block, name);
+    }
+    uint32_t current = dir_block;
+    char *buffer = malloc(sb->block_size);
+    if (!buffer) return -1;
+    uint32_t prev = 0;
+    while (current != 0) {
+        if (read_block(fd, current, buffer, sb->block_size) < 0) {
+            free(buffer);
+            return -1;
+        }
+        stats.dir_blocks_scanned++;
+        int n = ENTRY_PER_BLOCK(sb->block_size);
+        MyFSEntry *entries = (MyFSEntry *)buffer;
+        for (int i = 0; i < n; i++) {
+            if (entries[i].name_len == 0) {
+                // Found free slot.
+                entries[i] = *new_entry;
+                if (write_block(fd, current, buffer, sb->block_size) < 0) {
+                    free(buffer);
+                    return -1;
+                }
+                free(buffer);
+                return 0;
+            }
+        }
+        // No free slot: go to next directory block.
+        memcpy(&prev, buffer + sb->block_size - sizeof(uint32_t), sizeof(uint32_t));
+        if (prev == 0) break;
+        current = prev;
+    }
+    // No free slot in current chain; allocate new directory block.
+    uint32_t new_block = allocate_block_near(fd, sb, current);
+    if (new_block == 0) {
+        free(buffer);
+        return -1;
+    }
+    // Initialize new block as directory block (zeroed, with next pointer 0)
+    char *newbuf = calloc(1, sb->block_size);
     if (!newbuf) {
         free(buffer);
         return -1;
@@ -267,49 +1323,137 @@ int dir_insert_entry(int fd, SuperBlock *sb, uint32_t dir_block, MyFSEntry *new_
 }
 
 /*
- * traverse_path: Given a full path like "/dir1/dir2/file", traverse the directory tree.
- * On success, returns 0 and sets *parent_block to the block number of the parent directory
- * and *final_token to the last component (which is not traversed).
- * If the full path refers to a directory (and ends with a '/'), then *final_token is set to NULL.
+ * resolve_path: Walks the directory tree for traverse_path and traverse_path_writable.
+ * A leading "/.snap" component switches to the snapshot directory, which is read-only.
+ * Directories are locked hand over hand; the parent directory stays locked (shared,
+ * or exclusive when writable) until the caller closes the image or calls unlock_all.
+ * With writable set, every directory chain on the way (including the root) is made
+ * private first, so that a following update does not leak into a snapshot.
  */
-int traverse_path(int fd, SuperBlock *sb, const char *full_path, uint32_t *parent_block, char **final_token) {
+static int resolve_path(int fd, SuperBlock *sb, const char *full_path, int writable,
+                        uint32_t *parent_block, char **final_token) {
     // Duplicate and tokenize the path.
     char *pathdup = strdup(full_path);
     if (!pathdup) return -1;
     // Remove leading '/'
     char *p = pathdup;
     while (*p == '/') p++;
+    char **tokens = malloc(sizeof(char *) * (strlen(p) / 2 + 2));
+    if (!tokens) {
+        free(pathdup);
+        return -1;
+    }
+    int ntok = 0;
     char *saveptr;
-    char *token = strtok_r(p, "/", &saveptr);
-    uint32_t current = sb->root_dir_block;
-    uint32_t prev = current;
-    char *next_token = NULL;
-    while (token != NULL) {
-        next_token = strtok_r(NULL, "/", &saveptr);
-        if (next_token == NULL) {
-            // Last token: this is the entry to be created/located in current directory.
-            *parent_block = current;
-            *final_token = strdup(token);
-            free(pathdup);
-            return 0;
+    for (char *token = strtok_r(p, "/", &saveptr); token; token = strtok_r(NULL, "/", &saveptr))
+        tokens[ntok++] = token;
+    int first = 0, result = -1;
+    int in_snap = ntok > 0 && strcmp(tokens[0], SNAP_DIR_NAME) == 0;
+    if (in_snap) {
+        if (writable) {
+            fprintf(stderr, "traverse_path: Snapshots are read-only\n");
+            goto out;
+        }
+        first = 1;
+    }
+    // Mutating commands hold the tree lock shared so a snapshot sees none of them half done.
+    if (writable && lock_range(fd, LOCK_TREE_OFF(sb), 1, F_RDLCK) < 0) goto out;
+    if (read_superblock(fd, sb) < 0) goto out;
+    // Only the final parent is modified, unless snapshots force copies on the way down.
+    int levels = (ntok > first) ? ntok - first : 1;
+    short mode = (writable && (levels == 1 || sb->snap_count)) ? F_WRLCK : F_RDLCK;
+    uint32_t current;
+    off_t held;
+    if (in_snap) {
+        if (sb->snap_dir_block == 0) goto out;
+        current = sb->snap_dir_block;
+        held = dir_lock_offset(sb, current);
+        if (lock_range(fd, held, 1, mode) < 0) goto out;
+    } else {
+        held = LOCK_ROOT_OFF(sb);
+        if (lock_range(fd, held, 1, mode) < 0) goto out;
+        // Re-read under the root lock: a writer may just have copied the root.
+        if (read_superblock(fd, sb) < 0) goto out;
+        current = sb->root_dir_block;
+        if (writable) {
+            uint32_t root = dir_privatize_chain(fd, sb, current);
+            if (root == 0) goto out;
+            if (root != current) {
+                if (superblock_lock(fd, sb) < 0) goto out;
+                sb->root_dir_block = root;
+                superblock_unlock(fd, sb);
+                current = root;
+            }
         }
-        // Traverse into directory token.
+    }
+    for (int i = first; i < ntok - 1; i++) {
+        // Traverse into directory tokens[i].
         MyFSEntry found;
-        if (dir_find_entry(fd, sb, current, token, &found, &current, NULL) < 0) {
+        uint32_t found_block;
+        int entry_index;
+        if (dir_find_entry(fd, sb, current, tokens[i], &found, &found_block, &entry_index) < 0) {
             // Directory not found.
-            free(pathdup);
-            return -1;
+            goto out;
         }
-        if (found.type != DIR_TYPE) {
-            free(pathdup);
-            return -1;
+        if (found.type != DIR_TYPE) goto out;
+        uint32_t child = found.start_block;
+        if (writable) {
+            uint32_t copy = dir_privatize_chain(fd, sb, child);
+            if (copy == 0) goto out;
+            if (copy != child) {
+                // Repoint the (already private) parent entry at the copy.
+                char *buffer = malloc(sb->block_size);
+                if (!buffer || read_block(fd, found_block, buffer, sb->block_size) < 0) {
+                    free(buffer);
+                    goto out;
+                }
+                ((MyFSEntry *)buffer)[entry_index].start_block = copy;
+                write_block(fd, found_block, buffer, sb->block_size);
+                free(buffer);
+                dcache_forget(current, tokens[i]);
+                child = copy;
+            }
         }
+        if (i == ntok - 2 && writable) mode = F_WRLCK;
+        off_t child_lock = dir_lock_offset(sb, child);
+        if (lock_range(fd, child_lock, 1, mode) < 0) goto out;
+        // A writer that held this directory bumped the counter before letting go.
+        if (dcache.enabled && read_superblock(fd, sb) < 0) goto out;
+        lock_range(fd, held, 1, F_UNLCK);
+        held = child_lock;
+        current = child;
     }
-    // If path was empty or ends with '/', then final_token is NULL.
     *parent_block = current;
-    *final_token = NULL;
+    // If path was empty (or only "/.snap"), then final_token is NULL.
+    if (ntok > first) {
+        *final_token = strdup(tokens[ntok - 1]);
+        if (!*final_token) goto out;
+    } else {
+        *final_token = NULL;
+    }
+    result = 0;
+out:
+    free(tokens);
     free(pathdup);
-    return 0;
+    return result;
+}
+
+/*
+ * traverse_path: Given a full path like "/dir1/dir2/file", traverse the directory tree.
+ * On success, returns 0 and sets *parent_block to the block number of the parent directory
+ * and *final_token to the last component (which is not traversed).
+ * If the full path refers to a directory (and ends with a '/'), then *final_token is set to NULL.
+ */
+int traverse_path(int fd, SuperBlock *sb, const char *full_path, uint32_t *parent_block, char **final_token) {
+    return resolve_path(fd, sb, full_path, 0, parent_block, final_token);
+}
+
+/*
+ * traverse_path_writable: Same as traverse_path, for commands that modify the parent
+ * directory. Shared directory blocks along the path are copied on the way down.
+ */
+int traverse_path_writable(int fd, SuperBlock *sb, const char *full_path, uint32_t *parent_block, char **final_token) {
+    return resolve_path(fd, sb, full_path, 1, parent_block, final_token);
 }
 
 // ----------------------------------------------------------------
@@ -321,51 +1465,97 @@ int traverse_path(int fd, SuperBlock *sb, const char *full_path, uint32_t *paren
  * Usage: ./myfs mymkfs <fsfile> <block_size> <no_of_blocks>
  */
 int mymkfs(const char *fname, int block_size, int no_of_blocks) {
-    int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    // Block 0 is superblock, block 1 is root dir, followed by the reference count
+    // table (2 bytes per block), the snapshot directory and the free-block bitmap.
+    if (block_size <= 0 || (size_t)block_size < sizeof(SuperBlock)) {
+        fprintf(stderr, "mymkfs: Block size must be at least %zu bytes\n", sizeof(SuperBlock));
+        return -1;
+    }
+    if (no_of_blocks <= 0) {
+        fprintf(stderr, "mymkfs: Number of blocks must be positive\n");
+        return -1;
+    }
+    off_t total_size = (off_t)block_size * no_of_blocks;
+    if (total_size / block_size != no_of_blocks) {
+        fprintf(stderr, "mymkfs: Image size overflows off_t\n");
+        return -1;
+    }
+    int fd = bd_open(fname, O_RDWR | O_CREAT | O_TRUNC, 0666);
     if (fd == -1) {
         perror("mymkfs: open");
         return -1;
     }
-    off_t total_size = block_size * no_of_blocks;
     if (ftruncate(fd, total_size) == -1) {
         perror("mymkfs: ftruncate");
-        close(fd);
+        bd_close(fd);
+        return -1;
+    }
+    uint32_t rc_blocks = ((uint32_t)no_of_blocks * sizeof(uint16_t) + block_size - 1) / block_size;
+    uint32_t map_bytes = ((uint32_t)no_of_blocks + 63) / 64 * sizeof(uint64_t);
+    uint32_t map_blocks = (map_bytes + block_size - 1) / block_size;
+    uint32_t first_data = 3 + rc_blocks + map_blocks;
+    if ((uint32_t)no_of_blocks <= first_data) {
+        fprintf(stderr, "mymkfs: Too few blocks for metadata\n");
+        bd_close(fd);
         return -1;
     }
     SuperBlock sb;
+    memset(&sb, 0, sizeof(sb));
     sb.block_size = block_size;
     sb.total_blocks = no_of_blocks;
-    sb.first_free_block = 2; // Block 0 is superblock, block 1 is root dir.
+    sb.first_free_block = first_data;
     sb.root_dir_block = 1;
+    sb.refcount_block = 2;
+    sb.snap_dir_block = 2 + rc_blocks;
+    sb.version = MYFS_VERSION;
+    dcache_flush();
+    sb.frag_head = 0;
+    sb.free_blocks = no_of_blocks - first_data;
+    sb.used_blocks = first_data;
+    sb.inode_count = 1;
+    sb.entry_count = 0;
+    sb.free_map_block = 3 + rc_blocks;
+    sb.group_blocks = ((no_of_blocks + MYFS_GROUPS - 1) / MYFS_GROUPS + 63) / 64 * 64;
+    for (uint32_t i = first_data; i < (uint32_t)no_of_blocks; i++)
+        sb.group_free[i / sb.group_blocks]++;
     if (write_superblock(fd, &sb) < 0) {
-        close(fd);
-        return -1;
-    }
-    // Initialize root directory block (block 1) as empty.
-    char *zero = calloc(1, block_size);
-    if (!zero) { close(fd); return -1; }
-    if (pwrite(fd, zero, block_size, block_size) != block_size) {
-        perror("mymkfs: writing root dir");
-        free(zero);
-        close(fd);
-        return -1;
-    }
-    free(zero);
-    // Initialize free chain for blocks 2 to total_blocks-1.
+        bd_close(fd);
+        return -1;
+    }
+    // Root and snapshot directories start out empty (the file is already zero-filled);
+    // metadata blocks hold one reference each, free blocks none.
+    for (uint32_t i = 0; i < first_data; i++)
+        set_refcount(fd, &sb, i, 1);
+    // Every data block starts out free.
+    uint64_t *map = calloc(map_blocks, block_size);
+    if (!map) { bd_close(fd); return -1; }
+    for (uint32_t i = first_data; i < (uint32_t)no_of_blocks; i++)
+        map[i / 64] |= 1ULL << (i % 64);
+    if (bd_pwrite(fd, map, (size_t)map_blocks * block_size, (off_t)sb.free_map_block * block_size) !=
+        (ssize_t)map_blocks * block_size) {
+        perror("mymkfs: writing free-block bitmap");
+        free(map);
+        bd_close(fd);
+        return -1;
+    }
+    free(map);
+    // Initialize free chain for blocks first_data to total_blocks-1, linked both ways.
     char *buf = calloc(1, block_size);
-    if (!buf) { close(fd); return -1; }
-    for (uint32_t i = 2; i < (uint32_t)no_of_blocks; i++) {
+    if (!buf) { bd_close(fd); return -1; }
+    for (uint32_t i = first_data; i < (uint32_t)no_of_blocks; i++) {
         uint32_t next = (i < no_of_blocks - 1) ? i + 1 : 0;
+        uint32_t prev = (i > first_data) ? i - 1 : 0;
+        memcpy(buf, &prev, sizeof(uint32_t));
         memcpy(buf + block_size - sizeof(uint32_t), &next, sizeof(uint32_t));
-        if (pwrite(fd, buf, block_size, i * block_size) != block_size) {
+        if (write_block(fd, i, buf, block_size) < 0) {
             perror("mymkfs: initializing free chain");
             free(buf);
-            close(fd);
+            bd_close(fd);
             return -1;
         }
     }
     free(buf);
-    close(fd);
+    bd_close(fd);
     printf("Filesystem '%s' created: block size = %d, total blocks = %d\n", fname, block_size, no_of_blocks);
     return 0;
 }
@@ -386,7 +1576,7 @@ int mycopyTo(const char *srcfile, char *destspec) {
         free(fsname); free(path);
         return -1;
     }
-    int fd = open(fsname, O_RDWR);
+    int fd = bd_open(fsname, O_RDWR, 0);
     if (fd == -1) {
         perror("mycopyTo: open fsfile");
         free(fsname); free(path);
@@ -395,43 +1585,47 @@ int mycopyTo(const char *srcfile, char *destspec) {
     }
     SuperBlock sb;
     if (read_superblock(fd, &sb) < 0) {
-        close(sfd); close(fd); free(fsname); free(path);
+        close(sfd); bd_close(fd); free(fsname); free(path);
         return -1;
     }
     // Resolve parent directory from the path.
     uint32_t parent_block;
     char *final_token;
-    if (traverse_path(fd, &sb, path, &parent_block, &final_token) < 0) {
+    if (traverse_path_writable(fd, &sb, path, &parent_block, &final_token) < 0) {
         fprintf(stderr, "mycopyTo: Could not resolve path '%s'\n", path);
-        close(sfd); close(fd); free(fsname); free(path);
+        close(sfd); bd_close(fd); free(fsname); free(path);
         return -1;
     }
     if (!final_token) {
         fprintf(stderr, "mycopyTo: Target must be a file, not a directory\n");
-        close(sfd); close(fd); free(fsname); free(path);
+        close(sfd); bd_close(fd); free(fsname); free(path);
         return -1;
     }
     // Read source file size.
     struct stat st;
     if (fstat(sfd, &st) == -1) {
         perror("mycopyTo: fstat");
-        close(sfd); close(fd); free(fsname); free(path); free(final_token);
+        close(sfd); bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
     uint32_t filesize = st.st_size;
+    // A short last block is packed into a fragment block instead of getting its own block.
+    uint32_t tail_len = filesize % (sb.block_size - sizeof(uint32_t));
+    if (!frag_fits(&sb, tail_len)) tail_len = 0;
     // Allocate blocks for file data.
     uint32_t first_block = 0, current_block = 0;
-    uint32_t bytes_remaining = filesize;
+    uint32_t bytes_remaining = filesize - tail_len;
     char *data_buf = malloc(sb.block_size);
     if (!data_buf) {
-        close(sfd); close(fd); free(fsname); free(path); free(final_token);
+        close(sfd); bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
     while (bytes_remaining > 0) {
-        uint32_t new_block = allocate_block(fd, &sb);
+        // Place the file after its directory, and each block after the previous one.
+        uint32_t new_block = allocate_block_near(fd, &sb, first_block ? current_block : parent_block);
         if (new_block == 0) {
             fprintf(stderr, "mycopyTo: No free block available\n");
-            free(data_buf); close(sfd); close(fd);
+            free(data_buf); close(sfd); bd_close(fd);
             free(fsname); free(path); free(final_token);
             return -1;
         }
@@ -449,7 +1643,7 @@ int mycopyTo(const char *srcfile, char *destspec) {
                            (sb.block_size - sizeof(uint32_t)) : bytes_remaining;
         if (read(sfd, data_buf, to_read) != to_read) {
             perror("mycopyTo: read");
-            free(data_buf); close(sfd); close(fd);
+            free(data_buf); close(sfd); bd_close(fd);
             free(fsname); free(path); free(final_token);
             return -1;
         }
@@ -458,27 +1652,42 @@ int mycopyTo(const char *srcfile, char *destspec) {
         memcpy(data_buf + sb.block_size - sizeof(uint32_t), &next, sizeof(uint32_t));
         write_block(fd, current_block, data_buf, sb.block_size);
     }
+    uint32_t tail_block = 0;
+    uint16_t tail_offset = 0;
+    if (tail_len > 0) {
+        if (read(sfd, data_buf, tail_len) != tail_len ||
+            frag_alloc(fd, &sb, data_buf, tail_len, &tail_block, &tail_offset) < 0) {
+            fprintf(stderr, "mycopyTo: Could not store the file tail\n");
+            release_block(fd, &sb, first_block, 0);
+            free(data_buf); close(sfd); bd_close(fd);
+            free(fsname); free(path); free(final_token);
+            return -1;
+        }
+    }
     free(data_buf);
     close(sfd);
     // Create file descriptor entry.
     MyFSEntry new_entry;
     memset(&new_entry, 0, sizeof(MyFSEntry));
     // Use basename of final_token for file name.
-    strncpy(new_entry.name, final_token, MAX_NAME_LEN);
+    entry_set_name(&new_entry, final_token);
     new_entry.type = FILE_TYPE;
     new_entry.start_block = first_block;
     new_entry.size = filesize;
+    new_entry.tail_block = tail_block;
+    new_entry.tail_offset = tail_offset;
     // Insert into parent directory.
     if (dir_insert_entry(fd, &sb, parent_block, &new_entry) < 0) {
         fprintf(stderr, "mycopyTo: Failed to insert entry\n");
-        close(fd);
+        bd_close(fd);
         free(fsname); free(path); free(final_token);
         return -1;
     }
+    superblock_account(fd, &sb, 1, 1);
     printf("File '%s' copied to myfs as '%s' under directory (block %u) in filesystem '%s'.\n",
            srcfile, final_token, parent_block, fsname);
     free(fsname); free(path); free(final_token);
-    close(fd);
+    bd_close(fd);
     return 0;
 }
 
@@ -490,7 +1699,7 @@ int mycopyFrom(char *myfname, const char *linuxfile) {
     char *fsname = NULL, *path = NULL;
     if (parse_path(myfname, &fsname, &path) < 0)
         return -1;
-    int fd = open(fsname, O_RDONLY);
+    int fd = bd_open(fsname, O_RDONLY, 0);
     if (fd == -1) {
         perror("mycopyFrom: open fsfile");
         free(fsname); free(path);
@@ -498,7 +1707,7 @@ int mycopyFrom(char *myfname, const char *linuxfile) {
     }
     SuperBlock sb;
     if (read_superblock(fd, &sb) < 0) {
-        close(fd); free(fsname); free(path);
+        bd_close(fd); free(fsname); free(path);
         return -1;
     }
     // Resolve full path to file. Traverse path and get the final entry.
@@ -506,7 +1715,7 @@ int mycopyFrom(char *myfname, const char *linuxfile) {
     char *final_token;
     if (traverse_path(fd, &sb, path, &parent_block, &final_token) < 0) {
         fprintf(stderr, "mycopyFrom: Could not resolve path '%s'\n", path);
-        close(fd); free(fsname); free(path);
+        bd_close(fd); free(fsname); free(path);
         return -1;
     }
     // Now, final_token is the file name. Search for it in parent directory.
@@ -515,26 +1724,27 @@ int mycopyFrom(char *myfname, const char *linuxfile) {
     int entry_index;
     if (dir_find_entry(fd, &sb, parent_block, final_token, &fileEntry, &found_block, &entry_index) < 0) {
         fprintf(stderr, "mycopyFrom: File '%s' not found\n", final_token);
-        close(fd); free(fsname); free(path); free(final_token);
+        bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
     if (fileEntry.type != FILE_TYPE) {
         fprintf(stderr, "mycopyFrom: Specified path is not a file\n");
-        close(fd); free(fsname); free(path); free(final_token);
+        bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
     // Open destination Linux file.
     int sfd = open(linuxfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
     if (sfd == -1) {
         perror("mycopyFrom: open dest file");
-        close(fd); free(fsname); free(path); free(final_token);
+        bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
-    uint32_t filesize = fileEntry.size;
+    uint32_t tail_len = entry_tail_len(&sb, &fileEntry);
+    uint32_t filesize = fileEntry.size - tail_len;
     uint32_t current_block = fileEntry.start_block;
     char *data_buf = malloc(sb.block_size);
     if (!data_buf) {
-        close(sfd); close(fd); free(fsname); free(path); free(final_token);
+        close(sfd); bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
     while (filesize > 0 && current_block != 0) {
@@ -545,9 +1755,12 @@ int mycopyFrom(char *myfname, const char *linuxfile) {
         filesize -= to_write;
         memcpy(&current_block, data_buf + sb.block_size - sizeof(uint32_t), sizeof(uint32_t));
     }
+    if (tail_len > 0 &&
+        frag_read(fd, &sb, fileEntry.tail_block, fileEntry.tail_offset, data_buf, tail_len) == 0)
+        write(sfd, data_buf, tail_len);
     free(data_buf);
     close(sfd);
-    close(fd);
+    bd_close(fd);
     printf("File '%s' copied from myfs to '%s' from filesystem '%s'.\n", final_token, linuxfile, fsname);
     free(fsname); free(path); free(final_token);
     return 0;
@@ -561,7 +1774,7 @@ int myrm(char *myfname) {
     char *fsname = NULL, *path = NULL;
     if (parse_path(myfname, &fsname, &path) < 0)
         return -1;
-    int fd = open(fsname, O_RDWR);
+    int fd = bd_open(fsname, O_RDWR, 0);
     if (fd == -1) {
         perror("myrm: open fsfile");
         free(fsname); free(path);
@@ -569,14 +1782,14 @@ int myrm(char *myfname) {
     }
     SuperBlock sb;
     if (read_superblock(fd, &sb) < 0) {
-        close(fd); free(fsname); free(path);
+        bd_close(fd); free(fsname); free(path);
         return -1;
     }
     uint32_t parent_block;
     char *final_token;
-    if (traverse_path(fd, &sb, path, &parent_block, &final_token) < 0) {
+    if (traverse_path_writable(fd, &sb, path, &parent_block, &final_token) < 0) {
         fprintf(stderr, "myrm: Could not resolve path '%s'\n", path);
-        close(fd); free(fsname); free(path);
+        bd_close(fd); free(fsname); free(path);
         return -1;
     }
     MyFSEntry fileEntry;
@@ -584,45 +1797,35 @@ int myrm(char *myfname) {
     int entry_index;
     if (dir_find_entry(fd, &sb, parent_block, final_token, &fileEntry, &found_block, &entry_index) < 0) {
         fprintf(stderr, "myrm: File '%s' not found\n", final_token);
-        close(fd); free(fsname); free(path); free(final_token);
+        bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
     if (fileEntry.type != FILE_TYPE) {
         fprintf(stderr, "myrm: Specified path is not a file\n");
-        close(fd); free(fsname); free(path); free(final_token);
-        return -1;
-    }
-    // Free the chain of blocks used by the file.
-    uint32_t current_block = fileEntry.start_block;
-    char *buf = malloc(sb.block_size);
-    if (!buf) {
-        close(fd); free(fsname); free(path); free(final_token);
+        bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
-    while (current_block != 0) {
-        if (read_block(fd, current_block, buf, sb.block_size) < 0) break;
-        uint32_t next_block = 0;
-        memcpy(&next_block, buf + sb.block_size - sizeof(uint32_t), sizeof(uint32_t));
-        free_block(fd, &sb, current_block);
-        current_block = next_block;
-    }
-    free(buf);
+    // Drop this name's reference to the chain of blocks used by the file.
+    // Blocks still shared with a clone or a snapshot stay allocated.
+    entry_release(fd, &sb, &fileEntry);
     // Remove entry from directory.
     char *dir_buf = malloc(sb.block_size);
     if (!dir_buf) {
-        close(fd); free(fsname); free(path); free(final_token);
+        bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
-    if (read_block(fd, parent_block, dir_buf, sb.block_size) < 0) {
-        free(dir_buf); close(fd); free(fsname); free(path); free(final_token);
+    if (read_block(fd, found_block, dir_buf, sb.block_size) < 0) {
+        free(dir_buf); bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
     MyFSEntry *entries = (MyFSEntry *)dir_buf;
-    entries[entry_index].name[0] = '\0';
-    write_block(fd, parent_block, dir_buf, sb.block_size);
+    memset(&entries[entry_index], 0, sizeof(MyFSEntry));
+    write_block(fd, found_block, dir_buf, sb.block_size);
     free(dir_buf);
+    dcache_forget(parent_block, final_token);
+    superblock_account(fd, &sb, -1, -1);
     printf("File '%s' removed from filesystem '%s'.\n", final_token, fsname);
-    close(fd);
+    bd_close(fd);
     free(fsname); free(path); free(final_token);
     return 0;
 }
@@ -635,7 +1838,7 @@ int mymkdir(char *mydirname) {
     char *fsname = NULL, *path = NULL;
     if (parse_path(mydirname, &fsname, &path) < 0)
         return -1;
-    int fd = open(fsname, O_RDWR);
+    int fd = bd_open(fsname, O_RDWR, 0);
     if (fd == -1) {
         perror("mymkdir: open fsfile");
         free(fsname); free(path);
@@ -643,27 +1846,27 @@ int mymkdir(char *mydirname) {
     }
     SuperBlock sb;
     if (read_superblock(fd, &sb) < 0) {
-        close(fd); free(fsname); free(path);
+        bd_close(fd); free(fsname); free(path);
         return -1;
     }
     // Traverse path to get parent directory and final token.
     uint32_t parent_block;
     char *final_token;
-    if (traverse_path(fd, &sb, path, &parent_block, &final_token) < 0) {
+    if (traverse_path_writable(fd, &sb, path, &parent_block, &final_token) < 0) {
         fprintf(stderr, "mymkdir: Could not resolve path '%s'\n", path);
-        close(fd); free(fsname); free(path);
+        bd_close(fd); free(fsname); free(path);
         return -1;
     }
     // final_token is the name of the new directory.
     MyFSEntry new_entry;
     memset(&new_entry, 0, sizeof(MyFSEntry));
-    strncpy(new_entry.name, final_token, MAX_NAME_LEN);
+    entry_set_name(&new_entry, final_token);
     new_entry.type = DIR_TYPE;
     // Allocate a block for the new directory.
-    uint32_t new_dir_block = allocate_block(fd, &sb);
+    uint32_t new_dir_block = allocate_block_near(fd, &sb, dir_goal(&sb, parent_block, final_token));
     if (new_dir_block == 0) {
         fprintf(stderr, "mymkdir: No free block available\n");
-        close(fd); free(fsname); free(path); free(final_token);
+        bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
     new_entry.start_block = new_dir_block;
@@ -671,7 +1874,7 @@ int mymkdir(char *mydirname) {
     // Initialize the new directory block.
     char *zero = calloc(1, sb.block_size);
     if (!zero) {
-        close(fd); free(fsname); free(path); free(final_token);
+        bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
     uint32_t next = 0;
@@ -681,12 +1884,13 @@ int mymkdir(char *mydirname) {
     // Insert the new directory entry into the parent directory.
     if (dir_insert_entry(fd, &sb, parent_block, &new_entry) < 0) {
         fprintf(stderr, "mymkdir: Failed to insert directory entry\n");
-        close(fd); free(fsname); free(path); free(final_token);
+        bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
+    superblock_account(fd, &sb, 1, 1);
     printf("Directory '%s' created under parent block %u in filesystem '%s' (new block %u).\n",
            final_token, parent_block, fsname, new_dir_block);
-    close(fd);
+    bd_close(fd);
     free(fsname); free(path); free(final_token);
     return 0;
 }
@@ -699,7 +1903,7 @@ int myrmdir(char *mydirname) {
     char *fsname = NULL, *path = NULL;
     if (parse_path(mydirname, &fsname, &path) < 0)
         return -1;
-    int fd = open(fsname, O_RDWR);
+    int fd = bd_open(fsname, O_RDWR, 0);
     if (fd == -1) {
         perror("myrmdir: open fsfile");
         free(fsname); free(path);
@@ -707,15 +1911,15 @@ int myrmdir(char *mydirname) {
     }
     SuperBlock sb;
     if (read_superblock(fd, &sb) < 0) {
-        close(fd); free(fsname); free(path);
+        bd_close(fd); free(fsname); free(path);
         return -1;
     }
     // Traverse to parent directory and get final token.
     uint32_t parent_block;
     char *final_token;
-    if (traverse_path(fd, &sb, path, &parent_block, &final_token) < 0) {
+    if (traverse_path_writable(fd, &sb, path, &parent_block, &final_token) < 0) {
         fprintf(stderr, "myrmdir: Could not resolve path '%s'\n", path);
-        close(fd); free(fsname); free(path);
+        bd_close(fd); free(fsname); free(path);
         return -1;
     }
     MyFSEntry dirEntry;
@@ -723,68 +1927,75 @@ int myrmdir(char *mydirname) {
     int entry_index;
     if (dir_find_entry(fd, &sb, parent_block, final_token, &dirEntry, &found_block, &entry_index) < 0) {
         fprintf(stderr, "myrmdir: Directory '%s' not found\n", final_token);
-        close(fd); free(fsname); free(path); free(final_token);
+        bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
     if (dirEntry.type != DIR_TYPE) {
         fprintf(stderr, "myrmdir: Specified path is not a directory\n");
-        close(fd); free(fsname); free(path); free(final_token);
+        bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
-    // Check if directory is empty.
-    // For simplicity, we assume if the directory block contains no entries, it is empty.
-    char *dir_buf = malloc(sb.block_size);
-    if (!dir_buf) {
-        close(fd); free(fsname); free(path); free(final_token);
+    // Wait for readers still inside the directory before it goes away.
+    if (lock_range(fd, dir_lock_offset(&sb, dirEntry.start_block), 1, F_WRLCK) < 0) {
+        bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
-    if (read_block(fd, dirEntry.start_block, dir_buf, sb.block_size) < 0) {
-        free(dir_buf); close(fd); free(fsname); free(path); free(final_token);
+    // The directory is empty only if no block of its chain holds a live entry:
+    // release_block below drops everything the chain still refers to.
+    char *dir_buf = malloc(sb.block_size);
+    if (!dir_buf) {
+        bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
-    int n = ENTRY_PER_BLOCK(sb.block_size);
     int empty = 1;
-    MyFSEntry *dentries = (MyFSEntry *)dir_buf;
-    for (int i = 0; i < n; i++) {
-        if (dentries[i].name[0] != '\0') { empty = 0; break; }
+    for (uint32_t current = dirEntry.start_block; current != 0 && empty; ) {
+        if (read_block(fd, current, dir_buf, sb.block_size) < 0) {
+            free(dir_buf); bd_close(fd); free(fsname); free(path); free(final_token);
+            return -1;
+        }
+        if (dir_live_entries(&sb, dir_buf) > 0) empty = 0;
+        memcpy(&current, dir_buf + sb.block_size - sizeof(uint32_t), sizeof(uint32_t));
     }
     free(dir_buf);
     if (!empty) {
         fprintf(stderr, "myrmdir: Directory '%s' is not empty\n", final_token);
-        close(fd); free(fsname); free(path); free(final_token);
+        bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
-    // Free the directory block.
-    free_block(fd, &sb, dirEntry.start_block);
+    // Release the directory block (a snapshot may still hold it).
+    release_block(fd, &sb, dirEntry.start_block, 1);
     // Remove the directory entry from the parent directory.
     char *parent_buf = malloc(sb.block_size);
     if (!parent_buf) {
-        close(fd); free(fsname); free(path); free(final_token);
+        bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
-    if (read_block(fd, parent_block, parent_buf, sb.block_size) < 0) {
-        free(parent_buf); close(fd); free(fsname); free(path); free(final_token);
+    if (read_block(fd, found_block, parent_buf, sb.block_size) < 0) {
+        free(parent_buf); bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
     MyFSEntry *pentries = (MyFSEntry *)parent_buf;
-    pentries[entry_index].name[0] = '\0';
-    write_block(fd, parent_block, parent_buf, sb.block_size);
+    memset(&pentries[entry_index], 0, sizeof(MyFSEntry));
+    write_block(fd, found_block, parent_buf, sb.block_size);
     free(parent_buf);
+    dcache_forget(parent_block, final_token);
+    superblock_account(fd, &sb, -1, -1);
     printf("Directory '%s' removed from filesystem '%s'.\n", final_token, fsname);
-    close(fd);
+    bd_close(fd);
     free(fsname); free(path); free(final_token);
     return 0;
 }
 
 /*
- * myreadBlock: Reads the block_no-th block of a file into buf.
- * myfname is of the form <file path>@<fsfile>.
+ * myreadBlock: Reads the block_no-th block of a file into buf, which holds buflen
+ * bytes; a block larger than that is cut short. myfname is of the form
+ * <file path>@<fsfile>.
  */
-int myreadBlock(char *myfname, char *buf, int block_no) {
+int myreadBlock(char *myfname, char *buf, size_t buflen, int block_no) {
     char *fsname = NULL, *path = NULL;
     if (parse_path(myfname, &fsname, &path) < 0)
         return -1;
-    int fd = open(fsname, O_RDONLY);
+    int fd = bd_open(fsname, O_RDONLY, 0);
     if (fd == -1) {
         perror("myreadBlock: open fsfile");
         free(fsname); free(path);
@@ -792,7 +2003,7 @@ int myreadBlock(char *myfname, char *buf, int block_no) {
     }
     SuperBlock sb;
     if (read_superblock(fd, &sb) < 0) {
-        close(fd); free(fsname); free(path);
+        bd_close(fd); free(fsname); free(path);
         return -1;
     }
     // Traverse to parent directory and get file name.
@@ -800,7 +2011,7 @@ int myreadBlock(char *myfname, char *buf, int block_no) {
     char *final_token;
     if (traverse_path(fd, &sb, path, &parent_block, &final_token) < 0) {
         fprintf(stderr, "myreadBlock: Could not resolve path '%s'\n", path);
-        close(fd); free(fsname); free(path);
+        bd_close(fd); free(fsname); free(path);
         return -1;
     }
     MyFSEntry fileEntry;
@@ -808,18 +2019,34 @@ int myreadBlock(char *myfname, char *buf, int block_no) {
     int entry_index;
     if (dir_find_entry(fd, &sb, parent_block, final_token, &fileEntry, &found_block, &entry_index) < 0) {
         fprintf(stderr, "myreadBlock: File '%s' not found\n", final_token);
-        close(fd); free(fsname); free(path); free(final_token);
+        bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
     if (fileEntry.type != FILE_TYPE) {
         fprintf(stderr, "myreadBlock: '%s' is not a file\n", final_token);
-        close(fd); free(fsname); free(path); free(final_token);
+        bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
-    uint32_t current = fileEntry.start_block;
+    // The block is assembled in temp_buf and only buflen bytes of it reach buf.
+    size_t copy = buflen < sb.block_size ? buflen : sb.block_size;
     char *temp_buf = malloc(sb.block_size);
     if (!temp_buf) {
-        close(fd); free(fsname); free(path); free(final_token);
+        bd_close(fd); free(fsname); free(path); free(final_token);
+        return -1;
+    }
+    // The block after the last full one is the tail fragment, if the file has one.
+    uint32_t tail_len = entry_tail_len(&sb, &fileEntry);
+    if (tail_len > 0 && (uint32_t)block_no == (fileEntry.size - tail_len) / (sb.block_size - sizeof(uint32_t))) {
+        memset(temp_buf, 0, sb.block_size);
+        int rc = frag_read(fd, &sb, fileEntry.tail_block, fileEntry.tail_offset, temp_buf, tail_len);
+        if (rc == 0) memcpy(buf, temp_buf, copy);
+        free(temp_buf); bd_close(fd); free(fsname); free(path); free(final_token);
+        return rc;
+    }
+    uint32_t current = fileEntry.start_block;
+    if (current == 0) {
+        fprintf(stderr, "myreadBlock: Block chain ended before block %d\n", block_no);
+        free(temp_buf); bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
     for (int i = 0; i < block_no; i++) {
@@ -827,16 +2054,17 @@ int myreadBlock(char *myfname, char *buf, int block_no) {
         memcpy(&current, temp_buf + sb.block_size - sizeof(uint32_t), sizeof(uint32_t));
         if (current == 0) {
             fprintf(stderr, "myreadBlock: Block chain ended before block %d\n", block_no);
-            free(temp_buf); close(fd); free(fsname); free(path); free(final_token);
+            free(temp_buf); bd_close(fd); free(fsname); free(path); free(final_token);
             return -1;
         }
     }
-    if (read_block(fd, current, buf, sb.block_size) < 0) {
-        free(temp_buf); close(fd); free(fsname); free(path); free(final_token);
+    if (read_block(fd, current, temp_buf, sb.block_size) < 0) {
+        free(temp_buf); bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
+    memcpy(buf, temp_buf, copy);
     free(temp_buf);
-    close(fd);
+    bd_close(fd);
     free(fsname); free(path); free(final_token);
     return 0;
 }
@@ -849,7 +2077,7 @@ int mystat(char *myname, char *buf) {
     char *fsname = NULL, *path = NULL;
     if (parse_path(myname, &fsname, &path) < 0)
         return -1;
-    int fd = open(fsname, O_RDONLY);
+    int fd = bd_open(fsname, O_RDONLY, 0);
     if (fd == -1) {
         perror("mystat: open fsfile");
         free(fsname); free(path);
@@ -857,103 +2085,1336 @@ int mystat(char *myname, char *buf) {
     }
     SuperBlock sb;
     if (read_superblock(fd, &sb) < 0) {
-        close(fd); free(fsname); free(path);
+        bd_close(fd); free(fsname); free(path);
         return -1;
     }
     uint32_t parent_block;
     char *final_token;
     if (traverse_path(fd, &sb, path, &parent_block, &final_token) < 0) {
         fprintf(stderr, "mystat: Could not resolve path '%s'\n", path);
-        close(fd); free(fsname); free(path);
+        bd_close(fd); free(fsname); free(path);
         return -1;
     }
     MyFSEntry entry;
     uint32_t found;
     int idx;
     if (dir_find_entry(fd, &sb, parent_block, final_token, &entry, &found, &idx) < 0) {
-        snprintf(buf, 256, "mystat: Entry '%s' not found in filesystem '%s'.", final_token, fsname);
-        close(fd); free(fsname); free(path); free(final_token);
+        snprintf(buf, 256, "mystat: Entry '%s' not found in filesystem '%s'.", final_token ? final_token : path, fsname);
+        bd_close(fd); free(fsname); free(path); free(final_token);
         return -1;
     }
-    snprintf(buf, 256, "Name: %s\nType: %s\nStart Block: %u\nSize: %u bytes",
-             entry.name, (entry.type == FILE_TYPE) ? "File" : "Directory", entry.start_block, entry.size);
-    close(fd);
+    int len = snprintf(buf, 256, "Name: %.*s\nType: %s\nStart Block: %u\nSize: %u bytes",
+             entry.name_len, entry.name, (entry.type == FILE_TYPE) ? "File" : "Directory", entry.start_block, entry.size);
+    if (entry.tail_block && len < 256)
+        snprintf(buf + len, 256 - len, "\nTail: %u bytes in fragment block %u at offset %u",
+                 entry_tail_len(&sb, &entry), entry.tail_block, entry.tail_offset);
+    bd_close(fd);
     free(fsname); free(path); free(final_token);
     return 0;
 }
 
-// ----------------------------------------------------------------
-// Main: Command Dispatch
-// ----------------------------------------------------------------
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr,
-        "Usage:\n"
-        "  %s mymkfs <fsfile> <block_size> <no_of_blocks>\n"
-        "  %s mycopyTo <linuxfile> <myfile_path>@<fsfile>\n"
-        "  %s mycopyFrom <myfile_path>@<fsfile> <linuxfile>\n"
-        "  %s myrm <myfile_path>@<fsfile>\n"
+/*
+ * mysnapshot: Freezes the current root directory as a read-only snapshot.
+ * Specification: <snapshot name>@<fsfile>. The snapshot is reachable as /.snap/<name>.
+ * Only the root block gains a reference; blocks are copied lazily when the live tree changes.
+ */
+int mysnapshot(char *snapspec) {
+    char *fsname = NULL, *name = NULL;
+    if (parse_path(snapspec, &fsname, &name) < 0)
+        return -1;
+    int fd = bd_open(fsname, O_RDWR, 0);
+    if (fd == -1) {
+        perror("mysnapshot: open fsfile");
+        free(fsname); free(name);
+        return -1;
+    }
+    SuperBlock sb;
+    if (read_superblock(fd, &sb) < 0) {
+        bd_close(fd); free(fsname); free(name);
+        return -1;
+    }
+    if (sb.snap_dir_block == 0) {
+        fprintf(stderr, "mysnapshot: Filesystem '%s' has no snapshot support (re-run mymkfs)\n", fsname);
+        bd_close(fd); free(fsname); free(name);
+        return -1;
+    }
+    char *snapname = name;
+    while (*snapname == '/') snapname++;
+    if (*snapname == '\0' || strchr(snapname, '/') || strlen(snapname) >= MAX_NAME_LEN) {
+        fprintf(stderr, "mysnapshot: Invalid snapshot name '%s'\n", name);
+        bd_close(fd); free(fsname); free(name);
+        return -1;
+    }
+    // Wait for in-flight mutations, then freeze the root as it is now.
+    if (lock_range(fd, LOCK_TREE_OFF(&sb), 1, F_WRLCK) < 0 ||
+        lock_range(fd, dir_lock_offset(&sb, sb.snap_dir_block), 1, F_WRLCK) < 0 ||
+        read_superblock(fd, &sb) < 0) {
+        bd_close(fd); free(fsname); free(name);
+        return -1;
+    }
+    MyFSEntry existing;
+    uint32_t found_block;
+    int entry_index;
+    if (dir_find_entry(fd, &sb, sb.snap_dir_block, snapname, &existing, &found_block, &entry_index) == 0) {
+        fprintf(stderr, "mysnapshot: Snapshot '%s' already exists\n", snapname);
+        bd_close(fd); free(fsname); free(name);
+        return -1;
+    }
+    MyFSEntry snap;
+    memset(&snap, 0, sizeof(MyFSEntry));
+    entry_set_name(&snap, snapname);
+    snap.type = DIR_TYPE;
+    snap.start_block = sb.root_dir_block;
+    if (incref_block(fd, &sb, sb.root_dir_block) < 0 ||
+        dir_insert_entry(fd, &sb, sb.snap_dir_block, &snap) < 0) {
+        fprintf(stderr, "mysnapshot: Failed to record snapshot\n");
+        bd_close(fd); free(fsname); free(name);
+        return -1;
+    }
+    if (superblock_lock(fd, &sb) == 0) {
+        sb.snap_count++;
+        if (sb.version >= MYFS_COUNTERS_VERSION) sb.entry_count++;
+        superblock_unlock(fd, &sb);
+    }
+    printf("Snapshot '%s' of filesystem '%s' created (root block %u).\n", snapname, fsname, snap.start_block);
+    bd_close(fd);
+    free(fsname); free(name);
+    return 0;
+}
+
+/*
+ * myrmsnapshot: Deletes a snapshot and frees the blocks only it still references.
+ * Specification: <snapshot name>@<fsfile>.
+ */
+int myrmsnapshot(char *snapspec) {
+    char *fsname = NULL, *name = NULL;
+    if (parse_path(snapspec, &fsname, &name) < 0)
+        return -1;
+    int fd = bd_open(fsname, O_RDWR, 0);
+    if (fd == -1) {
+        perror("myrmsnapshot: open fsfile");
+        free(fsname); free(name);
+        return -1;
+    }
+    SuperBlock sb;
+    if (read_superblock(fd, &sb) < 0) {
+        bd_close(fd); free(fsname); free(name);
+        return -1;
+    }
+    char *snapname = name;
+    while (*snapname == '/') snapname++;
+    if (sb.snap_dir_block != 0 &&
+        (lock_range(fd, LOCK_TREE_OFF(&sb), 1, F_WRLCK) < 0 ||
+         lock_range(fd, dir_lock_offset(&sb, sb.snap_dir_block), 1, F_WRLCK) < 0)) {
+        bd_close(fd); free(fsname); free(name);
+        return -1;
+    }
+    MyFSEntry snap;
+    uint32_t found_block;
+    int entry_index;
+    if (sb.snap_dir_block == 0 ||
+        dir_find_entry(fd, &sb, sb.snap_dir_block, snapname, &snap, &found_block, &entry_index) < 0) {
+        fprintf(stderr, "myrmsnapshot: Snapshot '%s' not found\n", snapname);
+        bd_close(fd); free(fsname); free(name);
+        return -1;
+    }
+    release_block(fd, &sb, snap.start_block, 1);
+    if (superblock_lock(fd, &sb) == 0) {
+        sb.snap_count--;
+        superblock_unlock(fd, &sb);
+    }
+    char *dir_buf = malloc(sb.block_size);
+    if (!dir_buf) {
+        bd_close(fd); free(fsname); free(name);
+        return -1;
+    }
+    if (read_block(fd, found_block, dir_buf, sb.block_size) < 0) {
+        free(dir_buf); bd_close(fd); free(fsname); free(name);
+        return -1;
+    }
+    memset(&((MyFSEntry *)dir_buf)[entry_index], 0, sizeof(MyFSEntry));
+    write_block(fd, found_block, dir_buf, sb.block_size);
+    free(dir_buf);
+    dcache_forget(sb.snap_dir_block, snapname);
+    superblock_account(fd, &sb, 0, -1);
+    printf("Snapshot '%s' removed from filesystem '%s'.\n", snapname, fsname);
+    bd_close(fd);
+    free(fsname); free(name);
+    return 0;
+}
+
+/*
+ * myclone: Creates dstpath as a reflink copy of srcpath inside the same filesystem.
+ * Specification: <src path>@<fsfile> <dst path>. The source may live in a snapshot.
+ * Both names share the data chain, so the clone costs one reference count update
+ * regardless of file size. File data is never rewritten in place, so the blocks stay
+ * shared until the last name referring to them is removed.
+ */
+int myclone(char *srcspec, const char *dstpath) {
+    char *fsname = NULL, *path = NULL;
+    if (parse_path(srcspec, &fsname, &path) < 0)
+        return -1;
+    int fd = bd_open(fsname, O_RDWR, 0);
+    if (fd == -1) {
+        perror("myclone: open fsfile");
+        free(fsname); free(path);
+        return -1;
+    }
+    SuperBlock sb;
+    if (read_superblock(fd, &sb) < 0) {
+        bd_close(fd); free(fsname); free(path);
+        return -1;
+    }
+    if (sb.refcount_block == 0) {
+        fprintf(stderr, "myclone: Filesystem '%s' has no reference counts (re-run mymkfs)\n", fsname);
+        bd_close(fd); free(fsname); free(path);
+        return -1;
+    }
+    uint32_t parent_block, found_block;
+    char *final_token;
+    int entry_index;
+    MyFSEntry srcEntry;
+    if (traverse_path(fd, &sb, path, &parent_block, &final_token) < 0 || !final_token) {
+        fprintf(stderr, "myclone: Could not resolve path '%s'\n", path);
+        bd_close(fd); free(fsname); free(path);
+        return -1;
+    }
+    if (dir_find_entry(fd, &sb, parent_block, final_token, &srcEntry, &found_block, &entry_index) < 0 ||
+        srcEntry.type != FILE_TYPE) {
+        fprintf(stderr, "myclone: File '%s' not found\n", final_token);
+        bd_close(fd); free(fsname); free(path); free(final_token);
+        return -1;
+    }
+    free(final_token);
+    // Take the new reference while the source directory is still locked, then drop
+    // its lock: the destination is locked from the root down like any other path.
+    if (entry_incref(fd, &sb, &srcEntry) < 0) {
+        bd_close(fd); free(fsname); free(path);
+        return -1;
+    }
+    unlock_all(fd);
+    if (traverse_path_writable(fd, &sb, dstpath, &parent_block, &final_token) < 0 || !final_token) {
+        fprintf(stderr, "myclone: Could not resolve path '%s'\n", dstpath);
+        entry_release(fd, &sb, &srcEntry);
+        bd_close(fd); free(fsname); free(path);
+        return -1;
+    }
+    MyFSEntry existing;
+    if (dir_find_entry(fd, &sb, parent_block, final_token, &existing, &found_block, &entry_index) == 0) {
+        fprintf(stderr, "myclone: '%s' already exists\n", final_token);
+        entry_release(fd, &sb, &srcEntry);
+        bd_close(fd); free(fsname); free(path); free(final_token);
+        return -1;
+    }
+    MyFSEntry new_entry = srcEntry;
+    entry_set_name(&new_entry, final_token);
+    if (dir_insert_entry(fd, &sb, parent_block, &new_entry) < 0) {
+        fprintf(stderr, "myclone: Failed to insert entry\n");
+        entry_release(fd, &sb, &srcEntry);
+        bd_close(fd); free(fsname); free(path); free(final_token);
+        return -1;
+    }
+    superblock_account(fd, &sb, 1, 1);
+    printf("File '%s' cloned to '%s' in filesystem '%s' (shared start block %u).\n",
+           path, dstpath, fsname, new_entry.start_block);
+    bd_close(fd);
+    free(fsname); free(path); free(final_token);
+    return 0;
+}
+
+/*
+ * mydf: Reports block, inode and entry usage of the filesystem in fsfile.
+ * The counters live in the superblock, so this reads one block regardless of
+ * image size. Images formatted before the counters existed fall back to
+ * walking the free chain and cannot report inode or entry counts.
+ */
+int mydf(const char *fsname) {
+    int fd = bd_open(fsname, O_RDONLY, 0);
+    if (fd == -1) {
+        perror("mydf: open fsfile");
+        return -1;
+    }
+    SuperBlock sb;
+    // A shared lock on the superblock gives a consistent set of counters.
+    if (lock_range(fd, 0, sizeof(SuperBlock), F_RDLCK) < 0 || read_superblock(fd, &sb) < 0) {
+        bd_close(fd);
+        return -1;
+    }
+    int counted = sb.version >= MYFS_COUNTERS_VERSION;
+    if (!counted) {
+        sb.free_blocks = 0;
+        uint32_t block = sb.first_free_block, next;
+        off_t tail = (off_t)sb.block_size - sizeof(uint32_t);
+        while (block != 0 && sb.free_blocks < sb.total_blocks) {
+            if (bd_pread(fd, &next, sizeof(next), (off_t)block * sb.block_size + tail) != sizeof(next)) {
+                perror("mydf: walking free chain");
+                bd_close(fd);
+                return -1;
+            }
+            sb.free_blocks++;
+            block = next;
+        }
+        sb.used_blocks = sb.total_blocks - sb.free_blocks;
+    }
+    bd_close(fd);
+    printf("%-16s %10s %10s %10s %5s %10s\n", "Filesystem", "Blocks", "Used", "Free", "Use%", "BlockSize");
+    printf("%-16s %10u %10u %10u %4u%% %10u\n", fsname, sb.total_blocks, sb.used_blocks, sb.free_blocks,
+           sb.total_blocks ? (uint32_t)((uint64_t)sb.used_blocks * 100 / sb.total_blocks) : 0, sb.block_size);
+    if (counted)
+        printf("Inodes: %u  Entries: %u  Snapshots: %u\n", sb.inode_count, sb.entry_count, sb.snap_count);
+    else
+        printf("Inodes: -  Entries: -  Snapshots: %u  (version %u image, free chain walked)\n",
+               sb.snap_count, sb.version);
+    return 0;
+}
+
+typedef struct {
+    uint64_t files, dirs, blocks, extents, fragmented, seek_blocks;
+    uint32_t dir_groups[MYFS_GROUPS];
+} LayoutMetrics;
+
+/*
+ * layout_walk: Adds the placement of everything under the directory headed by
+ * dir_block to the totals in m (see myfrag).
+ */
+static int layout_walk(int fd, SuperBlock *sb, uint32_t dir_block, LayoutMetrics *m) {
+    char *buffer = malloc(sb->block_size);
+    if (!buffer) return -1;
+    int n = ENTRY_PER_BLOCK(sb->block_size);
+    off_t link = sb->block_size - sizeof(uint32_t);
+    for (uint32_t current = dir_block; current != 0; ) {
+        if (read_block(fd, current, buffer, sb->block_size) < 0) {
+            free(buffer);
+            return -1;
+        }
+        MyFSEntry *entries = (MyFSEntry *)buffer;
+        for (int i = 0; i < n; i++) {
+            if (!entries[i].name_len || entries[i].start_block == 0) continue;
+            uint32_t block = entries[i].start_block;
+            if (entries[i].type == DIR_TYPE) {
+                m->dirs++;
+                if (sb->group_blocks) m->dir_groups[block / sb->group_blocks]++;
+                if (layout_walk(fd, sb, block, m) < 0) {
+                    free(buffer);
+                    return -1;
+                }
+                continue;
+            }
+            // Distance from the directory to the file, then every jump inside the chain.
+            m->files++;
+            m->extents++;
+            m->seek_blocks += block > dir_block ? block - dir_block : dir_block - block;
+            int split = 0;
+            while (block != 0) {
+                uint32_t next;
+                if (bd_pread(fd, &next, sizeof(next), (off_t)block * sb->block_size + link) != sizeof(next)) {
+                    perror("myfrag: reading block chain");
+                    free(buffer);
+                    return -1;
+                }
+                m->blocks++;
+                if (next != 0 && next != block + 1) {
+                    m->extents++;
+                    m->seek_blocks += next > block ? next - block - 1 : block + 1 - next;
+                    split = 1;
+                }
+                block = next;
+            }
+            m->fragmented += split;
+        }
+        memcpy(&current, buffer + link, sizeof(uint32_t));
+    }
+    free(buffer);
+    return 0;
+}
+
+/*
+ * myfrag: Reports how the files under the root are laid out: extents (runs of
+ * consecutive blocks), fragmented files, and the seek distance in blocks a
+ * sequential reader covers going from each directory to its files and along
+ * their chains. Also counts the groups that hold directories.
+ */
+int myfrag(const char *fsname) {
+    int fd = bd_open(fsname, O_RDONLY, 0);
+    if (fd == -1) {
+        perror("myfrag: open fsfile");
+        return -1;
+    }
+    SuperBlock sb;
+    if (read_superblock(fd, &sb) < 0) {
+        bd_close(fd);
+        return -1;
+    }
+    LayoutMetrics m;
+    memset(&m, 0, sizeof(m));
+    if (layout_walk(fd, &sb, sb.root_dir_block, &m) < 0) {
+        bd_close(fd);
+        return -1;
+    }
+    bd_close(fd);
+    int groups = 0;
+    for (int g = 0; g < MYFS_GROUPS; g++) groups += m.dir_groups[g] > 0;
+    printf("files=%llu dirs=%llu blocks=%llu extents=%llu fragmented=%llu seek_blocks=%llu dir_groups=%d\n",
+           (unsigned long long)m.files, (unsigned long long)m.dirs, (unsigned long long)m.blocks,
+           (unsigned long long)m.extents, (unsigned long long)m.fragmented,
+           (unsigned long long)m.seek_blocks, groups);
+    return 0;
+}
+
+// ----------------------------------------------------------------
+// Export: whole tree as a tar stream
+// ----------------------------------------------------------------
+
+// Directory headers are written first (they carry no data). Files then follow in
+// order of their first block, and while one file is being written the blocks of
+// the next EXPORT_WINDOW files are read in ascending block order as well, the
+// ones that are not due yet being held in memory (at most EXPORT_BUFFER_BLOCKS).
+#define EXPORT_WINDOW 64
+#define EXPORT_BUFFER_BLOCKS 1024
+#define TAR_BLOCK 512
+
+typedef struct {
+    char *path;                // Path inside the archive (no leading '/')
+    MyFSEntry entry;
+    uint32_t next_block;       // Next chain block to read (0 = chain fully read)
+    uint32_t remaining;        // Chain bytes not read yet
+    char *data;                // Bytes read ahead of the file's turn
+    uint32_t buffered;         // Bytes in data
+    uint32_t buffered_blocks;  // Blocks those bytes came from
+} ExportItem;
+
+typedef struct {
+    ExportItem *items;
+    size_t count, cap;
+} ExportList;
+
+static int export_push(ExportList *list, const char *path, const MyFSEntry *entry) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 64;
+        ExportItem *items = realloc(list->items, cap * sizeof(ExportItem));
+        if (!items) return -1;
+        list->items = items;
+        list->cap = cap;
+    }
+    ExportItem *item = &list->items[list->count];
+    memset(item, 0, sizeof(*item));
+    item->path = strdup(path);
+    if (!item->path) return -1;
+    item->entry = *entry;
+    list->count++;
+    return 0;
+}
+
+/*
+ * export_collect: Appends every directory under dir_block to dirs (parents first)
+ * and every file to files. prefix is the archive path of the directory. Each
+ * subdirectory is read-locked before it is read and stays locked until the image
+ * is closed.
+ */
+static int export_collect(int fd, SuperBlock *sb, uint32_t dir_block, const char *prefix,
+                          ExportList *dirs, ExportList *files) {
+    char *buffer = malloc(sb->block_size);
+    if (!buffer) return -1;
+    int n = ENTRY_PER_BLOCK(sb->block_size);
+    for (uint32_t current = dir_block; current != 0; ) {
+        if (read_block(fd, current, buffer, sb->block_size) < 0) {
+            free(buffer);
+            return -1;
+        }
+        stats.dir_blocks_scanned++;
+        MyFSEntry *entries = (MyFSEntry *)buffer;
+        for (int i = 0; i < n; i++) {
+            if (!entries[i].name_len) continue;
+            char path[PATH_MAX];
+            if (snprintf(path, sizeof(path), "%s%.*s", prefix, entries[i].name_len, entries[i].name) >= (int)sizeof(path)) {
+                fprintf(stderr, "myexport: Path too long under '%s'\n", prefix);
+                free(buffer);
+                return -1;
+            }
+            if (entries[i].type == DIR_TYPE) {
+                strcat(path, "/");
+                if (export_push(dirs, path, &entries[i]) < 0 ||
+                    lock_range(fd, dir_lock_offset(sb, entries[i].start_block), 1, F_RDLCK) < 0 ||
+                    export_collect(fd, sb, entries[i].start_block, path, dirs, files) < 0) {
+                    free(buffer);
+                    return -1;
+                }
+            } else if (export_push(files, path, &entries[i]) < 0) {
+                free(buffer);
+                return -1;
+            }
+        }
+        memcpy(&current, buffer + sb->block_size - sizeof(uint32_t), sizeof(uint32_t));
+    }
+    free(buffer);
+    return 0;
+}
+
+static int export_by_start_block(const void *a, const void *b) {
+    uint32_t x = ((const ExportItem *)a)->entry.start_block;
+    uint32_t y = ((const ExportItem *)b)->entry.start_block;
+    return (x > y) - (x < y);
+}
+
+/*
+ * tar_header: Writes a POSIX ustar header for path. Paths longer than the 100-byte
+ * name field are split at a '/' into the 155-byte prefix field.
+ */
+static int tar_header(FILE *out, const char *path, int is_dir, uint32_t size, time_t mtime) {
+    unsigned char h[TAR_BLOCK];
+    memset(h, 0, sizeof(h));
+    size_t len = strlen(path);
+    const char *name = path;
+    if (len > 100) {
+        const char *split = NULL;
+        for (const char *s = strchr(path, '/'); s && s < path + len - 1; s = strchr(s + 1, '/'))
+            if ((size_t)(s - path) <= 155 && len - (size_t)(s - path) - 1 <= 100) { split = s; break; }
+        if (!split) {
+            fprintf(stderr, "myexport: Path '%s' does not fit in a tar header\n", path);
+            return -1;
+        }
+        memcpy(h + 345, path, split - path);
+        name = split + 1;
+    }
+    memcpy(h, name, strlen(name));
+    snprintf((char *)h + 100, 8, "%07o", is_dir ? 0755 : 0644);
+    snprintf((char *)h + 108, 8, "%07o", 0);
+    snprintf((char *)h + 116, 8, "%07o", 0);
+    snprintf((char *)h + 124, 12, "%011o", is_dir ? 0 : size);
+    snprintf((char *)h + 136, 12, "%011llo", (unsigned long long)mtime);
+    h[156] = is_dir ? '5' : '0';
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    memset(h + 148, ' ', 8);
+    unsigned sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++) sum += h[i];
+    snprintf((char *)h + 148, 8, "%06o", sum);
+    return fwrite(h, 1, sizeof(h), out) == sizeof(h) ? 0 : -1;
+}
+
+/*
+ * export_read_next: Reads the next chain block of item. The data goes straight to
+ * out when the item is the file being written, otherwise into its read-ahead buffer.
+ */
+static int export_read_next(int fd, SuperBlock *sb, ExportItem *item, char *block_buf,
+                            FILE *out, uint32_t *buffered_blocks) {
+    uint32_t payload = sb->block_size - sizeof(uint32_t);
+    if (read_block(fd, item->next_block, block_buf, sb->block_size) < 0) return -1;
+    uint32_t take = item->remaining < payload ? item->remaining : payload;
+    if (out) {
+        if (fwrite(block_buf, 1, take, out) != take) return -1;
+    } else {
+        char *data = realloc(item->data, item->buffered + take);
+        if (!data) return -1;
+        memcpy(data + item->buffered, block_buf, take);
+        item->data = data;
+        item->buffered += take;
+        item->buffered_blocks++;
+        (*buffered_blocks)++;
+    }
+    item->remaining -= take;
+    memcpy(&item->next_block, block_buf + payload, sizeof(uint32_t));
+    if (item->remaining == 0) item->next_block = 0;
+    return 0;
+}
+
+/*
+ * myexport: Writes the whole tree of fsfile (snapshots excluded) as a tar archive
+ * to tarfile, or to stdout when tarfile is "-". Only read locks are taken: the tree
+ * lock (keeping snapshots from being taken or removed) and every directory, held
+ * until the end. A writer needs its parent directory exclusively, so no name is
+ * added or removed and no file freed mid-export, and the archive is a consistent
+ * point-in-time copy. Readers are not held off.
+ */
+int myexport(const char *fsname, const char *tarfile) {
+    static const char zeros[TAR_BLOCK];
+    int fd = bd_open(fsname, O_RDONLY, 0);
+    if (fd == -1) {
+        perror("myexport: open fsfile");
+        return -1;
+    }
+    SuperBlock sb;
+    struct stat st;
+    // The first read only gives the geometry the lock keys depend on; the root may
+    // have moved (copied on write) by the time its lock is held.
+    if (fstat(fd, &st) < 0 || read_superblock(fd, &sb) < 0 ||
+        lock_range(fd, LOCK_TREE_OFF(&sb), 1, F_RDLCK) < 0 ||
+        lock_range(fd, LOCK_ROOT_OFF(&sb), 1, F_RDLCK) < 0 || read_superblock(fd, &sb) < 0) {
+        bd_close(fd);
+        return -1;
+    }
+    FILE *out = strcmp(tarfile, "-") == 0 ? stdout : fopen(tarfile, "wb");
+    if (!out) {
+        perror("myexport: open tarfile");
+        bd_close(fd);
+        return -1;
+    }
+    ExportList dirs = {0}, files = {0};
+    char *block_buf = malloc(sb.block_size);
+    int result = -1;
+    uint32_t buffered_blocks = 0;
+    uint64_t bytes = 0;
+    if (!block_buf || export_collect(fd, &sb, sb.root_dir_block, "", &dirs, &files) < 0)
+        goto out;
+    for (size_t i = 0; i < dirs.count; i++)
+        if (tar_header(out, dirs.items[i].path, 1, 0, st.st_mtime) < 0) goto out;
+
+    qsort(files.items, files.count, sizeof(ExportItem), export_by_start_block);
+    for (size_t i = 0; i < files.count; i++) {
+        ExportItem *f = &files.items[i];
+        f->remaining = f->entry.size - entry_tail_len(&sb, &f->entry);
+        f->next_block = f->remaining ? f->entry.start_block : 0;
+    }
+    for (size_t head = 0; head < files.count; head++) {
+        ExportItem *f = &files.items[head];
+        if (tar_header(out, f->path, 0, f->entry.size, st.st_mtime) < 0) goto out;
+        if (f->buffered && fwrite(f->data, 1, f->buffered, out) != f->buffered) goto out;
+        buffered_blocks -= f->buffered_blocks;
+        free(f->data);
+        f->data = NULL;
+        size_t end = head + EXPORT_WINDOW < files.count ? head + EXPORT_WINDOW : files.count;
+        while (f->next_block != 0) {
+            // Lowest pending block in the window; only the current file once the buffer is full.
+            ExportItem *pick = f;
+            for (size_t k = head + 1; k < end && buffered_blocks < EXPORT_BUFFER_BLOCKS; k++)
+                if (files.items[k].next_block && files.items[k].next_block < pick->next_block)
+                    pick = &files.items[k];
+            if (export_read_next(fd, &sb, pick, block_buf, pick == f ? out : NULL, &buffered_blocks) < 0)
+                goto out;
+        }
+        uint32_t tail_len = entry_tail_len(&sb, &f->entry);
+        if (tail_len > 0 &&
+            (frag_read(fd, &sb, f->entry.tail_block, f->entry.tail_offset, block_buf, tail_len) < 0 ||
+             fwrite(block_buf, 1, tail_len, out) != tail_len))
+            goto out;
+        uint32_t pad = (TAR_BLOCK - f->entry.size % TAR_BLOCK) % TAR_BLOCK;
+        if (fwrite(zeros, 1, pad, out) != pad) goto out;
+        bytes += f->entry.size;
+    }
+    // End of archive: two zero records.
+    for (int i = 0; i < 2; i++)
+        if (fwrite(zeros, 1, TAR_BLOCK, out) != TAR_BLOCK) goto out;
+    if (fflush(out) == 0) result = 0;
+out:
+    if (result < 0) fprintf(stderr, "myexport: Export of '%s' failed\n", fsname);
+    else fprintf(stderr, "Exported %zu files (%llu bytes) and %zu directories from '%s'.\n",
+                 files.count, (unsigned long long)bytes, dirs.count, fsname);
+    for (size_t i = 0; i < dirs.count; i++) free(dirs.items[i].path);
+    for (size_t i = 0; i < files.count; i++) {
+        free(files.items[i].path);
+        free(files.items[i].data);
+    }
+    free(dirs.items);
+    free(files.items);
+    free(block_buf);
+    if (out != stdout) fclose(out);
+    bd_close(fd);
+    return result;
+}
+
+// ----------------------------------------------------------------
+// myfsd: read-only image server
+// ----------------------------------------------------------------
+
+// myfsd serves one image to local processes over a UNIX stream socket. A request is
+// one line; the reply is "OK <n>\n" followed by n bytes, or "ERR <message>\n".
+//   stat <path>              mystat text
+//   list <path>              one "<d|f> <size> <name>" line per entry
+//   read <path>              the file contents
+//   readBlock <path> <n>     block n of the file, block_size bytes (as myreadBlock)
+// The main thread only accepts connections and waits for input (epoll, one-shot per
+// connection); a pool of workers reads and answers requests. All workers share one
+// block cache and one dentry cache, both set-associative with a mutex per group of
+// sets. Every request re-reads the superblock: every mutating command bumps its
+// modification counter after its last write, and a new counter value starts a new
+// cache generation and so invalidates everything cached before.
+#define FSD_WAYS 8
+#define FSD_LOCKS 64
+#define FSD_DEFAULT_CACHE_MB 64
+#define FSD_DENTRY_SETS 4096
+#define FSD_MAX_LINE 512
+
+typedef struct {
+    uint32_t block;
+    uint32_t generation;       // 0 = empty way
+    uint64_t last_use;
+} FsdBlockTag;
+
+typedef struct {
+    uint32_t parent;           // Head block of the directory holding the entry
+    uint32_t generation;       // 0 = empty way
+    uint64_t last_use;
+    MyFSEntry entry;           // name_hash, name_len and name form the rest of the key
+} FsdDentry;
+
+typedef struct FsdConn {
+    int fd;
+    size_t len;                // Bytes of an unfinished request line in buf
+    char buf[FSD_MAX_LINE];
+    struct FsdConn *next;      // Work queue link
+} FsdConn;
+
+typedef struct {
+    int fd;                    // Image, opened read-only
+    int epfd;
+    uint32_t block_size;       // Geometry the caches were sized for
+    uint32_t total_blocks;
+    pthread_mutex_t sb_lock;
+    SuperBlock sb;             // Superblock of the current generation
+    uint32_t generation;
+    uint32_t nsets;
+    FsdBlockTag *tags;         // nsets * FSD_WAYS
+    char *blocks;              // Block data, same layout as tags
+    pthread_mutex_t block_locks[FSD_LOCKS];
+    FsdDentry *dentries;       // FSD_DENTRY_SETS * FSD_WAYS
+    pthread_mutex_t dentry_locks[FSD_LOCKS];
+    uint64_t tick;
+    uint64_t block_hits, block_misses, dentry_hits, dentry_misses, requests;
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_cond;
+    FsdConn *queue_head, *queue_tail;
+} FsdServer;
+
+static volatile sig_atomic_t fsd_stop;
+
+static void fsd_on_signal(int sig) {
+    (void)sig;
+    fsd_stop = 1;
+}
+
+/*
+ * fsd_refresh: Re-reads the superblock; a new modification count starts a new cache
+ * generation. Copies the current superblock to *sb and returns its generation, or 0
+ * on error.
+ */
+static uint32_t fsd_refresh(FsdServer *srv, SuperBlock *sb) {
+    SuperBlock now;
+    // Plain pread: the server never locks, so blockdev's page cache would keep the first copy.
+    if (pread(srv->fd, &now, sizeof(now), 0) != sizeof(now)) return 0;
+    pthread_mutex_lock(&srv->sb_lock);
+    if (now.mod_count != srv->sb.mod_count) {
+        srv->sb = now;
+        if (++srv->generation == 0) srv->generation = 1;
+        bd_invalidate(srv->fd);
+    }
+    uint32_t gen = srv->generation;
+    *sb = srv->sb;
+    pthread_mutex_unlock(&srv->sb_lock);
+    if (sb->block_size != srv->block_size || sb->total_blocks != srv->total_blocks || sb->version < MYFS_MIN_VERSION || sb->version > MYFS_VERSION)
+        return 0;
+    return gen;
+}
+
+/*
+ * fsd_read_block: Copies block into buf from the shared cache, reading the image on a miss.
+ */
+static int fsd_read_block(FsdServer *srv, uint32_t gen, uint32_t block, char *buf) {
+    uint32_t bs = srv->block_size;
+    uint32_t set = block % srv->nsets;
+    pthread_mutex_t *lock = &srv->block_locks[set % FSD_LOCKS];
+    FsdBlockTag *tags = &srv->tags[(size_t)set * FSD_WAYS];
+    char *data = srv->blocks + (size_t)set * FSD_WAYS * bs;
+    pthread_mutex_lock(lock);
+    for (int w = 0; w < FSD_WAYS; w++) {
+        if (tags[w].generation == gen && tags[w].block == block) {
+            memcpy(buf, data + (size_t)w * bs, bs);
+            tags[w].last_use = __atomic_add_fetch(&srv->tick, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(lock);
+            __atomic_add_fetch(&srv->block_hits, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(lock);
+    __atomic_add_fetch(&srv->block_misses, 1, __ATOMIC_RELAXED);
+    if (block >= srv->total_blocks || bd_pread(srv->fd, buf, bs, (off_t)block * bs) != (ssize_t)bs)
+        return -1;
+    // Replace a stale way if there is one, else the least recently used.
+    pthread_mutex_lock(lock);
+    int victim = 0;
+    for (int w = 0; w < FSD_WAYS; w++) {
+        if (tags[w].generation != gen) { victim = w; break; }
+        if (tags[w].last_use < tags[victim].last_use) victim = w;
+    }
+    memcpy(data + (size_t)victim * bs, buf, bs);
+    tags[victim].block = block;
+    tags[victim].generation = gen;
+    tags[victim].last_use = __atomic_add_fetch(&srv->tick, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(lock);
+    return 0;
+}
+
+/*
+ * fsd_lookup: Finds name in the directory headed by dir_block, through the dentry cache.
+ * buf is a block-sized scratch buffer. Returns 0 and sets *entry if found.
+ */
+static int fsd_lookup(FsdServer *srv, uint32_t gen, uint32_t dir_block, const char *name,
+                      MyFSEntry *entry, char *buf) {
+    size_t len = strnlen(name, MAX_NAME_LEN);
+    uint32_t hash = name_hash(name, len);
+    uint32_t set = (dir_block * 2654435761u ^ hash) % FSD_DENTRY_SETS;
+    pthread_mutex_t *lock = &srv->dentry_locks[set % FSD_LOCKS];
+    FsdDentry *ways = &srv->dentries[(size_t)set * FSD_WAYS];
+    pthread_mutex_lock(lock);
+    for (int w = 0; w < FSD_WAYS; w++) {
+        if (ways[w].generation == gen && ways[w].parent == dir_block && ways[w].entry.name_hash == hash &&
+            ways[w].entry.name_len == len && memcmp(ways[w].entry.name, name, len) == 0) {
+            *entry = ways[w].entry;
+            ways[w].last_use = __atomic_add_fetch(&srv->tick, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(lock);
+            __atomic_add_fetch(&srv->dentry_hits, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(lock);
+    __atomic_add_fetch(&srv->dentry_misses, 1, __ATOMIC_RELAXED);
+    int n = ENTRY_PER_BLOCK(srv->block_size);
+    for (uint32_t current = dir_block; current != 0; ) {
+        if (fsd_read_block(srv, gen, current, buf) < 0) return -1;
+        MyFSEntry *entries = (MyFSEntry *)buf;
+        for (int base = 0; base < n; base += 32) {
+            int chunk = (n - base < 32) ? n - base : 32;
+            uint32_t mask = dir_match_candidates(entries + base, chunk, hash, (uint8_t)len);
+            for (; mask; mask &= mask - 1) {
+                int i = base + __builtin_ctz(mask);
+                if (memcmp(entries[i].name, name, len) != 0) continue;
+                *entry = entries[i];
+                pthread_mutex_lock(lock);
+                int victim = 0;
+                for (int w = 0; w < FSD_WAYS; w++) {
+                    if (ways[w].generation != gen) { victim = w; break; }
+                    if (ways[w].last_use < ways[victim].last_use) victim = w;
+                }
+                ways[victim].parent = dir_block;
+                ways[victim].generation = gen;
+                ways[victim].entry = *entry;
+                ways[victim].last_use = __atomic_add_fetch(&srv->tick, 1, __ATOMIC_RELAXED);
+                pthread_mutex_unlock(lock);
+                return 0;
+            }
+        }
+        memcpy(&current, buf + srv->block_size - sizeof(uint32_t), sizeof(uint32_t));
+    }
+    return -1;
+}
+
+/*
+ * fsd_resolve: Resolves an absolute path (snapshots under /.snap) to its entry.
+ * "/" and "/.snap" resolve to a synthesized directory entry for their root.
+ */
+static int fsd_resolve(FsdServer *srv, uint32_t gen, SuperBlock *sb, const char *path,
+                       MyFSEntry *entry, char *buf) {
+    memset(entry, 0, sizeof(*entry));
+    entry->type = DIR_TYPE;
+    entry->start_block = sb->root_dir_block;
+    entry->name_len = 1;
+    entry->name[0] = '/';
+    char pathdup[FSD_MAX_LINE];
+    snprintf(pathdup, sizeof(pathdup), "%s", path);
+    char *saveptr;
+    int first = 1;
+    for (char *token = strtok_r(pathdup, "/", &saveptr); token; token = strtok_r(NULL, "/", &saveptr)) {
+        if (first && strcmp(token, SNAP_DIR_NAME) == 0) {
+            if (sb->snap_dir_block == 0) return -1;
+            entry->start_block = sb->snap_dir_block;
+            entry_set_name(entry, SNAP_DIR_NAME);
+            first = 0;
+            continue;
+        }
+        first = 0;
+        if (entry->type != DIR_TYPE) return -1;
+        if (fsd_lookup(srv, gen, entry->start_block, token, entry, buf) < 0) return -1;
+    }
+    return 0;
+}
+
+static int fsd_send(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int fsd_reply_error(int fd, const char *msg) {
+    char line[FSD_MAX_LINE];
+    int len = snprintf(line, sizeof(line), "ERR %s\n", msg);
+    return fsd_send(fd, line, len);
+}
+
+static int fsd_reply_ok(int fd, const void *data, size_t len) {
+    char line[32];
+    int n = snprintf(line, sizeof(line), "OK %zu\n", len);
+    if (fsd_send(fd, line, n) < 0) return -1;
+    return len ? fsd_send(fd, data, len) : 0;
+}
+
+/*
+ * fsd_handle: Answers one request line. Returns -1 if the connection must be dropped.
+ */
+static int fsd_handle(FsdServer *srv, int fd, char *line, char *buf) {
+    __atomic_add_fetch(&srv->requests, 1, __ATOMIC_RELAXED);
+    char *saveptr;
+    char *op = strtok_r(line, " \t\r", &saveptr);
+    char *path = strtok_r(NULL, " \t\r", &saveptr);
+    char *arg = strtok_r(NULL, " \t\r", &saveptr);
+    if (!op || !path) return fsd_reply_error(fd, "usage: stat|list|read|readBlock <path> [block_no]");
+    SuperBlock sb;
+    uint32_t gen = fsd_refresh(srv, &sb);
+    if (gen == 0) return fsd_reply_error(fd, "image unreadable or reformatted");
+    MyFSEntry entry;
+    if (fsd_resolve(srv, gen, &sb, path, &entry, buf) < 0) return fsd_reply_error(fd, "not found");
+    uint32_t payload = sb.block_size - sizeof(uint32_t);
+    uint32_t tail_len = entry_tail_len(&sb, &entry);
+
+    if (strcmp(op, "stat") == 0) {
+        char text[256];
+        int len = snprintf(text, sizeof(text), "Name: %.*s\nType: %s\nStart Block: %u\nSize: %u bytes\n",
+                           entry.name_len, entry.name, (entry.type == FILE_TYPE) ? "File" : "Directory",
+                           entry.start_block, entry.size);
+        if (entry.tail_block)
+            len += snprintf(text + len, sizeof(text) - len, "Tail: %u bytes in fragment block %u at offset %u\n",
+                            tail_len, entry.tail_block, entry.tail_offset);
+        return fsd_reply_ok(fd, text, len);
+    }
+    if (strcmp(op, "list") == 0) {
+        if (entry.type != DIR_TYPE) return fsd_reply_error(fd, "not a directory");
+        size_t len = 0, cap = 1024;
+        char *text = malloc(cap);
+        int n = ENTRY_PER_BLOCK(sb.block_size);
+        for (uint32_t current = entry.start_block; text && current != 0; ) {
+            if (fsd_read_block(srv, gen, current, buf) < 0) {
+                free(text);
+                return fsd_reply_error(fd, "read error");
+            }
+            MyFSEntry *entries = (MyFSEntry *)buf;
+            for (int i = 0; text && i < n; i++) {
+                if (!entries[i].name_len) continue;
+                if (cap - len < 64) {
+                    char *grown = realloc(text, cap *= 2);
+                    if (!grown) { free(text); text = NULL; break; }
+                    text = grown;
+                }
+                len += snprintf(text + len, cap - len, "%c %u %.*s\n", entries[i].type == DIR_TYPE ? 'd' : 'f',
+                                entries[i].size, entries[i].name_len, entries[i].name);
+            }
+            memcpy(&current, buf + sb.block_size - sizeof(uint32_t), sizeof(uint32_t));
+        }
+        if (!text) return fsd_reply_error(fd, "out of memory");
+        int rc = fsd_reply_ok(fd, text, len);
+        free(text);
+        return rc;
+    }
+    if (entry.type != FILE_TYPE) return fsd_reply_error(fd, "not a file");
+    if (strcmp(op, "read") == 0) {
+        char line_out[32];
+        int n = snprintf(line_out, sizeof(line_out), "OK %u\n", entry.size);
+        if (fsd_send(fd, line_out, n) < 0) return -1;
+        // The size is already promised, so a read error can only drop the connection.
+        uint32_t remaining = entry.size - tail_len;
+        for (uint32_t current = entry.start_block; remaining > 0; ) {
+            if (current == 0 || fsd_read_block(srv, gen, current, buf) < 0) return -1;
+            uint32_t take = remaining < payload ? remaining : payload;
+            if (fsd_send(fd, buf, take) < 0) return -1;
+            remaining -= take;
+            memcpy(&current, buf + payload, sizeof(uint32_t));
+        }
+        if (tail_len > 0) {
+            if (fsd_read_block(srv, gen, entry.tail_block, buf) < 0) return -1;
+            if (fsd_send(fd, buf + entry.tail_offset + sizeof(FragHeader), tail_len) < 0) return -1;
+        }
+        return 0;
+    }
+    if (strcmp(op, "readBlock") == 0) {
+        if (!arg) return fsd_reply_error(fd, "usage: readBlock <path> <block_no>");
+        uint32_t block_no = (uint32_t)strtoul(arg, NULL, 10);
+        if (tail_len > 0 && block_no == (entry.size - tail_len) / payload) {
+            if (fsd_read_block(srv, gen, entry.tail_block, buf) < 0) return fsd_reply_error(fd, "read error");
+            memmove(buf, buf + entry.tail_offset + sizeof(FragHeader), tail_len);
+            memset(buf + tail_len, 0, sb.block_size - tail_len);
+            return fsd_reply_ok(fd, buf, sb.block_size);
+        }
+        uint32_t current = entry.start_block;
+        for (uint32_t i = 0; ; i++) {
+            if (current == 0 || fsd_read_block(srv, gen, current, buf) < 0)
+                return fsd_reply_error(fd, "block chain ended");
+            if (i == block_no) break;
+            memcpy(&current, buf + payload, sizeof(uint32_t));
+        }
+        return fsd_reply_ok(fd, buf, sb.block_size);
+    }
+    return fsd_reply_error(fd, "unknown request");
+}
+
+/*
+ * fsd_serve: Reads what the client has sent and answers every complete line.
+ * Returns 1 while the connection stays open, 0 once it is finished.
+ */
+static int fsd_serve(FsdServer *srv, FsdConn *c, char *buf) {
+    for (;;) {
+        ssize_t n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+        if (n <= 0) return 0;
+        c->len += n;
+        char *start = c->buf, *nl;
+        while ((nl = memchr(start, '\n', c->len - (start - c->buf))) != NULL) {
+            *nl = '\0';
+            if (fsd_handle(srv, c->fd, start, buf) < 0) return 0;
+            start = nl + 1;
+        }
+        c->len -= start - c->buf;
+        memmove(c->buf, start, c->len);
+        if (c->len == sizeof(c->buf)) {
+            fsd_reply_error(c->fd, "request line too long");
+            return 0;
+        }
+    }
+}
+
+static void *fsd_worker(void *arg) {
+    FsdServer *srv = arg;
+    char *buf = malloc(srv->block_size);
+    if (!buf) return NULL;
+    for (;;) {
+        pthread_mutex_lock(&srv->queue_lock);
+        while (!srv->queue_head) pthread_cond_wait(&srv->queue_cond, &srv->queue_lock);
+        FsdConn *c = srv->queue_head;
+        srv->queue_head = c->next;
+        if (!srv->queue_head) srv->queue_tail = NULL;
+        pthread_mutex_unlock(&srv->queue_lock);
+        if (fsd_serve(srv, c, buf)) {
+            // Hand the connection back to epoll for its next request.
+            struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = c };
+            if (epoll_ctl(srv->epfd, EPOLL_CTL_MOD, c->fd, &ev) == 0) continue;
+        }
+        close(c->fd);
+        free(c);
+    }
+    return NULL;
+}
+
+/*
+ * myfsd: Serves fsname read-only on the UNIX socket sockpath until SIGINT or SIGTERM.
+ * workers <= 0 uses one worker per online CPU; cache_mb sizes the block cache.
+ */
+int myfsd(const char *fsname, const char *sockpath, int workers, int cache_mb) {
+    FsdServer *srv = calloc(1, sizeof(FsdServer));
+    if (!srv) return -1;
+    srv->fd = bd_open(fsname, O_RDONLY, 0);
+    if (srv->fd == -1) {
+        perror("myfsd: open fsfile");
+        free(srv);
+        return -1;
+    }
+    if (read_superblock(srv->fd, &srv->sb) < 0) {
+        bd_close(srv->fd); free(srv);
+        return -1;
+    }
+    srv->block_size = srv->sb.block_size;
+    srv->total_blocks = srv->sb.total_blocks;
+    srv->generation = 1;
+    if (workers <= 0) workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers <= 0) workers = 1;
+    if (cache_mb <= 0) cache_mb = FSD_DEFAULT_CACHE_MB;
+    size_t cache_blocks = (size_t)cache_mb * 1024 * 1024 / srv->block_size;
+    srv->nsets = cache_blocks / FSD_WAYS ? cache_blocks / FSD_WAYS : 1;
+    srv->tags = calloc((size_t)srv->nsets * FSD_WAYS, sizeof(FsdBlockTag));
+    srv->blocks = malloc((size_t)srv->nsets * FSD_WAYS * srv->block_size);
+    srv->dentries = calloc((size_t)FSD_DENTRY_SETS * FSD_WAYS, sizeof(FsdDentry));
+    if (!srv->tags || !srv->blocks || !srv->dentries) {
+        fprintf(stderr, "myfsd: Cannot allocate a %d MB cache\n", cache_mb);
+        bd_close(srv->fd);
+        return -1;
+    }
+    pthread_mutex_init(&srv->sb_lock, NULL);
+    for (int i = 0; i < FSD_LOCKS; i++) {
+        pthread_mutex_init(&srv->block_locks[i], NULL);
+        pthread_mutex_init(&srv->dentry_locks[i], NULL);
+    }
+    pthread_mutex_init(&srv->queue_lock, NULL);
+    pthread_cond_init(&srv->queue_cond, NULL);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "myfsd: Socket path too long\n");
+        bd_close(srv->fd);
+        return -1;
+    }
+    strcpy(addr.sun_path, sockpath);
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct stat st;
+    if (lstat(sockpath, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(sockpath);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, SOMAXCONN) < 0) {
+        perror("myfsd: socket");
+        bd_close(srv->fd);
+        return -1;
+    }
+    srv->epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event lev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (srv->epfd < 0 || epoll_ctl(srv->epfd, EPOLL_CTL_ADD, lfd, &lev) < 0) {
+        perror("myfsd: epoll");
+        close(lfd); unlink(sockpath); bd_close(srv->fd);
+        return -1;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = fsd_on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    for (int i = 0; i < workers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, fsd_worker, srv) != 0) {
+            fprintf(stderr, "myfsd: Cannot start worker %d\n", i);
+            close(lfd); unlink(sockpath); bd_close(srv->fd);
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    fprintf(stderr, "myfsd: Serving '%s' on '%s' with %d workers and a %d MB block cache.\n",
+            fsname, sockpath, workers, cache_mb);
+
+    struct epoll_event events[64];
+    while (!fsd_stop) {
+        int n = epoll_wait(srv->epfd, events, 64, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("myfsd: epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            FsdConn *c = events[i].data.ptr;
+            if (c == NULL) {
+                int cfd;
+                while ((cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+                    FsdConn *nc = calloc(1, sizeof(FsdConn));
+                    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = nc };
+                    if (nc) nc->fd = cfd;
+                    if (!nc || epoll_ctl(srv->epfd, EPOLL_CTL_ADD, cfd, &ev) < 0) {
+                        close(cfd);
+                        free(nc);
+                    }
+                }
+                continue;
+            }
+            pthread_mutex_lock(&srv->queue_lock);
+            c->next = NULL;
+            if (srv->queue_tail) srv->queue_tail->next = c;
+            else srv->queue_head = c;
+            srv->queue_tail = c;
+            pthread_cond_signal(&srv->queue_cond);
+            pthread_mutex_unlock(&srv->queue_lock);
+        }
+    }
+    close(lfd);
+    unlink(sockpath);
+    fprintf(stderr, "myfsd: %llu requests, block cache %llu hits / %llu misses, dentry cache %llu hits / %llu misses.\n",
+            (unsigned long long)srv->requests, (unsigned long long)srv->block_hits,
+            (unsigned long long)srv->block_misses, (unsigned long long)srv->dentry_hits,
+            (unsigned long long)srv->dentry_misses);
+    return 0;
+}
+
+/*
+ * myfsdc: Sends one request to a myfsd socket and writes the reply body to stdout.
+ */
+int myfsdc(const char *sockpath, int argc, char *argv[]) {
+    char line[FSD_MAX_LINE];
+    size_t len = 0;
+    for (int i = 0; i < argc; i++) {
+        int n = snprintf(line + len, sizeof(line) - len, i ? " %s" : "%s", argv[i]);
+        if (n < 0 || (size_t)n >= sizeof(line) - len - 1) {
+            fprintf(stderr, "myfsdc: Request too long\n");
+            return -1;
+        }
+        len += n;
+    }
+    line[len++] = '\n';
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sockpath);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("myfsdc: connect");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    FILE *in = fdopen(fd, "r");
+    if (!in || fsd_send(fd, line, len) < 0 || !fgets(line, sizeof(line), in)) {
+        fprintf(stderr, "myfsdc: No reply from '%s'\n", sockpath);
+        if (in) fclose(in); else close(fd);
+        return -1;
+    }
+    unsigned long long size;
+    if (sscanf(line, "OK %llu", &size) != 1) {
+        fprintf(stderr, "myfsdc: %s", line);
+        fclose(in);
+        return -1;
+    }
+    char chunk[8192];
+    while (size > 0) {
+        size_t want = size < sizeof(chunk) ? size : sizeof(chunk);
+        size_t got = fread(chunk, 1, want, in);
+        if (got == 0) break;
+        fwrite(chunk, 1, got, stdout);
+        size -= got;
+    }
+    fclose(in);
+    if (size > 0) {
+        fprintf(stderr, "myfsdc: Reply truncated\n");
+        return -1;
+    }
+    return 0;
+}
+
+// ----------------------------------------------------------------
+// Main: Command Dispatch
+// ----------------------------------------------------------------
+int run_command(int argc, char *argv[]);
+
+/*
+ * mybatch: Runs one command per line of cmdfile ("-" for stdin) in this process,
+ * written as on the command line without the program name. The dentry cache is
+ * on, so directories shared by many paths are searched once. Lines are split on
+ * whitespace; blank lines and lines starting with '#' are skipped. Every line is
+ * run even if an earlier one fails; returns 0 only if all of them succeeded.
+ */
+int mybatch(char *prog, const char *cmdfile) {
+    FILE *in = strcmp(cmdfile, "-") == 0 ? stdin : fopen(cmdfile, "r");
+    if (!in) {
+        perror("mybatch: open command file");
+        return -1;
+    }
+    if (dcache_enable() < 0) {
+        fprintf(stderr, "mybatch: Cannot allocate the dentry cache\n");
+        if (in != stdin) fclose(in);
+        return -1;
+    }
+    char line[4096];
+    int lineno = 0, failed = 0;
+    while (fgets(line, sizeof(line), in)) {
+        lineno++;
+        char *argv[64];
+        int argc = 0;
+        argv[argc++] = prog;
+        char *saveptr;
+        for (char *tok = strtok_r(line, " \t\r\n", &saveptr); tok && argc < 63; tok = strtok_r(NULL, " \t\r\n", &saveptr))
+            argv[argc++] = tok;
+        argv[argc] = NULL;
+        if (argc == 1 || argv[1][0] == '#') continue;
+        if (strcmp(argv[1], "mybatch") == 0) {
+            fprintf(stderr, "mybatch: line %d: Batches cannot be nested\n", lineno);
+            failed++;
+            continue;
+        }
+        if (run_command(argc, argv) != 0) {
+            fprintf(stderr, "mybatch: line %d: %s failed\n", lineno, argv[1]);
+            failed++;
+        }
+    }
+    if (in != stdin) fclose(in);
+    return failed ? -1 : 0;
+}
+
+/*
+ * run_command: Runs one command line (argv[0] is the program name). Returns 0 on
+ * success and -1 on any failure, usage errors included; it never exits, so a bad
+ * line in a batch only fails that line.
+ */
+int run_command(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr,
+        "Usage:\n"
+        "  %s [--stats] <command> ...  (or set MYFS_STATS=1; MYFS_ALLOC=group|chain picks block placement)\n"
+        "  %s mymkfs <fsfile> <block_size> <no_of_blocks>\n"
+        "  %s mycopyTo <linuxfile> <myfile_path>@<fsfile>\n"
+        "  %s mycopyFrom <myfile_path>@<fsfile> <linuxfile>\n"
+        "  %s myrm <myfile_path>@<fsfile>\n"
         "  %s mymkdir <dir_path>@<fsfile>\n"
         "  %s myrmdir <dir_path>@<fsfile>\n"
         "  %s myreadBlock <myfile_path>@<fsfile> <buf> <block_no>\n"
-        "  %s mystat <path>@<fsfile>\n",
-        argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
-        exit(1);
+        "  %s mystat <path>@<fsfile>\n"
+        "  %s mysnapshot <name>@<fsfile>\n"
+        "  %s myrmsnapshot <name>@<fsfile>\n"
+        "  %s myclone <myfile_path>@<fsfile> <new_path>\n"
+        "  %s mydf <fsfile>\n"
+        "  %s myfrag <fsfile>\n"
+        "  %s myexport <fsfile> <tarfile|->\n"
+        "  %s mybatch <cmdfile|->\n"
+        "  %s myfsd <fsfile> <socket> [workers] [cache_mb]\n"
+        "  %s myfsdc <socket> stat|list|read|readBlock <path> [block_no]\n",
+        argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
+        argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+        return -1;
     }
     
     if (strcmp(argv[1], "mymkfs") == 0) {
         if (argc != 5) {
             fprintf(stderr, "Usage: %s mymkfs <fsfile> <block_size> <no_of_blocks>\n", argv[0]);
-            exit(1);
+            return -1;
         }
-        int bs = atoi(argv[3]);
-        int nblocks = atoi(argv[4]);
-        return mymkfs(argv[2], bs, nblocks);
+        // strtol, not atoi: a count past INT_MAX must be refused, not wrapped.
+        char *end3, *end4;
+        errno = 0;
+        long bs = strtol(argv[3], &end3, 10);
+        long nblocks = strtol(argv[4], &end4, 10);
+        if (errno || *end3 || *end4 || end3 == argv[3] || end4 == argv[4] || bs > INT_MAX || nblocks > INT_MAX) {
+            fprintf(stderr, "mymkfs: Invalid block size or block count\n");
+            return -1;
+        }
+        return mymkfs(argv[2], (int)bs, (int)nblocks);
     }
     else if (strcmp(argv[1], "mycopyTo") == 0) {
         if (argc != 4) {
             fprintf(stderr, "Usage: %s mycopyTo <linuxfile> <myfile_path>@<fsfile>\n", argv[0]);
-            exit(1);
+            return -1;
         }
         return mycopyTo(argv[2], argv[3]);
     }
     else if (strcmp(argv[1], "mycopyFrom") == 0) {
         if (argc != 4) {
             fprintf(stderr, "Usage: %s mycopyFrom <myfile_path>@<fsfile> <linuxfile>\n", argv[0]);
-            exit(1);
+            return -1;
         }
         return mycopyFrom(argv[2], argv[3]);
     }
     else if (strcmp(argv[1], "myrm") == 0) {
         if (argc != 3) {
             fprintf(stderr, "Usage: %s myrm <myfile_path>@<fsfile>\n", argv[0]);
-            exit(1);
+            return -1;
         }
         return myrm(argv[2]);
     }
     else if (strcmp(argv[1], "mymkdir") == 0) {
         if (argc != 3) {
             fprintf(stderr, "Usage: %s mymkdir <dir_path>@<fsfile>\n", argv[0]);
-            exit(1);
+            return -1;
         }
         return mymkdir(argv[2]);
     }
     else if (strcmp(argv[1], "myrmdir") == 0) {
         if (argc != 3) {
             fprintf(stderr, "Usage: %s myrmdir <dir_path>@<fsfile>\n", argv[0]);
-            exit(1);
+            return -1;
         }
         return myrmdir(argv[2]);
     }
     else if (strcmp(argv[1], "myreadBlock") == 0) {
         if (argc != 4) {
             fprintf(stderr, "Usage: %s myreadBlock <myfile_path>@<fsfile> <block_no>\n", argv[0]);
-            exit(1);
+            return -1;
         }
         int bno = atoi(argv[3]);
-        char *readbuf = malloc(4096); // For simplicity; ideally, use the fs block size.
-        if (!readbuf) exit(1);
-        if (myreadBlock(argv[2], readbuf, bno) == 0) {
+        // Only the head of the block is printed, so only that much is kept.
+        char readbuf[64];
+        int rc = myreadBlock(argv[2], readbuf, sizeof(readbuf), bno);
+        if (rc == 0) {
             printf("Block %d data (first 64 bytes):\n", bno);
             for (int i = 0; i < 64; i++) {
                 printf("%02X ", (unsigned char)readbuf[i]);
@@ -961,26 +3422,118 @@ int main(int argc, char *argv[]) {
             }
             printf("\n");
         }
-        free(readbuf);
-        return 0;
+        return rc;
     }
     else if (strcmp(argv[1], "mystat") == 0) {
         if (argc != 3) {
             fprintf(stderr, "Usage: %s mystat <path>@<fsfile>\n", argv[0]);
-            exit(1);
+            return -1;
         }
-        char info[256];
-        if (mystat(argv[2], info) == 0) {
+        char info[256] = "";
+        int rc = mystat(argv[2], info);
+        if (rc == 0) {
             printf("%s\n", info);
+        } else if (info[0]) {
+            fprintf(stderr, "%s\n", info);
         }
-        return 0;
+        return rc;
+    }
+    else if (strcmp(argv[1], "mysnapshot") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "Usage: %s mysnapshot <name>@<fsfile>\n", argv[0]);
+            return -1;
+        }
+        return mysnapshot(argv[2]);
+    }
+    else if (strcmp(argv[1], "myrmsnapshot") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "Usage: %s myrmsnapshot <name>@<fsfile>\n", argv[0]);
+            return -1;
+        }
+        return myrmsnapshot(argv[2]);
+    }
+    else if (strcmp(argv[1], "myclone") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, "Usage: %s myclone <myfile_path>@<fsfile> <new_path>\n", argv[0]);
+            return -1;
+        }
+        return myclone(argv[2], argv[3]);
+    }
+    else if (strcmp(argv[1], "mydf") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "Usage: %s mydf <fsfile>\n", argv[0]);
+            return -1;
+        }
+        return mydf(argv[2]);
+    }
+    else if (strcmp(argv[1], "myfrag") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "Usage: %s myfrag <fsfile>\n", argv[0]);
+            return -1;
+        }
+        return myfrag(argv[2]);
+    }
+    else if (strcmp(argv[1], "myexport") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, "Usage: %s myexport <fsfile> <tarfile|->\n", argv[0]);
+            return -1;
+        }
+        return myexport(argv[2], argv[3]);
+    }
+    else if (strcmp(argv[1], "mybatch") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "Usage: %s mybatch <cmdfile|->\n", argv[0]);
+            return -1;
+        }
+        return mybatch(argv[0], argv[2]);
+    }
+    else if (strcmp(argv[1], "myfsd") == 0) {
+        if (argc < 4 || argc > 6) {
+            fprintf(stderr, "Usage: %s myfsd <fsfile> <socket> [workers] [cache_mb]\n", argv[0]);
+            return -1;
+        }
+        return myfsd(argv[2], argv[3], argc > 4 ? atoi(argv[4]) : 0, argc > 5 ? atoi(argv[5]) : 0);
+    }
+    else if (strcmp(argv[1], "myfsdc") == 0) {
+        if (argc < 5) {
+            fprintf(stderr, "Usage: %s myfsdc <socket> stat|list|read|readBlock <path> [block_no]\n", argv[0]);
+            return -1;
+        }
+        return myfsdc(argv[2], argc - 3, argv + 3);
     }
     else {
         fprintf(stderr, "Unknown command: %s\n", argv[1]);
-        exit(1);
+        return -1;
     }
     
     return 0;
 }
 
+/*
+ * main: Strips an optional leading --stats, runs the command and, when statistics
+ * are enabled, prints them as JSON on stderr.
+ */
+int main(int argc, char *argv[]) {
+    const char *env = getenv("MYFS_STATS");
+    stats.enabled = env && *env && strcmp(env, "0") != 0;
+    if (argc > 1 && strcmp(argv[1], "--stats") == 0) {
+        stats.enabled = 1;
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+    env = getenv("MYFS_ALLOC");
+    if (env && strcmp(env, "chain") == 0) {
+        alloc_policy = ALLOC_CHAIN;
+    } else if (env && *env && strcmp(env, "group") != 0) {
+        fprintf(stderr, "MYFS_ALLOC must be 'group' or 'chain'\n");
+        return 1;
+    }
+    uint64_t start = stats_now_ns();
+    int status = run_command(argc, argv);
+    if (stats.enabled)
+        stats_print(stderr, argc > 1 ? argv[1] : "", status, stats_now_ns() - start);
+    return status;
+}
+
 
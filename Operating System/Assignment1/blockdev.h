@@ -0,0 +1,372 @@
+/* Filename: blockdev.h */
+
+/* Block device layer shared by the filesystem tools of Assignments 8.1, 8.3
+   and 8.4.
+
+   A tool opens its image with bd_open and then does all image I/O through
+   bd_pread, bd_pwrite, bd_pwritev and bd_sync, passing the descriptor it
+   got back; the descriptor stays a plain file descriptor, so fcntl locks,
+   fstat and mmap on it keep working. How the bytes move is chosen once per
+   process by the BLOCKDEV environment variable:
+
+     pread    pread/pwrite on the descriptor (the default)
+     mmap     memcpy to and from a shared mapping of the image as it was when
+              opened; accesses past the mapping (the image grew) use pread
+     direct   O_DIRECT on a second descriptor for accesses whose offset and
+              length are multiples of BD_ALIGN (through an aligned bounce
+              buffer if the caller's buffer is not), buffered I/O on the first
+              descriptor otherwise, so small updates never read-modify-write
+              a sector behind another process's lock
+
+   A backend that cannot be set up for an image (mmap of an empty or
+   write-only file, O_DIRECT on a filesystem without it) falls back to pread.
+
+   BLOCKDEV_CACHE=<pages> adds a direct-mapped, write-through cache of
+   BD_PAGE-byte pages that serves reads lying within one page. It only sees
+   this process's writes: tools that share an image between processes call
+   bd_invalidate after taking a lock. BLOCKDEV_STATS=1 prints the counters in
+   bd_stats on stderr when the process exits. */
+
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define BD_MAX_FDS 1024       // descriptors at or above this are passed straight through
+#define BD_ALIGN 4096         // O_DIRECT offset, length and buffer alignment
+#define BD_PAGE 4096          // cache granularity
+
+#define BD_PREAD 0
+#define BD_MMAP 1
+#define BD_DIRECT 2
+
+typedef struct {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t syncs;
+} BlockDevStats;
+
+typedef struct {
+    int backend;
+    int dfd;                  // O_DIRECT descriptor, -1 unless backend is BD_DIRECT
+    char *map;                // shared mapping, NULL unless backend is BD_MMAP
+    size_t map_len;
+    int map_writable;
+    int slots;                // cache pages, 0 = no cache
+    uint64_t *keys;           // page number + 1 held by each slot, 0 = empty
+    char *pages;
+    uint64_t wseq;            // writes so far; a miss is only cached if none raced it
+    pthread_mutex_t lock;
+} BlockDev;
+
+static BlockDev *bd_devs[BD_MAX_FDS];
+static BlockDevStats bd_stats;
+static int bd_backend = -1;   // from BLOCKDEV, read on the first bd_open
+
+static inline const char *bd_backend_name(int backend) {
+    return backend == BD_MMAP ? "mmap" : backend == BD_DIRECT ? "direct" : "pread";
+}
+
+static inline void bd_count(uint64_t *counter, uint64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+// bd_report: prints bd_stats as one line (registered with atexit by BLOCKDEV_STATS=1)
+static inline void bd_report(void) {
+    fprintf(stderr, "blockdev: backend=%s reads=%llu writes=%llu bytes_read=%llu bytes_written=%llu "
+            "cache_hits=%llu cache_misses=%llu syncs=%llu\n", bd_backend_name(bd_backend),
+            (unsigned long long)bd_stats.reads, (unsigned long long)bd_stats.writes,
+            (unsigned long long)bd_stats.bytes_read, (unsigned long long)bd_stats.bytes_written,
+            (unsigned long long)bd_stats.cache_hits, (unsigned long long)bd_stats.cache_misses,
+            (unsigned long long)bd_stats.syncs);
+}
+
+static inline void bd_configure(void) {
+    const char *name = getenv("BLOCKDEV");
+    bd_backend = BD_PREAD;
+    if (name && strcmp(name, "mmap") == 0)
+        bd_backend = BD_MMAP;
+    else if (name && strcmp(name, "direct") == 0)
+        bd_backend = BD_DIRECT;
+    else if (name && *name && strcmp(name, "pread") != 0)
+        fprintf(stderr, "blockdev: unknown BLOCKDEV '%s', using pread\n", name);
+    const char *report = getenv("BLOCKDEV_STATS");
+    if (report && *report && strcmp(report, "0") != 0)
+        atexit(bd_report);
+}
+
+// bd_open: open(2) for an image; the result is used with the other bd_ calls
+static inline int bd_open(const char *path, int flags, mode_t mode) {
+    int fd = open(path, flags, mode);
+    if (fd < 0 || fd >= BD_MAX_FDS)
+        return fd;
+    if (bd_backend < 0)
+        bd_configure();
+    BlockDev *dev = calloc(1, sizeof(BlockDev));
+    if (!dev)
+        return fd;            // unmanaged: plain pread/pwrite
+    dev->backend = BD_PREAD;
+    dev->dfd = -1;
+    pthread_mutex_init(&dev->lock, NULL);
+
+    int readable = (flags & O_ACCMODE) != O_WRONLY;
+    struct stat st;
+    if (bd_backend == BD_MMAP && readable && fstat(fd, &st) == 0 && st.st_size > 0) {
+        int prot = (flags & O_ACCMODE) == O_RDONLY ? PROT_READ : PROT_READ | PROT_WRITE;
+        void *map = mmap(NULL, (size_t)st.st_size, prot, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            dev->backend = BD_MMAP;
+            dev->map = map;
+            dev->map_len = (size_t)st.st_size;
+            dev->map_writable = prot & PROT_WRITE;
+        }
+    }
+#ifdef O_DIRECT
+    if (bd_backend == BD_DIRECT) {
+        dev->dfd = open(path, (flags & ~(O_CREAT | O_EXCL | O_TRUNC)) | O_DIRECT);
+        if (dev->dfd >= 0)
+            dev->backend = BD_DIRECT;
+        else
+            perror("blockdev: O_DIRECT open, using pread");
+    }
+#endif
+
+    const char *cache = getenv("BLOCKDEV_CACHE");
+    int slots = cache ? atoi(cache) : 0;
+    if (slots > 0) {
+        dev->keys = calloc(slots, sizeof(uint64_t));
+        dev->pages = malloc((size_t)slots * BD_PAGE);
+        if (dev->keys && dev->pages) {
+            dev->slots = slots;
+        } else {
+            free(dev->keys);
+            free(dev->pages);
+            dev->keys = NULL;
+            dev->pages = NULL;
+        }
+    }
+    bd_devs[fd] = dev;
+    return fd;
+}
+
+static inline BlockDev *bd_dev(int fd) {
+    return fd >= 0 && fd < BD_MAX_FDS ? bd_devs[fd] : NULL;
+}
+
+static inline int bd_aligned(size_t len, off_t offset) {
+    return (len | (uintptr_t)offset) % BD_ALIGN == 0;
+}
+
+// bd_direct_io: one O_DIRECT transfer; len and offset are multiples of BD_ALIGN
+static inline ssize_t bd_direct_io(BlockDev *dev, void *buf, size_t len, off_t offset, int write) {
+    if ((uintptr_t)buf % BD_ALIGN == 0)
+        return write ? pwrite(dev->dfd, buf, len, offset) : pread(dev->dfd, buf, len, offset);
+    void *bounce;
+    if (posix_memalign(&bounce, BD_ALIGN, len) != 0)
+        return -1;
+    ssize_t n;
+    if (write) {
+        memcpy(bounce, buf, len);
+        n = pwrite(dev->dfd, bounce, len, offset);
+    } else {
+        n = pread(dev->dfd, bounce, len, offset);
+        if (n > 0)
+            memcpy(buf, bounce, n);
+    }
+    free(bounce);
+    return n;
+}
+
+// bd_backend_io: moves the bytes with dev's backend (dev may be NULL)
+static inline ssize_t bd_backend_io(int fd, BlockDev *dev, void *buf, size_t len, off_t offset, int write) {
+    if (dev && dev->backend == BD_MMAP && (!write || dev->map_writable) &&
+        offset >= 0 && (size_t)offset + len <= dev->map_len) {
+        if (write)
+            memcpy(dev->map + offset, buf, len);
+        else
+            memcpy(buf, dev->map + offset, len);
+        return (ssize_t)len;
+    }
+    if (dev && dev->backend == BD_DIRECT && bd_aligned(len, offset))
+        return bd_direct_io(dev, buf, len, offset, write);
+    return write ? pwrite(fd, buf, len, offset) : pread(fd, buf, len, offset);
+}
+
+// bd_pread: pread(2) through the image's backend and cache
+static inline ssize_t bd_pread(int fd, void *buf, size_t len, off_t offset) {
+    BlockDev *dev = bd_dev(fd);
+    bd_count(&bd_stats.reads, 1);
+    uint64_t page = (uint64_t)offset / BD_PAGE;
+    if (!dev || !dev->slots || len == 0 || offset < 0 || (uint64_t)(offset + len - 1) / BD_PAGE != page) {
+        ssize_t n = bd_backend_io(fd, dev, buf, len, offset, 0);
+        if (n > 0)
+            bd_count(&bd_stats.bytes_read, n);
+        return n;
+    }
+
+    size_t within = (size_t)(offset % BD_PAGE);
+    char *slot = dev->pages + (size_t)(page % dev->slots) * BD_PAGE;
+    pthread_mutex_lock(&dev->lock);
+    if (dev->keys[page % dev->slots] == page + 1) {
+        memcpy(buf, slot + within, len);
+        pthread_mutex_unlock(&dev->lock);
+        bd_count(&bd_stats.cache_hits, 1);
+        bd_count(&bd_stats.bytes_read, len);
+        return (ssize_t)len;
+    }
+    uint64_t wseq = dev->wseq;
+    pthread_mutex_unlock(&dev->lock);
+
+    bd_count(&bd_stats.cache_misses, 1);
+    static __thread char fill[BD_PAGE] __attribute__((aligned(BD_ALIGN)));
+    ssize_t n = bd_backend_io(fd, dev, fill, BD_PAGE, (off_t)(page * BD_PAGE), 0);
+    if (n < (ssize_t)within + (ssize_t)len) {
+        // Short page (end of the image) or error: answer without caching.
+        n = bd_backend_io(fd, dev, buf, len, offset, 0);
+        if (n > 0)
+            bd_count(&bd_stats.bytes_read, n);
+        return n;
+    }
+    memcpy(buf, fill + within, len);
+    if (n == BD_PAGE) {
+        pthread_mutex_lock(&dev->lock);
+        if (dev->wseq == wseq) {
+            memcpy(slot, fill, BD_PAGE);
+            dev->keys[page % dev->slots] = page + 1;
+        }
+        pthread_mutex_unlock(&dev->lock);
+    }
+    bd_count(&bd_stats.bytes_read, len);
+    return (ssize_t)len;
+}
+
+// bd_cache_store: copies written bytes into the cached pages they overlap (lock held)
+static inline void bd_cache_store(BlockDev *dev, const void *buf, size_t len, off_t offset) {
+    uint64_t first = (uint64_t)offset / BD_PAGE, last = (uint64_t)(offset + len - 1) / BD_PAGE;
+    for (uint64_t page = first; page <= last; page++) {
+        if (dev->keys[page % dev->slots] != page + 1)
+            continue;
+        uint64_t lo = page * BD_PAGE > (uint64_t)offset ? page * BD_PAGE : (uint64_t)offset;
+        uint64_t hi = (page + 1) * BD_PAGE < (uint64_t)(offset + len) ? (page + 1) * BD_PAGE : (uint64_t)(offset + len);
+        memcpy(dev->pages + (size_t)(page % dev->slots) * BD_PAGE + (lo - page * BD_PAGE),
+               (const char *)buf + (lo - offset), hi - lo);
+    }
+}
+
+// bd_pwrite: pwrite(2) through the image's backend; cached pages are updated
+static inline ssize_t bd_pwrite(int fd, const void *buf, size_t len, off_t offset) {
+    BlockDev *dev = bd_dev(fd);
+    bd_count(&bd_stats.writes, 1);
+    ssize_t n = bd_backend_io(fd, dev, (void *)buf, len, offset, 1);
+    if (n > 0)
+        bd_count(&bd_stats.bytes_written, n);
+    if (!dev || !dev->slots || n <= 0)
+        return n;
+
+    pthread_mutex_lock(&dev->lock);
+    dev->wseq++;
+    bd_cache_store(dev, buf, n, offset);
+    pthread_mutex_unlock(&dev->lock);
+    return n;
+}
+
+// bd_pwritev: pwritev(2) through the image's backend; cached pages are updated
+static inline ssize_t bd_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    BlockDev *dev = bd_dev(fd);
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    bd_count(&bd_stats.writes, 1);
+
+    ssize_t n;
+    if (dev && dev->backend == BD_MMAP && dev->map_writable &&
+        offset >= 0 && (size_t)offset + len <= dev->map_len) {
+        char *to = dev->map + offset;
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(to, iov[i].iov_base, iov[i].iov_len);
+            to += iov[i].iov_len;
+        }
+        n = (ssize_t)len;
+    } else if (dev && dev->backend == BD_DIRECT && bd_aligned(len, offset)) {
+        // Gather into one aligned buffer: O_DIRECT needs every segment aligned.
+        char *bounce;
+        if (posix_memalign((void **)&bounce, BD_ALIGN, len) != 0)
+            return -1;
+        char *to = bounce;
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(to, iov[i].iov_base, iov[i].iov_len);
+            to += iov[i].iov_len;
+        }
+        n = pwrite(dev->dfd, bounce, len, offset);
+        free(bounce);
+    } else {
+        n = pwritev(fd, iov, iovcnt, offset);
+    }
+    if (n > 0)
+        bd_count(&bd_stats.bytes_written, n);
+    if (!dev || !dev->slots || n <= 0)
+        return n;
+
+    pthread_mutex_lock(&dev->lock);
+    dev->wseq++;
+    off_t at = offset;
+    for (int i = 0; i < iovcnt && at < offset + n; at += iov[i++].iov_len) {
+        size_t part = (size_t)(offset + n - at) < iov[i].iov_len ? (size_t)(offset + n - at) : iov[i].iov_len;
+        if (part)
+            bd_cache_store(dev, iov[i].iov_base, part, at);
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return n;
+}
+
+// bd_invalidate: forgets cached pages, which another process may have changed
+static inline void bd_invalidate(int fd) {
+    BlockDev *dev = bd_dev(fd);
+    if (!dev || !dev->slots)
+        return;
+    pthread_mutex_lock(&dev->lock);
+    memset(dev->keys, 0, dev->slots * sizeof(uint64_t));
+    dev->wseq++;
+    pthread_mutex_unlock(&dev->lock);
+}
+
+// bd_sync: waits until the image's data is on disk
+static inline int bd_sync(int fd) {
+    BlockDev *dev = bd_dev(fd);
+    bd_count(&bd_stats.syncs, 1);
+    if (dev && dev->map && msync(dev->map, dev->map_len, MS_SYNC) < 0)
+        return -1;
+    return fdatasync(fd);
+}
+
+// bd_close: close(2) for a descriptor from bd_open
+static inline int bd_close(int fd) {
+    BlockDev *dev = bd_dev(fd);
+    if (dev) {
+        bd_devs[fd] = NULL;
+        if (dev->map)
+            munmap(dev->map, dev->map_len);
+        if (dev->dfd >= 0)
+            close(dev->dfd);
+        pthread_mutex_destroy(&dev->lock);
+        free(dev->keys);
+        free(dev->pages);
+        free(dev);
+    }
+    return close(fd);
+}
+
+#endif
@@ -0,0 +1,433 @@
+#!/bin/bash
+# Filename: fsbench.sh
+#
+# Benchmark driver for the block filesystem assignments:
+#   fs81   Assignment 8.1/solution.c  (bitmap allocator, driven through Assignment 8.1/bench.c)
+#   fs82   Assignment 8.2/*.c         (one tool per command, fixed 2048 x 4096 layout)
+#   myfsv1 Assignment 8.3/myfsv1.c    (command chosen by argv[0])
+#   fs83   Assignment 8.3/solution.c  (chained blocks, root directory only, image always ./dd1)
+#   myfsv2 Assignment 8.4/myfsv2.c    (chained blocks with directories)
+#
+# Workloads (skipped for tools that cannot express them):
+#   mkfs      format an image of FSBENCH_BLOCKS blocks
+#   import    copy FSBENCH_FILES files of FSBENCH_SIZE bytes into the image
+#   bulk      the same import done by one process (fs82 file lists, myfsv2 mybatch)
+#   lookup    FSBENCH_READS stats of a file FSBENCH_DEPTH directories deep
+#   wide      create FSBENCH_WIDE entries in one directory
+#   randread  FSBENCH_READS random reads (myreadBlock for myfsv2, whole files otherwise)
+#   churn     FSBENCH_CHURN remove + re-import cycles of random files
+#   large     copy one FSBENCH_LARGE-byte file in and back out of an image
+#             sized to hold it (fs83 and myfsv2)
+#   serve     min(FSBENCH_READS, 100) cycles of replacing a file served by a
+#             running myfsd with another of the same size and reading it back
+#             through the server; fails if a stale copy is returned (myfsv2)
+#   search    FSBENCH_CHURN free + allocate pairs on an in-memory bitmap of
+#             FSBENCH_BIG blocks, 99% used (fs81: the free-block search alone)
+#   check     100 consistency checks of a half-used image of FSBENCH_BIG
+#             blocks, each after 100 random frees and allocations
+#
+# For myfsv2 a layout report follows: the same aged image (FSBENCH_FILES files
+# of mixed sizes spread over FSBENCH_DIRS directories, then FSBENCH_CHURN
+# remove + re-import cycles) is built under each MYFS_ALLOC placement policy
+# and measured with myfrag: extents per file, fragmented files, and the seek
+# distance in blocks of reading every directory's files in order.
+#
+# For fs81 a scaling report follows: FSBENCH_MTOPS claim/release operations
+# per thread on one shared handle over FSBENCH_BIG blocks, for each thread
+# count in FSBENCH_THREADS. Then a policy report: FSBENCH_SIMOPS events of
+# each synthetic trace replayed by allocsim on FSBENCH_BLOCKS blocks under
+# each placement policy, with latency percentiles, failed allocations and
+# the final fragmentation index.
+#
+# fs81, myfsv1, fs83 and myfsv2 do their image I/O through blockdev.h, so
+# BLOCKDEV=pread|mmap|direct, BLOCKDEV_CACHE and BLOCKDEV_STATS in the
+# environment apply to all of them (fs82 keeps its own pread metadata layer).
+#
+# Every run starts from a fresh image in a scratch directory and uses
+# FSBENCH_SEED for its random choices, so two runs do the same work.
+# Output is one fixed-column line per tool and workload; syscalls are
+# counted with strace -f -c when it is installed ("na" otherwise).
+#
+# Usage: ./fsbench.sh [tool ...]     (default: all tools)
+
+set -u
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+
+BLOCKS=${FSBENCH_BLOCKS:-65536}
+FILES=${FSBENCH_FILES:-1000}
+SIZE=${FSBENCH_SIZE:-4000}
+DEPTH=${FSBENCH_DEPTH:-10}
+WIDE=${FSBENCH_WIDE:-100000}
+READS=${FSBENCH_READS:-1000}
+CHURN=${FSBENCH_CHURN:-1000}
+SEED=${FSBENCH_SEED:-42}
+DIRS=${FSBENCH_DIRS:-8}
+BIG=${FSBENCH_BIG:-1048576}
+MTOPS=${FSBENCH_MTOPS:-1000000}
+THREADS=${FSBENCH_THREADS:-1 2 4 8}
+SIMOPS=${FSBENCH_SIMOPS:-100000}
+LARGE=${FSBENCH_LARGE:-67108864}
+
+BIN=$(mktemp -d)
+WORK=$(mktemp -d)
+trap 'rm -rf "$BIN" "$WORK"' EXIT
+
+# ----------------------------------------------------------------
+# Build
+# ----------------------------------------------------------------
+build() {
+    local a81="$HERE/Assignment 8.1" a82="$HERE/Assignment 8.2" a83="$HERE/Assignment 8.3"
+    "$CC" $CFLAGS -pthread -o "$BIN/bench81" "$a81/bench.c" &&
+    "$CC" $CFLAGS -pthread -o "$BIN/allocsim" "$a81/allocsim.c" &&
+    "$CC" $CFLAGS -o "$BIN/mymkfs82" "$a82/mymkfs.c" &&
+    "$CC" $CFLAGS -pthread -o "$BIN/mycopy_to" "$a82/mycopy_to.c" &&
+    "$CC" $CFLAGS -pthread -o "$BIN/mycopy_from" "$a82/mycopy_from.c" &&
+    "$CC" $CFLAGS -pthread -o "$BIN/myrm82" "$a82/myrm.c" &&
+    mkdir -p "$BIN/v1" && "$CC" $CFLAGS -pthread -o "$BIN/v1/myfsv1" "$a83/myfsv1.c" &&
+    "$CC" $CFLAGS -pthread -o "$BIN/fs83" "$a83/solution.c" &&
+    "$CC" $CFLAGS -pthread -o "$BIN/myfsv2" "$HERE/Assignment 8.4/myfsv2.c" || return 1
+    for cmd in mymkfs mycopyTo mycopyFrom myrm; do
+        ln -sf myfsv1 "$BIN/v1/$cmd"
+    done
+}
+
+# ----------------------------------------------------------------
+# Helpers
+# ----------------------------------------------------------------
+
+# make_files <count> <size>: f1..f<count> in the current directory
+make_files() {
+    local i
+    yes abcdefghijklmnopqrstuvwxyz | head -c "$2" > f1
+    for ((i = 2; i <= $1; i++)); do cp f1 "f$i"; done
+}
+
+min() { echo $(( $1 < $2 ? $1 : $2 )); }
+
+# Deterministic random numbers in [1, $1] from the shared seed.
+rand_seq() {
+    awk -v n="$1" -v c="$2" -v s="$SEED" 'BEGIN { srand(s); for (i = 0; i < c; i++) print int(rand() * n) + 1 }'
+}
+
+# ----------------------------------------------------------------
+# Workloads: <tool>_<workload>_setup prepares the scratch directory
+# (untimed), <tool>_<workload>_run does the measured work and sets
+# OPS and BYTES.
+# ----------------------------------------------------------------
+
+fs81_mkfs_run() {
+    local out
+    out=$("$BIN/bench81" mkfs dd1 4096 "$BLOCKS") || return 1
+    set -- $out
+    OPS=${1#ops=}; BYTES=${2#bytes=}; INNER_NS=${3#ns=}
+}
+fs81_churn_run() {
+    local out
+    out=$("$BIN/bench81" churn dd1 4096 "$BLOCKS" "$CHURN" "$SEED") || return 1
+    set -- $out
+    OPS=${1#ops=}; BYTES=${2#bytes=}; INNER_NS=${3#ns=}
+}
+fs81_search_run() {
+    local out
+    out=$("$BIN/bench81" search "$BIG" 99 "$CHURN" "$SEED" word) || return 1
+    set -- $out
+    OPS=${1#ops=}; BYTES=${2#bytes=}; INNER_NS=${3#ns=}
+}
+
+fs81_check_run() {
+    local out
+    out=$("$BIN/bench81" check dd1 "$BIG" 100 100 "$SEED" incremental) || return 1
+    set -- $out
+    OPS=${1#ops=}; BYTES=${2#bytes=}; INNER_NS=${3#ns=}
+}
+
+fs82_mkfs_run() { "$BIN/mymkfs82" dd1; OPS=1; BYTES=$(stat -c %s dd1); }
+fs82_import_setup() { "$BIN/mymkfs82" dd1; make_files "$(min "$FILES" 2048)" "$(min "$SIZE" 4096)"; }
+fs82_import_run() {
+    local i n=$(min "$FILES" 2048)
+    for ((i = 1; i <= n; i++)); do "$BIN/mycopy_to" "f$i" dd1 || return 1; done
+    OPS=$n; BYTES=$((n * $(min "$SIZE" 4096)))
+}
+fs82_bulk_setup() { fs82_import_setup; }
+fs82_bulk_run() {
+    local n=$(min "$FILES" 2048)
+    seq -f 'f%g' 1 "$n" | "$BIN/mycopy_to" - dd1 || return 1
+    OPS=$n; BYTES=$((n * $(min "$SIZE" 4096)))
+}
+fs82_randread_setup() { fs82_import_setup && fs82_import_run; }
+fs82_randread_run() {
+    local i n=$(min "$FILES" 2048)
+    for i in $(rand_seq "$n" "$READS"); do "$BIN/mycopy_from" "f$i" dd1 || return 1; done
+    OPS=$READS; BYTES=$((READS * $(min "$SIZE" 4096)))
+}
+fs82_churn_setup() { fs82_randread_setup; }
+fs82_churn_run() {
+    local i n=$(min "$FILES" 2048)
+    for i in $(rand_seq "$n" "$CHURN"); do
+        "$BIN/myrm82" "f$i" dd1 && "$BIN/mycopy_to" "f$i" dd1 || return 1
+    done
+    OPS=$((2 * CHURN)); BYTES=$((CHURN * $(min "$SIZE" 4096)))
+}
+
+myfsv1_mkfs_run() { "$BIN/v1/mymkfs" dd1; OPS=1; BYTES=$(stat -c %s dd1); }
+myfsv1_import_setup() { "$BIN/v1/mymkfs" dd1; make_files "$(min "$FILES" 2048)" "$(min "$SIZE" 4096)"; }
+myfsv1_import_run() {
+    local i n=$(min "$FILES" 2048)
+    for ((i = 1; i <= n; i++)); do "$BIN/v1/mycopyTo" "f$i" dd1 || return 1; done
+    OPS=$n; BYTES=$((n * $(min "$SIZE" 4096)))
+}
+myfsv1_randread_setup() { myfsv1_import_setup && myfsv1_import_run; }
+myfsv1_randread_run() {
+    local i n=$(min "$FILES" 2048)
+    for i in $(rand_seq "$n" "$READS"); do "$BIN/v1/mycopyFrom" "f$i@dd1" out || return 1; done
+    OPS=$READS; BYTES=$((READS * $(min "$SIZE" 4096)))
+}
+myfsv1_churn_setup() { myfsv1_randread_setup; }
+myfsv1_churn_run() {
+    local i n=$(min "$FILES" 2048)
+    for i in $(rand_seq "$n" "$CHURN"); do
+        "$BIN/v1/myrm" "f$i@dd1" && "$BIN/v1/mycopyTo" "f$i" dd1 || return 1
+    done
+    OPS=$((2 * CHURN)); BYTES=$((CHURN * $(min "$SIZE" 4096)))
+}
+
+# fs83 keeps all entries in the single root block (4096 / 21 = 195 slots).
+FS83_MAX=195
+fs83_mkfs_run() { "$BIN/fs83" mymkfs dd1 > /dev/null; OPS=1; BYTES=$(stat -c %s dd1); }
+fs83_import_setup() { "$BIN/fs83" mymkfs dd1 > /dev/null; make_files 1 "$SIZE"; }
+fs83_import_run() {
+    local i n=$(min "$FILES" $FS83_MAX)
+    for ((i = 1; i <= n; i++)); do "$BIN/fs83" mycopyto f1 "f$i" > /dev/null || return 1; done
+    OPS=$n; BYTES=$((n * SIZE))
+}
+fs83_randread_setup() { fs83_import_setup && fs83_import_run; }
+fs83_randread_run() {
+    local i n=$(min "$FILES" $FS83_MAX)
+    for i in $(rand_seq "$n" "$READS"); do "$BIN/fs83" mycopyfrom "f$i" out > /dev/null || return 1; done
+    OPS=$READS; BYTES=$((READS * SIZE))
+}
+fs83_churn_setup() { fs83_randread_setup; }
+fs83_churn_run() {
+    local i n=$(min "$FILES" $FS83_MAX)
+    for i in $(rand_seq "$n" "$CHURN"); do
+        "$BIN/fs83" myrm "f$i" > /dev/null && "$BIN/fs83" mycopyto f1 "f$i" > /dev/null || return 1
+    done
+    OPS=$((2 * CHURN)); BYTES=$((CHURN * SIZE))
+}
+
+fs83_large_setup() { head -c "$LARGE" /dev/urandom > big; "$BIN/fs83" mymkfs dd1 $((LARGE / 4092 + 16)) > /dev/null; }
+fs83_large_run() {
+    "$BIN/fs83" mycopyto big big > /dev/null && "$BIN/fs83" mycopyfrom big out > /dev/null || return 1
+    OPS=2; BYTES=$((2 * LARGE))
+}
+
+V2_BS=4096
+myfsv2_mkfs_run() { "$BIN/myfsv2" mymkfs dd1 $V2_BS "$BLOCKS" > /dev/null; OPS=1; BYTES=$((V2_BS * BLOCKS)); }
+myfsv2_import_setup() { "$BIN/myfsv2" mymkfs dd1 $V2_BS "$BLOCKS" > /dev/null; make_files 1 "$SIZE"; }
+myfsv2_import_run() {
+    local i
+    for ((i = 1; i <= FILES; i++)); do "$BIN/myfsv2" mycopyTo f1 "/f$i@dd1" > /dev/null || return 1; done
+    OPS=$FILES; BYTES=$((FILES * SIZE))
+}
+myfsv2_large_setup() { head -c "$LARGE" /dev/urandom > big; "$BIN/myfsv2" mymkfs dd1 $V2_BS $((LARGE / 4000 + 1024)) > /dev/null; }
+myfsv2_large_run() {
+    "$BIN/myfsv2" mycopyTo big /big@dd1 > /dev/null && "$BIN/myfsv2" mycopyFrom /big@dd1 out > /dev/null || return 1
+    OPS=2; BYTES=$((2 * LARGE))
+}
+myfsv2_serve_setup() {
+    "$BIN/myfsv2" mymkfs dd1 $V2_BS "$BLOCKS" > /dev/null
+    yes a | head -c "$SIZE" > a; yes b | head -c "$SIZE" > b
+    "$BIN/myfsv2" mycopyTo a /f@dd1 > /dev/null
+}
+myfsv2_serve_run() {
+    local i n=$(min "$READS" 100) v pid rc=0
+    "$BIN/myfsv2" myfsd dd1 sock > /dev/null 2>&1 & pid=$!
+    for ((i = 0; i < 100; i++)); do [ -S sock ] && break; sleep 0.05; done
+    "$BIN/myfsv2" myfsdc sock read /f > out && cmp -s out a || rc=1
+    for ((i = 1; i <= n && rc == 0; i++)); do
+        v=$([ $((i % 2)) = 1 ] && echo b || echo a)
+        "$BIN/myfsv2" myrm /f@dd1 > /dev/null && "$BIN/myfsv2" mycopyTo "$v" /f@dd1 > /dev/null &&
+        "$BIN/myfsv2" myfsdc sock read /f > out && cmp -s out "$v" || rc=1
+    done
+    kill "$pid"; wait "$pid"
+    OPS=$((3 * n)); BYTES=$((2 * n * SIZE))
+    return $rc
+}
+myfsv2_bulk_setup() { myfsv2_import_setup; }
+myfsv2_bulk_run() {
+    local i
+    for ((i = 1; i <= FILES; i++)); do echo "mycopyTo f1 /f$i@dd1"; done | "$BIN/myfsv2" mybatch - > /dev/null || return 1
+    OPS=$FILES; BYTES=$((FILES * SIZE))
+}
+myfsv2_lookup_setup() {
+    local i p=""
+    "$BIN/myfsv2" mymkfs dd1 $V2_BS "$BLOCKS" > /dev/null
+    for ((i = 1; i <= DEPTH; i++)); do p="$p/d$i"; "$BIN/myfsv2" mymkdir "$p@dd1" > /dev/null; done
+    make_files 1 "$SIZE"
+    "$BIN/myfsv2" mycopyTo f1 "$p/leaf@dd1" > /dev/null
+    LOOKUP_PATH="$p/leaf"
+}
+myfsv2_lookup_run() {
+    local i
+    for ((i = 0; i < READS; i++)); do "$BIN/myfsv2" mystat "$LOOKUP_PATH@dd1" > /dev/null || return 1; done
+    OPS=$READS; BYTES=0
+}
+myfsv2_wide_setup() {
+    "$BIN/myfsv2" mymkfs dd1 $V2_BS $((WIDE / ((V2_BS - 4) / 32) + 64)) > /dev/null
+    "$BIN/myfsv2" mymkdir "/w@dd1" > /dev/null
+    : > empty
+}
+myfsv2_wide_run() {
+    local i
+    for ((i = 1; i <= WIDE; i++)); do "$BIN/myfsv2" mycopyTo empty "/w/e$i@dd1" > /dev/null || return 1; done
+    OPS=$WIDE; BYTES=0
+}
+myfsv2_randread_setup() {
+    "$BIN/myfsv2" mymkfs dd1 $V2_BS "$BLOCKS" > /dev/null
+    yes abcdefghijklmnopqrstuvwxyz | head -c $(( (V2_BS - 4) * READS )) > big
+    "$BIN/myfsv2" mycopyTo big "/big@dd1" > /dev/null
+}
+myfsv2_randread_run() {
+    local i
+    for i in $(rand_seq "$READS" "$READS"); do
+        "$BIN/myfsv2" myreadBlock "/big@dd1" $((i - 1)) > /dev/null || return 1
+    done
+    OPS=$READS; BYTES=$((READS * V2_BS))
+}
+myfsv2_churn_setup() { myfsv2_import_setup && myfsv2_import_run; }
+myfsv2_churn_run() {
+    local i
+    for i in $(rand_seq "$FILES" "$CHURN"); do
+        "$BIN/myfsv2" myrm "/f$i@dd1" > /dev/null && "$BIN/myfsv2" mycopyTo f1 "/f$i@dd1" > /dev/null || return 1
+    done
+    OPS=$((2 * CHURN)); BYTES=$((CHURN * SIZE))
+}
+
+# layout <policy>: ages a myfsv2 image under MYFS_ALLOC=<policy> in the
+# current directory and prints one layout report line.
+layout() {
+    local i d n=0 out
+    export MYFS_ALLOC=$1
+    "$BIN/myfsv2" mymkfs dd1 $V2_BS "$BLOCKS" > /dev/null || return 1
+    for ((d = 1; d <= DIRS; d++)); do "$BIN/myfsv2" mymkdir "/d$d@dd1" > /dev/null || return 1; done
+    # Sizes from a quarter block to four blocks, so files interleave unevenly.
+    for ((i = 1; i <= 4; i++)); do yes abcdefghijklmnopqrstuvwxyz | head -c $((V2_BS * i - V2_BS / 2)) > s$i; done
+    for ((i = 1; i <= FILES; i++)); do
+        "$BIN/myfsv2" mycopyTo "s$((i % 4 + 1))" "/d$((i % DIRS + 1))/f$i@dd1" > /dev/null || return 1
+    done
+    for i in $(rand_seq "$FILES" "$CHURN"); do
+        n=$((n + 1))
+        "$BIN/myfsv2" myrm "/d$((i % DIRS + 1))/f$i@dd1" > /dev/null &&
+        "$BIN/myfsv2" mycopyTo "s$((n % 4 + 1))" "/d$((i % DIRS + 1))/f$i@dd1" > /dev/null || return 1
+    done
+    out=$("$BIN/myfsv2" myfrag dd1) || return 1
+    unset MYFS_ALLOC
+    echo "$out" | awk -v p="$1" '{
+        for (i = 1; i <= NF; i++) { split($i, kv, "="); m[kv[1]] = kv[2] }
+        f = m["files"] ? m["files"] : 1
+        printf "%-8s %9d %9d %9.2f %9.1f %14d %12.1f %10d\n", p, m["files"], m["extents"], m["extents"] / f,
+               100 * m["fragmented"] / f, m["seek_blocks"], m["seek_blocks"] / f, m["dir_groups"]
+    }'
+}
+
+# ----------------------------------------------------------------
+# Driver
+# ----------------------------------------------------------------
+
+# setup <tool>_<workload>: runs the setup step, if any, in the current directory.
+setup() {
+    ! declare -F "$1_setup" > /dev/null || "$1_setup" > /dev/null
+}
+
+# measure <tool> <workload>: prints one report line, or nothing if the
+# tool has no such workload.
+measure() {
+    local fn="$1_$2" dir start end ns syscalls="na"
+    declare -F "${fn}_run" > /dev/null || return 0
+    OPS=0; BYTES=0; INNER_NS=""
+
+    dir="$WORK/$fn"; rm -rf "$dir"; mkdir -p "$dir"; cd "$dir"
+    setup "$fn" || { echo "$1: $2 setup failed" >&2; cd "$WORK"; return 1; }
+    start=$(date +%s%N)
+    "${fn}_run" > /dev/null || { echo "$1: $2 failed" >&2; cd "$WORK"; return 1; }
+    end=$(date +%s%N)
+    ns=${INNER_NS:-$((end - start))}
+
+    if command -v strace > /dev/null; then
+        rm -rf "$dir"/*
+        setup "$fn"
+        export BIN SEED BIG BLOCKS FILES SIZE DEPTH WIDE READS CHURN LARGE V2_BS FS83_MAX LOOKUP_PATH
+        export -f "${fn}_run" min rand_seq
+        strace -f -qq -c -o "$WORK/strace.out" bash -c "${fn}_run" > /dev/null 2>&1
+        syscalls=$(awk '$NF == "total" { print $(NF-2) + 0 }' "$WORK/strace.out")
+    fi
+    cd "$WORK"
+
+    awk -v t="$1" -v w="$2" -v o="$OPS" -v b="$BYTES" -v ns="$ns" -v sc="$syscalls" 'BEGIN {
+        s = ns / 1e9; if (s <= 0) s = 1e-9
+        printf "%-8s %-9s %9d %12d %10.4f %12.1f %9.2f %10s\n", t, w, o, b, s, o / s, b / s / 1048576, sc
+    }'
+}
+
+TOOLS=${*:-fs81 fs82 myfsv1 fs83 myfsv2}
+WORKLOADS="mkfs import bulk lookup wide randread churn large serve search check"
+LOOKUP_PATH=""
+
+build || { echo "fsbench: build failed" >&2; exit 1; }
+
+echo "# fsbench blocks=$BLOCKS files=$FILES size=$SIZE depth=$DEPTH wide=$WIDE reads=$READS churn=$CHURN seed=$SEED big=$BIG large=$LARGE"
+printf "%-8s %-9s %9s %12s %10s %12s %9s %10s\n" tool workload ops bytes seconds ops_per_s mb_per_s syscalls
+for tool in $TOOLS; do
+    for wl in $WORKLOADS; do
+        measure "$tool" "$wl"
+    done
+done
+
+case " $TOOLS " in
+*" fs81 "*)
+    echo
+    echo "# scaling fs81 blocks=$BIG ops_per_thread=$MTOPS cpus=$(nproc)"
+    printf "%-8s %12s %10s %12s %8s\n" threads ops seconds ops_per_s speedup
+    base=""
+    for t in $THREADS; do
+        out=$(cd "$WORK" && "$BIN/bench81" threads dd_mt "$BIG" "$MTOPS" "$t" "$SEED") ||
+            { echo "fs81: threads $t failed" >&2; continue; }
+        set -- $out
+        awk -v t="$t" -v o="${1#ops=}" -v ns="${3#ns=}" -v base="$base" 'BEGIN {
+            r = o / (ns / 1e9); if (base == "") base = r
+            printf "%-8s %12d %10.4f %12.1f %8.2f\n", t, o, ns / 1e9, r, r / base
+        }'
+        [ -n "$base" ] || base=$(awk -v o="${1#ops=}" -v ns="${3#ns=}" 'BEGIN { print o / (ns / 1e9) }')
+    done
+
+    echo
+    echo "# policies fs81 blocks=$BLOCKS events=$SIMOPS"
+    printf "%-8s %-7s %12s %8s %8s %8s %8s\n" trace policy ops_per_s p50_ns p99_ns failed frag
+    for trace in uniform bursty log mixed; do
+        for policy in first next best aligned buddy; do
+            out=$(cd "$WORK" && "$BIN/allocsim" dd_sim "$BLOCKS" "$trace" "$policy" "$SIMOPS" "$SEED" | tail -n 1) ||
+                { echo "fs81: allocsim $trace $policy failed" >&2; continue; }
+            echo "$out" | awk -v t="$trace" -v p="$policy" '{
+                for (i = 1; i <= NF; i++) { split($i, kv, "="); m[kv[1]] = kv[2] }
+                printf "%-8s %-7s %12.1f %8d %8d %8d %8.4f\n", t, p, m["ops_per_s"], m["p50_ns"], m["p99_ns"], m["failed"], m["frag"]
+            }'
+        done
+    done
+    ;;
+esac
+
+case " $TOOLS " in
+*" myfsv2 "*)
+    echo
+    echo "# layout myfsv2 dirs=$DIRS files=$FILES churn=$CHURN"
+    printf "%-8s %9s %9s %9s %9s %14s %12s %10s\n" policy files extents ext_per_f frag_pct seek_blocks seek_per_f dir_groups
+    for policy in group chain; do
+        dir="$WORK/layout_$policy"; mkdir -p "$dir"; cd "$dir"
+        layout "$policy" || echo "myfsv2: layout under $policy failed" >&2
+        cd "$WORK"
+    done
+    ;;
+esac